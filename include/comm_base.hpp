@@ -29,6 +29,7 @@
 #include <atomic>
 
 #include "status_data.hpp"
+#include "utilities.hpp"
 #include "utils.hpp"
 namespace RoverRobotics {
 class CommBase;
@@ -59,4 +60,11 @@ class RoverRobotics::CommBase {
    * @return bool file descriptor state
    */
   virtual bool is_connected() = 0;
+  /*
+   * @brief Pure Virtual Interface to report the health of the link. The
+   * implementation of this function should return counters and states of the
+   * communication device that help diagnosing a degraded link
+   * @return vector of metric name and value pairs
+   */
+  virtual std::vector<std::pair<std::string, double>> metrics() = 0;
 };
\ No newline at end of file
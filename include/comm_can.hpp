@@ -15,13 +15,17 @@ class RoverRobotics::CommCan : public RoverRobotics::CommBase {
    *
    * @param device the device path
    * @param callbackfunction
-   * @param settings
+   * @param settings empty for the defaults, otherwise the socket send buffer
+   * size in bytes (4 bytes, big endian, 0 keeps the kernel default) followed
+   * by the SO_PRIORITY of the frames
    */
   CommCan(const char *device, std::function<void(std::vector<uint8_t>)>,
           std::vector<uint8_t>);
   /*
    * @brief Write data to Can Device
-   * by accepting a vector of unsigned int 32 and convert it to a byte stream
+   * by accepting a vector of unsigned int 32 and convert it to a byte stream.
+   * Never blocks: when the interface queue is full the frame waits in the slot
+   * of its id, replacing an older frame of the same id that still waits
    * @param msg message to convert and write to device
    */
   void write_to_device(std::vector<uint8_t> msg);
@@ -38,8 +42,54 @@ class RoverRobotics::CommCan : public RoverRobotics::CommBase {
    * @return bool file descriptor state
    */
   bool is_connected();
+  /*
+   * @brief Report the controller state and the error counters of the Can
+   * device
+   * @return vector of metric name and value pairs
+   */
+  std::vector<std::pair<std::string, double>> metrics();
+
+  /* fault confinement state of the Can controller, worst last */
+  enum can_state {
+    ERROR_ACTIVE = 0,
+    ERROR_WARNING = 1,
+    ERROR_PASSIVE = 2,
+    BUS_OFF = 3
+  };
 
  private:
+  /*
+   * @brief Update the controller state and the error counters from an error
+   * frame
+   * @param error_frame frame with CAN_ERR_FLAG set
+   */
+  void handle_error_frame(const struct can_frame &error_frame);
+  /*
+   * @brief Try to send a frame without blocking
+   * @param tx_frame frame to send
+   * @return 0 when sent, otherwise the errno of the failed send
+   */
+  int send_frame(const struct can_frame &tx_frame);
+  /*
+   * @brief Send the waiting frames, first deferred first, until the interface
+   * queue is full again. Call with Can_write_mutex_ held
+   */
+  void flush_pending();
+  /*
+   * @brief Hold a frame the interface could not take, newest frame per id
+   * wins and keeps the place of the one it replaces. Call with
+   * Can_write_mutex_ held
+   * @param tx_frame frame to hold
+   */
+  void defer_frame(const struct can_frame &tx_frame);
+
+  /* a frame waiting for room in the interface queue */
+  struct pending_frame {
+    struct can_frame frame;
+    uint32_t sequence; /* order of deferral, the slots are reused */
+    bool valid;
+  };
+
   struct sockaddr_can addr;  // CAN Address
   struct can_frame frame;
   struct can_frame robot_frame;
@@ -49,7 +99,40 @@ class RoverRobotics::CommCan : public RoverRobotics::CommBase {
   int Can_port_;
   const int CAN_MSG_SIZE_ = 9;
   std::atomic<bool> is_connected_;
-  std::mutex Can_write_mutex_;
+  std::atomic<int> can_state_;
+  /* error classes reported by the error frames */
+  std::atomic<uint32_t> bus_off_count_;
+  std::atomic<uint32_t> error_passive_count_;
+  std::atomic<uint32_t> error_warning_count_;
+  std::atomic<uint32_t> restart_count_;
+  std::atomic<uint32_t> protocol_error_count_;
+  std::atomic<uint32_t> ack_error_count_;
+  std::atomic<uint32_t> lost_arbitration_count_;
+  std::atomic<uint32_t> tx_timeout_count_;
+  std::atomic<uint32_t> rx_overflow_count_;
+  std::atomic<uint32_t> transceiver_error_count_;
+  std::atomic<uint32_t> read_error_count_;
+  /* error counters of the controller, when the driver reports them */
+  std::atomic<uint8_t> tx_error_counter_;
+  std::atomic<uint8_t> rx_error_counter_;
+  Utilities::ProfiledMutex Can_write_mutex_{"can_write"};
+  /* one slot per id, enough for every controller on the bus */
+  static const int MAX_PENDING_FRAMES_ = 8;
+  pending_frame pending_frames_[MAX_PENDING_FRAMES_];
+  std::atomic<int> pending_count_;
+  uint32_t next_sequence_;
+  std::atomic<uint32_t> tx_sent_count_;
+  std::atomic<uint32_t> tx_deferred_count_;
+  std::atomic<uint32_t> tx_replaced_count_;
+  std::atomic<uint32_t> tx_dropped_count_;
+  std::atomic<uint32_t> tx_error_count_;
   std::thread Can_read_thread_;
   const int TIMEOUT_MS_ = 1000;  // 1 sec timeout
+  const int READ_ERROR_BACKOFF_MS_ = 10;
+  /* ahead of bulk traffic in the interface queue, highest without
+   * CAP_NET_ADMIN */
+  const int DEFAULT_TX_PRIORITY_ = 6;
+  /* error counter levels of the fault confinement states */
+  const uint8_t ERROR_WARNING_LIMIT_ = 96;
+  const uint8_t ERROR_PASSIVE_LIMIT_ = 128;
 };
@@ -0,0 +1,58 @@
+#pragma once
+#include "comm_base.hpp"
+
+namespace RoverRobotics {
+class CommLockstep;
+}
+class RoverRobotics::CommLockstep : public RoverRobotics::CommBase {
+ public:
+  /*
+   * @brief Constructor For Lockstep Communication
+   * An in-memory device for simulation: nothing is read or written on its own,
+   * the owner injects the received bytes and collects the written ones. No
+   * thread is started.
+   */
+  CommLockstep();
+  /*
+   * @brief Write data to the Lockstep Device
+   * by keeping the message until it is collected
+   * @param msg message to keep
+   */
+  void write_to_device(std::vector<uint8_t> msg);
+  /*
+   * @brief Read data from the Lockstep Device
+   * by handing every injected message to the callback, in order. Returns once
+   * they are all processed instead of looping.
+   * @param callback to process the messages
+   */
+  void read_device_loop(std::function<void(std::vector<uint8_t>)>);
+  /*
+   * @brief Queue a message as if the robot sent it, processed by the next
+   * read_device_loop
+   * @param msg message in the format of the simulated device
+   */
+  void inject(std::vector<uint8_t> msg);
+  /*
+   * @brief Take the messages written since the last call
+   * @return the messages, oldest first
+   */
+  std::vector<std::vector<uint8_t>> take_written();
+  /*
+   * @brief Check if the simulation delivered any message yet
+   * @return bool
+   */
+  bool is_connected();
+  /*
+   * @brief Report the traffic of the Lockstep Device
+   * @return vector of metric name and value pairs
+   */
+  std::vector<std::pair<std::string, double>> metrics();
+
+ private:
+  Utilities::ProfiledMutex lockstep_mutex_{"lockstep"};
+  std::vector<std::vector<uint8_t>> received_;
+  std::vector<std::vector<uint8_t>> written_;
+  std::atomic<bool> is_connected_;
+  std::atomic<uint32_t> rx_count_;
+  std::atomic<uint32_t> tx_count_;
+};
@@ -38,9 +38,14 @@ class RoverRobotics::CommSerial : public RoverRobotics::CommBase {
    * @return bool file descriptor state
    */
   bool is_connected();
+  /*
+   * @brief Report the state of the Serial device
+   * @return vector of metric name and value pairs
+   */
+  std::vector<std::pair<std::string, double>> metrics();
 
  private:
-  std::mutex serial_write_mutex_;
+  Utilities::ProfiledMutex serial_write_mutex_{"serial_write"};
   int read_size_;
   int serial_port_;
   std::atomic<bool> is_connected_;
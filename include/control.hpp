@@ -1,15 +1,20 @@
 #pragma once
 #include <algorithm>
+#include <array>
 #include <chrono>
 #include <cstdint>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <string>
 #include <vector>
 
+#include "utilities.hpp"
+
 #ifdef DEBUG
 #include <ctime>
 #include <sstream>
@@ -21,17 +26,27 @@ namespace Control {
 
 /* classes */
 class PidController;
+template <int WHEELS>
 class SkidRobotMotionController;
 class AlphaBetaFilter;
+class WheelSpeedPredictor;
+class WheelSpeedMpc;
+template <int WHEELS>
+class TachometerOdometry;
+class KinematicCalibrator;
+class TrimEstimator;
+class SlipDetector;
+class PathFollower;
 
 /* datatypes */
 typedef enum {
   OPEN_LOOP = 0,
   TRACTION_CONTROL = 1,
   INDEPENDENT_WHEEL = 2,
+  MODEL_PREDICTIVE = 3,
 } robot_motion_mode_t;
 
-const uint8_t NUM_MOTION_MODES = 3;
+const uint8_t NUM_MOTION_MODES = 4;
 
 struct angular_scaling_params {
   float a_coef;
@@ -46,11 +61,35 @@ struct robot_velocities {
   float angular_velocity;
 };
 
-struct motor_data {
-  float fl;
-  float fr;
-  float rl;
-  float rr;
+/* per-wheel values of a skid steer robot with WHEELS wheels (2, 4, 6 or 8).
+ * Wheels are numbered one axle after the other from the front, the left wheel
+ * of each axle first: {left, right} with 2 wheels, {fl, fr, rl, rr} with 4,
+ * {fl, fr, ml, mr, rl, rr} with 6 */
+template <int WHEELS>
+using wheel_data = std::array<float, WHEELS>;
+
+template <int WHEELS>
+using wheel_counts = std::array<int32_t, WHEELS>;
+
+typedef enum {
+  LEFT_WHEELS = 0,
+  RIGHT_WHEELS = 1,
+} wheel_side_t;
+
+/*
+ * @brief Side of a wheel in the wheel numbering
+ * @param wheel is the index of the wheel
+ */
+constexpr wheel_side_t wheelSide(int wheel) {
+  return static_cast<wheel_side_t>(wheel % 2);
+}
+
+struct odometry_data {
+  double left_distance;
+  double right_distance;
+  double x;
+  double y;
+  double heading;
 };
 
 struct robot_geometry {
@@ -61,6 +100,17 @@ struct robot_geometry {
   float center_of_mass_y_offset;
 };
 
+struct skid_steer_params {
+  float track_expansion; /* growth of the effective wheel base with the
+                            longitudinal spread of the wheels (lateral slip) */
+  float traction_factor; /* ground speed per unit of wheel surface speed
+                            (longitudinal slip) */
+};
+
+/* no slip, the effective wheel base is the geometric wheel base */
+const skid_steer_params IDEAL_SKID_STEER = {.track_expansion = 0,
+                                            .traction_factor = 1};
+
 struct pid_gains {
   double kp;
   double ki;
@@ -68,7 +118,7 @@ struct pid_gains {
 };
 
 struct pid_outputs {
-  std::string name;
+  const char *name;
   double time;
   float dt;
   float pid_output;
@@ -87,16 +137,183 @@ struct pid_output_limits {
   float negmax;
 };
 
+struct pid_tuning {
+  float setpoint_weight_p;       /* share of the setpoint seen by the P term */
+  float setpoint_weight_d;       /* share of the setpoint seen by the D term */
+  float derivative_filter_time;  /* time constant of the D term filter (s) */
+  float antiwindup_gain;         /* back-calculation tracking gain (1/s) */
+  float min_dt;                  /* updates closer than this are skipped (s) */
+  float max_dt;                  /* gaps longer than this restart the pid (s) */
+};
+
+/* derivative on measurement (no kick on setpoint steps), lightly filtered,
+ * with back calculation */
+const pid_tuning DEFAULT_PID_TUNING = {
+    .setpoint_weight_p = 1,
+    .setpoint_weight_d = 0,
+    .derivative_filter_time = 0.02,
+    .antiwindup_gain = 10,
+    .min_dt = 0.0001,
+    .max_dt = std::numeric_limits<float>::max()};
+
+template <int WHEELS>
+struct deadband_compensation {
+  wheel_data<WHEELS> breakaway_duty; /* duty at which each wheel starts to
+                                        turn, 0 leaves it uncompensated */
+  float blend_duty;                  /* requests below this ramp up to the
+                                        breakaway duty instead of jumping to
+                                        it, must be positive when any wheel
+                                        is compensated */
+};
+
+template <int WHEELS>
+const deadband_compensation<WHEELS> NO_DEADBAND_COMPENSATION = {
+    .breakaway_duty = {}, .blend_duty = 0};
+
+typedef enum {
+  ZIEGLER_NICHOLS = 0, /* quarter amplitude decay, fast but oscillatory */
+  TYREUS_LUYBEN = 1,   /* slower, less overshoot and more robust */
+} autotune_rule_t;
+
+struct autotune_params {
+  float wheel_rpm;       /* wheel speed the relay oscillates around */
+  float relay_amplitude; /* duty cycle swing either side of the bias */
+  float hysteresis;      /* rpm band around the target that does not switch */
+  uint8_t cycles;        /* oscillation periods averaged, after the first */
+  autotune_rule_t rule;
+  bool apply;            /* use the gains as soon as the experiment ends */
+};
+
+struct autotune_result {
+  float ultimate_gain;   /* duty cycle per rpm */
+  float ultimate_period; /* s */
+  pid_gains gains;
+};
+
+struct path_point {
+  float x;     /* m, in the frame of the external pose corrections */
+  float y;     /* m */
+  float speed; /* forward speed when passing this point (m/s) */
+};
+
+struct pure_pursuit_params {
+  float min_lookahead;        /* lookahead distance at standstill (m) */
+  float lookahead_time;       /* travel time added to the lookahead (s) */
+  float min_speed;            /* keeps the robot moving until the goal (m/s) */
+  float goal_tolerance;       /* distance to the last point that ends it (m) */
+  float max_angular_velocity; /* rad/s */
+};
+
+const pure_pursuit_params DEFAULT_PURE_PURSUIT = {.min_lookahead = 0.3,
+                                                  .lookahead_time = 1.0,
+                                                  .min_speed = 0.05,
+                                                  .goal_tolerance = 0.05,
+                                                  .max_angular_velocity = 2.0};
+
+struct plant_model {
+  float gain;           /* steady-state wheel rpm per unit of duty cycle */
+  float time_constant;  /* first-order response time of the wheel (s) */
+  float dead_time;      /* delay inherent to the drive itself (s) */
+};
+
+struct mpc_params {
+  float dt;                     /* prediction step, the control period (s) */
+  float tracking_weight;        /* cost of the wheelspeed error */
+  float duty_rate_weight;       /* cost of changing the duty between steps */
+  float max_wheel_acceleration; /* rpm/s */
+  float max_wheel_jerk;         /* rpm/s^2 */
+  float disturbance_gain;       /* (0, 1] filter of the model mismatch */
+  float admm_rho;               /* step of the qp solver */
+  int iterations;               /* qp solver iterations, fixed every tick */
+};
+
+const mpc_params DEFAULT_MPC_PARAMS = {.dt = 0.03,
+                                       .tracking_weight = 1.0,
+                                       .duty_rate_weight = 0.1,
+                                       .max_wheel_acceleration = 2000,
+                                       .max_wheel_jerk = 20000,
+                                       .disturbance_gain = 0.2,
+                                       .admm_rho = 10.0,
+                                       .iterations = 50};
+
+struct traction_params {
+  float slip_threshold;  /* relative speed excess over the slowest wheel of
+                            the side, beyond its usual excess, that is slip */
+  float noise_sigmas;    /* the excess must also stand out of its own noise
+                            by this many standard deviations */
+  float statistics_time; /* time constant of the running excess statistics,
+                            only learned while the wheel grips (s) */
+  float current_ratio;   /* a slipping wheel draws less than this share of
+                            the mean current of its side */
+  float min_current;     /* A, below this the currents are not judged */
+  float min_speed;       /* rpm, below this the side is not judged */
+  float redistribution;  /* [0, 1] share of the duty taken from slipping
+                            wheels that is given to the wheels with grip */
+};
+
+const traction_params DEFAULT_TRACTION_PARAMS = {.slip_threshold = 0.15,
+                                                 .noise_sigmas = 3.0,
+                                                 .statistics_time = 2.0,
+                                                 .current_ratio = 0.8,
+                                                 .min_current = 1.0,
+                                                 .min_speed = 20,
+                                                 .redistribution = 1.0};
+
+struct mpc_timing {
+  float last_solve_time;  /* s */
+  float worst_solve_time; /* s, since the controller was made */
+};
+
 /* useful functions */
 
+/*
+ * @brief Time of the controllers: the steady clock, unless the calling thread
+ * runs in simulated time
+ */
+std::chrono::steady_clock::time_point clockNow();
+
+/*
+ * @brief Run the controllers called from this thread in simulated time, or on
+ * the steady clock again when empty
+ * @param simulated_time is the current simulated time
+ */
+void setSimulatedTime(
+    std::optional<std::chrono::steady_clock::time_point> simulated_time);
+
+/*
+ * @brief Computes the effective wheel base of a skid steer robot, which is the
+ * lateral distance between the instantaneous centers of rotation of the two
+ * sides. Wheels far from the center of rotation (along the robot) scrub
+ * sideways when turning, which makes the robot turn slower than its geometric
+ * wheel base suggests.
+ * @param robot_geometry is a description of the robot geometry
+ * @param skid_steer_params is the slip description of the robot
+ */
+float computeEffectiveWheelBase(robot_geometry robot_geometry,
+                                skid_steer_params skid_steer_params);
+
 /*
  * @brief Translate linear and angular commands into target wheelspeeds based on
  * robot geometery
  * @param target_velocities is the target linear and angular velocities
  * @param robot_geometry is a description of the robot geometry
  */
-motor_data computeSkidSteerWheelSpeeds(robot_velocities target_velocities,
-                                       robot_geometry robot_geometry);
+template <int WHEELS>
+wheel_data<WHEELS> computeSkidSteerWheelSpeeds(
+    robot_velocities target_velocities, robot_geometry robot_geometry);
+
+/*
+ * @brief Translate linear and angular commands into target wheelspeeds with an
+ * instantaneous-center-of-rotation skid steer model
+ * @param target_velocities is the target linear and angular velocities
+ * @param robot_geometry is a description of the robot geometry, including the
+ * center of mass offsets
+ * @param skid_steer_params is the slip description of the robot
+ */
+template <int WHEELS>
+wheel_data<WHEELS> computeSkidSteerWheelSpeeds(
+    robot_velocities target_velocities, robot_geometry robot_geometry,
+    skid_steer_params skid_steer_params);
 
 /*
  * @brief Limit the acceleration and deceleration of the robot (prevent
@@ -133,8 +350,38 @@ robot_velocities scaleAngularCommand(robot_velocities target_velocities,
  * @param wheel_speeds rpm data for each wheel
  * @param robot_geometry is a description of the robot's geometry
  */
+template <int WHEELS>
 robot_velocities computeVelocitiesFromWheelspeeds(
-    motor_data wheel_speeds, robot_geometry robot_geometry);
+    wheel_data<WHEELS> wheel_speeds, robot_geometry robot_geometry);
+
+/*
+ * @brief Computes estimated robot velocities (linear, angular) from wheelspeeds
+ * with an instantaneous-center-of-rotation skid steer model
+ * @param wheel_speeds rpm data for each wheel
+ * @param robot_geometry is a description of the robot's geometry, including
+ * the center of mass offsets
+ * @param skid_steer_params is the slip description of the robot
+ */
+template <int WHEELS>
+robot_velocities computeVelocitiesFromWheelspeeds(
+    wheel_data<WHEELS> wheel_speeds, robot_geometry robot_geometry,
+    skid_steer_params skid_steer_params);
+
+/*
+ * @brief Average of the wheels of one side
+ * @param wheel_values is a value for each wheel
+ * @param side is the side to average
+ */
+template <int WHEELS>
+float averageSide(const wheel_data<WHEELS> &wheel_values, wheel_side_t side);
+
+/*
+ * @brief Give every wheel the value of its side
+ * @param left is the value of the left wheels
+ * @param right is the value of the right wheels
+ */
+template <int WHEELS>
+wheel_data<WHEELS> fillSides(float left, float right);
 
 }  // namespace Control
 
@@ -197,6 +444,40 @@ class Control::PidController {
    */
   float getIntegralErrorLimit();
 
+  /*
+   * @brief set the second generation terms of the PID: setpoint weighting,
+   * derivative filtering, back-calculation anti-windup (engages when the
+   * output limits or trackAppliedOutput clip the output) and time step guards
+   * @param pid_tuning is the set of terms, see DEFAULT_PID_TUNING
+   */
+  void setTuning(pid_tuning pid_tuning);
+
+  /*
+   * @brief get the second generation terms of the PID
+   */
+  pid_tuning getTuning();
+
+  /*
+   * @brief mark the output as an increment which the caller accumulates
+   * (velocity form); an update skipped by min_dt then returns a zero increment
+   * instead of holding the last output
+   * @param incremental is true for the velocity form
+   */
+  void setIncremental(bool incremental);
+
+  /*
+   * @brief report the output which actually reached the plant when something
+   * after the PID limits it further (ie the sum of increments saturating); the
+   * back-calculation bleeds the integrator by the difference
+   * @param applied_output is the applied part of the last output
+   */
+  void trackAppliedOutput(float applied_output);
+
+  /*
+   * @brief clear the integrator, derivative and time bookkeeping
+   */
+  void reset();
+
   /*
    * @brief run the PID loop, compute the PID control output
    * @param target is the desired value
@@ -219,12 +500,21 @@ class Control::PidController {
   float integral_error_;
   float integral_error_limit_;
   float previous_error_;
+  float previous_derivative_signal_;
+  float filtered_derivative_;
+  pid_outputs last_output_;
+  pid_tuning pid_tuning_;
+  bool incremental_;
+  float tracking_dt_;
   float pos_max_output_;
   float neg_max_output_;
   std::chrono::steady_clock::time_point time_last_;
   std::chrono::steady_clock::time_point time_origin_;
 };
 
+/* WHEELS is the number of driven wheels, built for 2, 4, 6 and 8; per-wheel
+ * work (pids, predictors, traction control) scales with it */
+template <int WHEELS>
 class Control::SkidRobotMotionController {
  public:
   /* constructors */
@@ -316,6 +606,18 @@ class Control::SkidRobotMotionController {
    */
   robot_geometry getRobotGeometry();
 
+  /*
+   * @brief set the slip parameters of the skid steer model which is used in
+   * odometry and control
+   * @param skid_steer_params is the slip description of the robot
+   */
+  void setSkidSteerParams(skid_steer_params skid_steer_params);
+
+  /*
+   * @brief get the slip parameters of the skid steer model
+   */
+  skid_steer_params getSkidSteerParams();
+
   /*
    * @brief set the pid gains used in closed-loop control on the wheelspeeds
    * @param pid_gains is the P, I, and D gains
@@ -327,6 +629,49 @@ class Control::SkidRobotMotionController {
    */
   pid_gains getPidGains();
 
+  /*
+   * @brief set the second generation terms used by the wheelspeed pids
+   * (setpoint weighting, derivative filter, anti-windup, dt guards)
+   * @param pid_tuning is the set of terms, see DEFAULT_PID_TUNING
+   */
+  void setPidTuning(pid_tuning pid_tuning);
+
+  /*
+   * @brief get the second generation terms used by the wheelspeed pids
+   */
+  pid_tuning getPidTuning();
+
+  /*
+   * @brief start a relay feedback (Astrom-Hagglund) experiment. Each side is
+   * driven with a duty of bias +/- the relay amplitude, switching as its speed
+   * crosses the target, which makes it oscillate at its ultimate period. The
+   * experiment replaces normal control until it ends, times out or is
+   * stopped; velocity commands are ignored meanwhile. The protocol still has
+   * to keep calling runMotionControl with fresh commands. An oscillation too
+   * small to tell from the hysteresis ends the experiment without a result.
+   * @param autotune_params describes the experiment and the tuning rule
+   * @return false (and nothing started) if the parameters can not produce an
+   * oscillation to tune from
+   */
+  bool startAutotune(autotune_params autotune_params);
+
+  /*
+   * @brief abort a running relay experiment and return to normal control
+   */
+  void stopAutotune();
+
+  /*
+   * @brief get whether a relay experiment is running
+   */
+  bool isAutotuning();
+
+  /*
+   * @brief get the result of the last completed relay experiment. The gains
+   * are for the incremental form of the wheelspeed pids, where the pid output
+   * is added to the duty cycle every control tick.
+   */
+  std::optional<autotune_result> getAutotuneResult();
+
   /*
    * @brief set the max allowable motor duty cycle, not to be exceeded by
    * control loops
@@ -352,6 +697,48 @@ class Control::SkidRobotMotionController {
    */
   float getMotorMinDuty();
 
+  /*
+   * @brief set the static friction feedforward. Nonzero duty requests are
+   * mapped onto [breakaway, max] in their direction so small corrections
+   * still move the wheel, with a linear ramp from zero for requests below the
+   * blend duty. Requests below the min duty are dropped before the mapping.
+   * A compensation without a positive blend duty is ignored.
+   * @param deadband_compensation is the per-wheel breakaway duty and blend
+   */
+  void setDeadbandCompensation(
+      deadband_compensation<WHEELS> deadband_compensation);
+
+  /*
+   * @brief get the static friction feedforward
+   */
+  deadband_compensation<WHEELS> getDeadbandCompensation();
+
+  /*
+   * @brief scale the duty cycles by nominal over measured bus voltage, so a
+   * duty keeps producing the same speed as the battery drains
+   * @param voltage_compensation enables the scaling
+   * @param nominal_voltage is the voltage the duty cycles are referenced to;
+   * with 0 the first settled measurement is used
+   */
+  void setVoltageCompensation(bool voltage_compensation,
+                              float nominal_voltage);
+
+  /*
+   * @brief get whether the duty cycles are scaled by the bus voltage
+   */
+  bool getVoltageCompensation();
+
+  /*
+   * @brief feed a bus voltage measurement from the motor controllers
+   * @param voltage is the measured input voltage (V)
+   */
+  void setBusVoltage(float voltage);
+
+  /*
+   * @brief get the filtered bus voltage (V), 0 before any measurement
+   */
+  float getBusVoltage();
+
   /*
    * @brief set the decay of the PID output, to help it converge to 0 on periods
    * of inactivity (stationary robot)
@@ -387,6 +774,29 @@ class Control::SkidRobotMotionController {
    */
   void setTrim(float left_trim, float right_trim);
 
+  /*
+   * @brief enable or disable automatic trim. While the robot is commanded
+   * straight the left/right speed imbalance is measured (from the injected yaw
+   * rate when fresh, otherwise from the wheels in OPEN_LOOP only, since the
+   * closed loop modes servo the wheels to their trimmed targets) and the trim
+   * is adjusted until the imbalance settles. Disabling keeps the current trim.
+   * @param auto_trim enables the estimator, starting from the current trim
+   * @param max_trim is the largest trim value the estimator may apply
+   */
+  void setAutoTrim(bool auto_trim, float max_trim);
+
+  /*
+   * @brief get whether automatic trim is running
+   */
+  bool getAutoTrim();
+
+  /*
+   * @brief returns the trim value once the automatic trim has settled, which
+   * also ends the automatic trim. Positive values reduce the right side,
+   * negative values reduce the left side.
+   */
+  std::optional<float> takeStableTrim();
+
   /*
    * @brief gets the curvature correction for the left side of the robot
    */
@@ -411,19 +821,135 @@ class Control::SkidRobotMotionController {
    */
   angular_scaling_params getAngularScaling();
 
+  /*
+   * @brief enable or disable the latency compensating (smith) predictor which
+   * runs ahead of the wheel speed loops in the closed-loop modes
+   * @param enabled true to feed the pids the predicted wheelspeeds instead of
+   * the (delayed) measured wheelspeeds
+   */
+  void setLatencyCompensation(bool enabled);
+
+  /*
+   * @brief get whether the latency compensating predictor is enabled
+   */
+  bool getLatencyCompensation();
+
+  /*
+   * @brief set the model of the wheel drive used by the predictor
+   * @param plant_model is the gain, time constant, and dead time of a wheel
+   */
+  void setPlantModel(plant_model plant_model);
+
+  /*
+   * @brief get the model of the wheel drive used by the predictor
+   */
+  plant_model getPlantModel();
+
+  /*
+   * @brief set the measured delay of the communication pipeline, which is
+   * added to the dead time of the plant model
+   * @param feedback_delay is the age of the wheelspeed feedback plus the time
+   * until the next command is sent (s)
+   */
+  void setFeedbackDelay(float feedback_delay);
+
+  /*
+   * @brief get the measured delay of the communication pipeline
+   */
+  float getFeedbackDelay();
+
+  /*
+   * @brief enable or disable the outer yaw-rate loop in TRACTION_CONTROL mode,
+   * which corrects the left/right wheelspeed targets so the measured angular
+   * velocity follows the commanded angular velocity
+   * @param enabled true to run the yaw-rate loop
+   */
+  void setYawRateControl(bool enabled);
+
+  /*
+   * @brief get whether the outer yaw-rate loop is enabled
+   */
+  bool getYawRateControl();
+
+  /*
+   * @brief set the pid gains of the outer yaw-rate loop
+   * @param pid_gains is the P, I, and D gains (output is rad/s of correction)
+   */
+  void setYawRatePidGains(pid_gains pid_gains);
+
+  /*
+   * @brief get the pid gains of the outer yaw-rate loop
+   */
+  pid_gains getYawRatePidGains();
+
+  /*
+   * @brief inject a measured yaw rate (ie from a gyro) to be used as feedback
+   * instead of the angular velocity derived from the wheels. Falls back to the
+   * wheels when no new rate arrives within the timeout.
+   * @param yaw_rate is the measured yaw rate (rad/s, positive counterclockwise)
+   */
+  void setMeasuredYawRate(float yaw_rate);
+
+  /*
+   * @brief set the horizon weights and constraints of the MODEL_PREDICTIVE
+   * mode, which predicts with the plant model
+   * @param mpc_params is the weights, limits and solver settings
+   */
+  void setMpcParams(mpc_params mpc_params);
+
+  /*
+   * @brief get the horizon weights and constraints of the MODEL_PREDICTIVE mode
+   */
+  mpc_params getMpcParams();
+
+  /*
+   * @brief get the time taken by the qp solves of the MODEL_PREDICTIVE mode,
+   * the slower side of the robot; zero in the other modes
+   */
+  mpc_timing getMpcTiming();
+
+  /*
+   * @brief set the slip detection and duty redistribution of the
+   * TRACTION_CONTROL mode
+   * @param traction_params is the thresholds and the share redistributed
+   */
+  void setTractionParams(traction_params traction_params);
+
+  /*
+   * @brief get the slip detection and duty redistribution settings
+   */
+  traction_params getTractionParams();
+
+  /*
+   * @brief feed a motor current measurement of one wheel, which confirms the
+   * slip seen on its speed (a spinning wheel is unloaded). Without fresh
+   * currents the slip is judged on the speeds alone.
+   * @param wheel is the index of the wheel
+   * @param current is the measured motor current (A)
+   */
+  void setMotorCurrent(int wheel, float current);
+
+  /*
+   * @brief get the share of its duty each wheel kept in the last traction
+   * control tick, 1 for a wheel with grip
+   */
+  wheel_data<WHEELS> getWheelGrip();
+
   /*
    * @brief compute the duty cycles for each motor based on the target, current
    * speed, and current duty cycle
    */
-  motor_data runMotionControl(robot_velocities velocity_targets,
-                              motor_data current_duty_cycles,
-                              motor_data current_motor_speeds);
+  wheel_data<WHEELS> runMotionControl(
+      robot_velocities velocity_targets,
+      wheel_data<WHEELS> current_duty_cycles,
+      wheel_data<WHEELS> current_motor_speeds);
 
   /*
    * @brief get an estimate of the robot's velocities from the motor_speeds
    * (derived)
    */
-  robot_velocities getMeasuredVelocities(motor_data current_motor_speeds);
+  robot_velocities getMeasuredVelocities(
+      wheel_data<WHEELS> current_motor_speeds);
 
  private:
   std::string log_folder_path_;
@@ -433,61 +959,664 @@ class Control::SkidRobotMotionController {
 
   robot_motion_mode_t operating_mode_;
   robot_geometry robot_geometry_;
+  skid_steer_params skid_steer_params_ = IDEAL_SKID_STEER;
 
-  std::mutex pid_mutex_;
+  Utilities::ProfiledMutex pid_mutex_{"control_pid"};
   std::unique_ptr<PidController> pid_controller_left_;
   std::unique_ptr<PidController> pid_controller_right_;
 
-  std::unique_ptr<PidController> pid_controller_fl_;
-  std::unique_ptr<PidController> pid_controller_fr_;
-  std::unique_ptr<PidController> pid_controller_rl_;
-  std::unique_ptr<PidController> pid_controller_rr_;
+  std::array<std::unique_ptr<PidController>, WHEELS> pid_controller_wheels_;
 
   pid_gains pid_gains_;
+  pid_tuning pid_tuning_;
   robot_velocities measured_velocities_;
 
   float open_loop_max_wheel_rpm_;
 
   float max_motor_duty_;
   float min_motor_duty_;
+  deadband_compensation<WHEELS> deadband_compensation_ =
+      NO_DEADBAND_COMPENSATION<WHEELS>;
+
+  /* bus voltage compensation */
+  const float VOLTAGE_FILTER_ALPHA_ = 0.05;
+  const uint32_t VOLTAGE_SETTLE_SAMPLES_ = 20;
+  /* a scale outside of this range is a bad reading, not a flat battery */
+  const float MIN_VOLTAGE_SCALE_ = 0.7;
+  const float MAX_VOLTAGE_SCALE_ = 1.5;
+  Utilities::ProfiledMutex voltage_mutex_{"control_voltage"};
+  bool voltage_compensation_ = false;
+  float nominal_bus_voltage_ = 0;
+  float filtered_bus_voltage_ = 0;
+  uint32_t bus_voltage_samples_ = 0;
+  std::unique_ptr<AlphaBetaFilter> bus_voltage_filter_;
+
+  /*
+   * @brief get the duty scale for the current bus voltage, 1 when disabled
+   */
+  float voltageScale_();
+
+  /*
+   * @brief map a duty request past the breakaway duty of its wheel
+   */
+  float compensateDeadband_(float duty, float breakaway_duty);
 
   float left_trim_value_;
   float right_trim_value_;
 
+  /* automatic trim, only while commanded straight and fast enough */
+  const float AUTO_TRIM_MAX_ANGULAR_VELOCITY_ = 0.02; /* rad/s */
+  const float AUTO_TRIM_MIN_LINEAR_VELOCITY_ = 0.2;   /* m/s */
+  const float AUTO_TRIM_SETTLE_TIME_ = 0.5;           /* s */
+  Utilities::ProfiledMutex auto_trim_mutex_{"control_auto_trim"};
+  std::unique_ptr<TrimEstimator> trim_estimator_;
+  float auto_trim_straight_time_;
+
   float max_linear_acceleration_;
   float max_angular_acceleration_;
 
   angular_scaling_params angular_scaling_params_;
 
+  /* outer yaw-rate loop */
+  const float YAW_RATE_TIMEOUT_ = 0.2;
+  bool yaw_rate_control_;
+  pid_gains yaw_rate_pid_gains_;
+  std::unique_ptr<PidController> pid_controller_yaw_;
+  Utilities::ProfiledMutex yaw_rate_mutex_{"control_yaw_rate"};
+  float measured_yaw_rate_;
+  std::chrono::steady_clock::time_point yaw_rate_time_;
+
+  /*
+   * @brief read the injected yaw rate if it is not older than the timeout
+   * @param yaw_rate is set to the injected yaw rate when fresh
+   * @return true if the injected yaw rate is fresh
+   */
+  bool readMeasuredYawRate_(float &yaw_rate);
+
+  /*
+   * @brief measure the left/right imbalance while commanded straight and feed
+   * it to the trim estimator, then apply the estimated trim
+   */
+  void updateAutoTrim_(robot_velocities velocity_targets,
+                       wheel_data<WHEELS> current_wheel_speeds,
+                       float delta_time);
+
   float geometric_decay_;
 
   std::chrono::steady_clock::time_point time_last_;
   std::chrono::steady_clock::time_point time_origin_;
 
-  motor_data duty_cycles_;
+  wheel_data<WHEELS> duty_cycles_;
+
+  /* latency compensation */
+  bool latency_compensation_;
+  plant_model plant_model_;
+  float feedback_delay_;
+  wheel_data<WHEELS> applied_duty_cycles_;
+
+  /* relay autotuner */
+  const float AUTOTUNE_TIMEOUT_ = 30; /* s */
+  struct relay_state {
+    float output;         /* +1 or -1 */
+    float peak_high;      /* rpm extremes of the current period */
+    float peak_low;
+    float last_rise_time; /* s, negative before the first rise */
+    uint8_t rises;
+    float amplitude_sum;  /* rpm */
+    float period_sum;     /* s */
+    uint8_t periods;
+  };
+  Utilities::ProfiledMutex autotune_mutex_{"control_autotune"};
+  bool autotuning_ = false;
+  autotune_params autotune_params_;
+  float autotune_start_time_;
+  float autotune_dt_sum_;
+  uint32_t autotune_ticks_;
+  relay_state relay_left_;
+  relay_state relay_right_;
+  std::optional<autotune_result> autotune_result_;
+
+  /*
+   * @brief run one tick of the relay experiment
+   * @return the relay duty cycles, empty when no experiment is running
+   */
+  std::optional<wheel_data<WHEELS>> runAutotune_(
+      wheel_data<WHEELS> current_wheel_speeds, float accumulated_time,
+      float delta_time);
+
+  /*
+   * @brief switch the relay of one side and record its oscillation
+   */
+  void updateRelay_(relay_state &relay, float wheel_speed, float time);
+
+  /*
+   * @brief derive the ultimate gain and period, and pid gains from them
+   */
+  std::optional<autotune_result> computeAutotuneResult_(
+      const relay_state &relay);
+
+  /* one predictor per wheel */
+  std::array<std::unique_ptr<WheelSpeedPredictor>, WHEELS> predictors_;
+
+  /* model predictive control, one per side */
+  mpc_params mpc_params_;
+  std::unique_ptr<WheelSpeedMpc> mpc_left_;
+  std::unique_ptr<WheelSpeedMpc> mpc_right_;
+
+  /* slip detection, one detector per wheel */
+  const float MOTOR_CURRENT_TIMEOUT_ = 0.2; /* s */
+  Utilities::ProfiledMutex traction_mutex_{"control_traction"};
+  traction_params traction_params_;
+  std::array<std::unique_ptr<SlipDetector>, WHEELS> slip_detectors_;
+  wheel_data<WHEELS> motor_currents_;
+  std::array<std::chrono::steady_clock::time_point, WHEELS> current_times_;
+  wheel_data<WHEELS> wheel_grip_;
 
   void initializePids();
 
-  motor_data computeMotorCommandsDual_(motor_data target_wheel_speeds,
-                                       motor_data current_motor_speeds);
+  void initializePredictors();
+
+  void initializeSlipDetectors();
 
-  motor_data computeMotorCommandsQuad_(motor_data target_wheel_speeds,
-                                       motor_data current_motor_speeds);
+  wheel_data<WHEELS> predictWheelSpeeds_(
+      wheel_data<WHEELS> current_motor_speeds, float delta_time);
 
-  motor_data clipDutyCycles_(motor_data proposed_duties);
+  wheel_data<WHEELS> correctYawRate_(wheel_data<WHEELS> target_wheel_speeds,
+                                     float angular_velocity_target);
 
-  motor_data computeTorqueDistribution_(motor_data current_motor_speeds,
-                                        motor_data power_proposals);
+  wheel_data<WHEELS> computeMotorCommandsDual_(
+      wheel_data<WHEELS> target_wheel_speeds,
+      wheel_data<WHEELS> current_motor_speeds);
+
+  wheel_data<WHEELS> computeMotorCommandsWheels_(
+      wheel_data<WHEELS> target_wheel_speeds,
+      wheel_data<WHEELS> current_motor_speeds);
+
+  wheel_data<WHEELS> computeMotorCommandsMpc_(
+      wheel_data<WHEELS> target_wheel_speeds,
+      wheel_data<WHEELS> current_motor_speeds);
+
+  void accumulateDuties_(wheel_data<WHEELS> motor_duties_add);
+
+  wheel_data<WHEELS> clipDutyCycles_(wheel_data<WHEELS> proposed_duties);
+
+  wheel_data<WHEELS> computeTorqueDistribution_(
+      wheel_data<WHEELS> current_motor_speeds,
+      wheel_data<WHEELS> power_proposals, float delta_time);
 };
 
-// #TODO: implement if needed
+/* a single state exponential moving average (the alpha stage only); the name
+ * is kept from the original declaration, there is no beta (rate) state */
 class Control::AlphaBetaFilter {
  public:
   /* constructors */
+
+  /*
+   * @brief exponential moving average, the first value seeds the average
+   * @param alpha is the weight of each new value on the range (0, 1]
+   */
   AlphaBetaFilter(float alpha);
 
+  /*
+   * @brief add a value and get the filtered value
+   * @param new_value is the latest raw value
+   */
   float update(float new_value);
 
+  /*
+   * @brief forget the history; the next value seeds the average
+   */
+  void reset();
+
  private:
+  float alpha_;
+  bool initialized_;
   float running_sum_;
 };
+
+class Control::WheelSpeedPredictor {
+ public:
+  /* constructors */
+
+  /*
+   * @brief forward predicts the speed of a single wheel from its delayed
+   * feedback (smith predictor). A first-order model of the wheel is run with
+   * the duty cycles actually applied; the model output delayed by the pipeline
+   * delay is compared against the measurement, and that mismatch corrects the
+   * undelayed model output
+   * @param plant_model is the gain, time constant, and dead time of the wheel
+   */
+  WheelSpeedPredictor(plant_model plant_model);
+
+  /*
+   * @brief set the model of the wheel
+   * @param plant_model is the gain, time constant, and dead time of the wheel
+   */
+  void setPlantModel(plant_model plant_model);
+
+  /*
+   * @brief clear the model state and its history
+   */
+  void reset();
+
+  /*
+   * @brief estimate the present speed of the wheel
+   * @param measured is the latest (delayed) measured wheelspeed
+   * @param applied_duty is the duty cycle applied since the previous call
+   * @param feedback_delay is the delay of the communication pipeline (s)
+   * @param dt is the time since the previous call (s)
+   */
+  float predict(float measured, float applied_duty, float feedback_delay,
+                float dt);
+
+ private:
+  /* enough history to cover ~300ms at the 30ms control rate with margin */
+  static const int HISTORY_LENGTH_ = 32;
+
+  plant_model plant_model_;
+  float model_speed_;
+  int history_head_;
+  std::array<float, HISTORY_LENGTH_> model_history_;
+  std::array<float, HISTORY_LENGTH_> dt_history_;
+};
+
+class Control::WheelSpeedMpc {
+ public:
+  /* prediction steps, fixed so every buffer of the solver is preallocated */
+  static const int HORIZON = 10;
+
+  /* constructors */
+
+  /*
+   * @brief linear model predictive controller of the speed of one side. The
+   * first-order plant model predicts the speed over the horizon; a qp over the
+   * duty cycles trades the tracking error against duty changes, subject to
+   * duty, acceleration and jerk limits. The qp is solved with a fixed number
+   * of ADMM iterations, warm started from the previous tick, and does not
+   * allocate.
+   * @param plant_model is the gain and time constant of the side
+   * @param mpc_params is the weights, limits and solver settings
+   * @param max_duty is the largest duty cycle magnitude
+   */
+  WheelSpeedMpc(plant_model plant_model, mpc_params mpc_params,
+                float max_duty);
+
+  /*
+   * @brief forget the warm start and the model mismatch
+   */
+  void reset();
+
+  /*
+   * @brief solve the horizon and get the duty cycle to apply now
+   * @param target_speed is the wheelspeed target over the horizon (rpm)
+   * @param measured_speed is the present wheelspeed (rpm)
+   */
+  float update(float target_speed, float measured_speed);
+
+  /*
+   * @brief get the time taken by the solves
+   */
+  mpc_timing getTiming();
+
+ private:
+  /* duty, acceleration and jerk at each step */
+  static const int CONSTRAINTS_ = 3 * HORIZON;
+  /* keeps the reduced kkt matrix positive definite */
+  const float ADMM_SIGMA_ = 1e-4;
+  /* over-relaxation of the ADMM steps */
+  const float ADMM_ALPHA_ = 1.6;
+
+  mpc_params mpc_params_;
+  float max_duty_;
+
+  /* speeds are divided by the plant gain so the qp is well scaled */
+  float speed_scale_;
+  float decay_;
+  float input_gain_;
+  float max_step_acceleration_;
+  float max_step_jerk_;
+
+  /* response of the predicted speeds to the duties, row per step */
+  std::array<float, HORIZON * HORIZON> response_;
+  std::array<float, HORIZON * HORIZON> hessian_;
+  std::array<float, CONSTRAINTS_ * HORIZON> constraints_;
+  /* cholesky factor of hessian + sigma I + rho A'A */
+  std::array<float, HORIZON * HORIZON> kkt_factor_;
+
+  /* solver state, kept between ticks for the warm start */
+  std::array<float, HORIZON> duties_;
+  std::array<float, CONSTRAINTS_> slack_;
+  std::array<float, CONSTRAINTS_> dual_;
+
+  /* workspace */
+  std::array<float, HORIZON + 1> free_response_;
+  std::array<float, HORIZON> linear_cost_;
+  std::array<float, HORIZON> solution_;
+  std::array<float, CONSTRAINTS_> lower_;
+  std::array<float, CONSTRAINTS_> upper_;
+  std::array<float, CONSTRAINTS_> relaxed_;
+
+  bool initialized_;
+  float previous_speed_;
+  float previous_duty_;
+  float disturbance_;
+
+  float last_solve_time_;
+  float worst_solve_time_;
+
+  /*
+   * @brief build the prediction, cost and constraint matrices and factor the
+   * kkt matrix; only on construction
+   */
+  void setup_(plant_model plant_model);
+
+  /*
+   * @brief solve the factored kkt system in place
+   */
+  void solveKkt_(std::array<float, HORIZON> &rhs);
+};
+
+template <int WHEELS>
+class Control::TachometerOdometry {
+ public:
+  /* constructors */
+
+  /*
+   * @brief integrates odometry from the absolute tachometer counts of the
+   * motor controllers. Unlike integrating sampled rpm, no distance is lost
+   * when samples are missed or jittered since every update accounts for the
+   * full count change since the previous one.
+   * @param meters_per_count is the distance the wheel travels per tachometer
+   * count
+   * @param robot_geometry is a description of the robot's geometry
+   */
+  TachometerOdometry(float meters_per_count, robot_geometry robot_geometry);
+
+  /*
+   * @brief set the robot geometry used to compute heading
+   * @param robot_geometry is a description of the robot's geometry
+   */
+  void setRobotGeometry(robot_geometry robot_geometry);
+
+  /*
+   * @brief set the slip parameters of the skid steer model used to compute
+   * heading and ground distance
+   * @param skid_steer_params is the slip description of the robot
+   */
+  void setSkidSteerParams(skid_steer_params skid_steer_params);
+
+  /*
+   * @brief set the distance the wheel travels per tachometer count, ie after
+   * the wheel radius was recalibrated
+   * @param meters_per_count is the distance per tachometer count
+   */
+  void setMetersPerCount(float meters_per_count);
+
+  /*
+   * @brief zero the odometry; the next update sets a new count baseline
+   */
+  void reset();
+
+  /*
+   * @brief update the odometry with the latest absolute tachometer counts
+   * @param tachometer_counts is the latest count of each motor
+   */
+  odometry_data update(wheel_counts<WHEELS> tachometer_counts);
+
+  /*
+   * @brief get the odometry without updating it
+   */
+  odometry_data getOdometry();
+
+ private:
+  /* anything further than this in one update is a controller reset (m) */
+  const float MAX_UPDATE_DISTANCE_ = 1.0;
+
+  float meters_per_count_;
+  robot_geometry robot_geometry_;
+  skid_steer_params skid_steer_params_ = IDEAL_SKID_STEER;
+  bool initialized_;
+  wheel_counts<WHEELS> last_counts_;
+  odometry_data odometry_;
+
+  float countsToDistance_(int32_t counts_now, int32_t counts_last);
+};
+
+class Control::KinematicCalibrator {
+ public:
+  /* constructors */
+
+  /*
+   * @brief recursive least-squares fit of the effective wheel radius and wheel
+   * base against external references. Both are estimated as a scale on the
+   * nominal values, with a forgetting factor so the fit follows tyre wear and
+   * terrain. Samples are meant to be added outside of the control loop.
+   * @param robot_geometry is the nominal robot geometry
+   * @param skid_steer_params is the slip description of the robot
+   */
+  KinematicCalibrator(robot_geometry robot_geometry,
+                      skid_steer_params skid_steer_params);
+
+  /*
+   * @brief fit the effective wheel base against a measured yaw rate
+   * @param left_wheel_rate is the mean left wheel speed (rad/s)
+   * @param right_wheel_rate is the mean right wheel speed (rad/s)
+   * @param yaw_rate is the measured yaw rate, ie from a gyro (rad/s)
+   * @return true if the calibrated geometry changed enough to be applied
+   */
+  bool addYawRateSample(float left_wheel_rate, float right_wheel_rate,
+                        float yaw_rate);
+
+  /*
+   * @brief fit the effective wheel radius and wheel base against a measured
+   * displacement
+   * @param left_wheel_angle is the left wheel rotation over the interval (rad)
+   * @param right_wheel_angle is the right wheel rotation over the interval
+   * (rad)
+   * @param distance is the measured distance travelled by the center of mass
+   * over the interval (m)
+   * @param rotation is the measured heading change over the interval (rad)
+   * @return true if the calibrated geometry changed enough to be applied
+   */
+  bool addDisplacementSample(float left_wheel_angle, float right_wheel_angle,
+                             float distance, float rotation);
+
+  /*
+   * @brief get the latest calibrated geometry; estimates which have not
+   * converged keep their nominal value
+   */
+  robot_geometry getGeometry();
+
+ private:
+  /* memory of the estimators, ~1/(1 - FORGETTING_FACTOR_) samples */
+  const float FORGETTING_FACTOR_ = 0.995;
+  const float INITIAL_COVARIANCE_ = 1;
+  /* an estimate is trusted below this covariance and above this many samples;
+   * the regressor is normalized, so the covariance does not depend on how
+   * hard the samples excite the model and floors near 1 - FORGETTING_FACTOR_ */
+  const float CONVERGED_COVARIANCE_ = 0.05;
+  const uint32_t MIN_SAMPLES_ = 20;
+  /* samples with less excitation than this carry mostly noise */
+  const float MIN_YAW_EXCITATION_ = 0.1;          /* rad/s */
+  const float MIN_DISTANCE_EXCITATION_ = 0.05;    /* m */
+  const float MIN_ROTATION_EXCITATION_ = 0.05;    /* rad */
+  /* scales outside of this range mean a bad reference, not a worn tyre */
+  const float MIN_SCALE_ = 0.5;
+  const float MAX_SCALE_ = 2.0;
+  /* relative change before a new geometry is worth applying */
+  const float APPLY_TOLERANCE_ = 0.01;
+
+  struct scale_estimate {
+    float scale;
+    float covariance;
+    uint32_t samples;
+  };
+
+  Utilities::ProfiledMutex calibration_mutex_{"calibration"};
+  robot_geometry nominal_geometry_;
+  skid_steer_params skid_steer_params_;
+  float nominal_radius_;   /* ground distance per wheel radian (m/rad) */
+  float nominal_yaw_gain_; /* heading change per wheel radian of differential */
+  scale_estimate radius_estimate_;
+  scale_estimate yaw_gain_estimate_;
+  robot_geometry applied_geometry_;
+
+  void updateEstimate_(scale_estimate &estimate, float prediction,
+                       float measurement);
+
+  bool isConverged_(const scale_estimate &estimate);
+
+  robot_geometry computeGeometry_();
+
+  bool checkApply_();
+};
+
+class Control::TrimEstimator {
+ public:
+  /* constructors */
+
+  /*
+   * @brief incremental estimator of the drive trim. Each sample of the
+   * left/right imbalance measured with the current trim applied nudges the
+   * trim against it, so the trim integrates towards the value at which the
+   * robot drives straight.
+   * @param max_trim is the largest magnitude of trim the estimator may reach
+   * @param initial_trim is the trim to start from
+   */
+  TrimEstimator(float max_trim, float initial_trim);
+
+  /*
+   * @brief update the trim with one imbalance sample
+   * @param imbalance is the relative speed excess of the right side over the
+   * left side, (right - left) / (right + left)
+   * @param dt is the time since the previous sample (s)
+   * @return the updated trim
+   */
+  float update(float imbalance, float dt);
+
+  /*
+   * @brief get the current trim; positive reduces the right side
+   */
+  float getTrim();
+
+  /*
+   * @brief get whether the imbalance has stayed small long enough
+   */
+  bool isStable();
+
+ private:
+  /* trim correction per second per unit of imbalance */
+  const float TRIM_GAIN_ = 2.0;
+  /* a larger imbalance is a bump or a wheel off the ground */
+  const float MAX_IMBALANCE_ = 0.3;
+  const float FILTER_TIME_CONSTANT_ = 0.5; /* s */
+  const float STABLE_IMBALANCE_ = 0.005;
+  const float STABLE_TIME_ = 2.0; /* s */
+
+  float max_trim_;
+  float trim_;
+  float filtered_imbalance_;
+  float stable_time_;
+};
+
+class Control::SlipDetector {
+ public:
+  /* constructors */
+
+  /*
+   * @brief slip detector of a single wheel. The relative speed excess of the
+   * wheel over the slowest wheel of its side is tracked with a running mean
+   * and variance while the wheel grips, which absorbs tire wear and noise.
+   * An excess standing out of those statistics, with a motor current below
+   * the side mean when known, is slip.
+   * @param params is the thresholds of the detector
+   */
+  SlipDetector(traction_params params);
+
+  /*
+   * @brief set the thresholds of the detector, keeping its statistics
+   */
+  void setParams(traction_params params);
+
+  /*
+   * @brief judge one sample of the wheel, constant time
+   * @param speed_excess is |wheel speed| / reference speed - 1
+   * @param current_share is |wheel current| / mean |current| of the side,
+   * empty when the currents are unknown
+   * @param dt is the time the statistics learn from this sample (s), 0 only
+   * judges it
+   * @return the share of its duty the wheel should keep, 1 without slip
+   */
+  float update(float speed_excess, std::optional<float> current_share,
+               float dt);
+
+  /*
+   * @brief get whether the last sample was slip
+   */
+  bool isSlipping();
+
+  /*
+   * @brief forget the statistics and the slip state
+   */
+  void reset();
+
+ private:
+  traction_params params_;
+  bool slipping_;
+  float excess_mean_;
+  float excess_variance_;
+};
+
+class Control::PathFollower {
+ public:
+  /* constructors */
+
+  /*
+   * @brief pure pursuit tracker of a path, run from the motor control loop on
+   * the wheel odometry. External pose corrections move the odometry into the
+   * frame of the path; between them the odometry alone carries the pose.
+   * @param params is the lookahead and limits of the tracker
+   */
+  PathFollower(pure_pursuit_params params);
+
+  /*
+   * @brief replace the path being followed, from any thread; the control loop
+   * picks it up on its next update without waiting on a lock
+   * @param path is the points to follow in order, empty to stop following
+   */
+  void setPath(std::vector<path_point> path);
+
+  /*
+   * @brief align the odometry with an external pose estimate
+   * @param world_pose is the pose in the frame of the path (x, y, heading)
+   * @param odometry_pose is the odometry at the time of the estimate
+   */
+  void correctPose(odometry_data world_pose, odometry_data odometry_pose);
+
+  /*
+   * @brief compute the velocities that track the path; allocation free
+   * @param odometry is the latest wheel odometry
+   * @return the velocity targets, empty when there is no path to follow
+   */
+  std::optional<robot_velocities> update(odometry_data odometry);
+
+  /*
+   * @brief get whether a path is being followed
+   */
+  bool isActive();
+
+ private:
+  pure_pursuit_params params_;
+
+  /* written by setPath, swapped in by update */
+  std::shared_ptr<const std::vector<path_point>> path_;
+  std::shared_ptr<const std::vector<path_point>> active_path_;
+  size_t progress_index_;
+  float last_speed_;
+
+  /* odometry frame expressed in the path frame */
+  Utilities::ProfiledMutex frame_mutex_{"path_frame"};
+  float frame_x_;
+  float frame_y_;
+  float frame_heading_;
+};
@@ -2,6 +2,7 @@
 
 #include "comm_base.hpp"
 #include "comm_can.hpp"
+#include "comm_lockstep.hpp"
 #include "comm_serial.hpp"
 #include "control.hpp"
 #include "utilities.hpp"
@@ -32,10 +33,49 @@ class RoverRobotics::BaseProtocolObject {
    * robot_mode_ FALSE, this function simply translates the commanded
    * velocities into motor duty cycles and there is no expectation that the
    * commanded velocities will be realized by the robot. In robot_mode_ FALSE
-   * mode, motor power is roughly proportional to commanded velocity.
+   * mode, motor power is roughly proportional to commanded velocity. A
+   * velocity command also ends a path being followed.
    * @param controllarray an double array of control in m/s
    */
   virtual void set_robot_velocity(double* controllarray) = 0;
+  /*
+   * @brief Set Measured Yaw Rate
+   * Inject an externally measured yaw rate (ie from a gyro) which is used as
+   * heading rate feedback instead of the rate derived from the wheels. Robots
+   * which do not close the loop on heading rate ignore it
+   * @param double yaw rate in rad/s, positive counterclockwise
+   */
+  virtual void set_measured_yaw_rate(double) {}
+  /*
+   * @brief Set Reference Displacement
+   * Inject a ground-truth displacement (ie from motion capture or a surveyed
+   * course) travelled since the previous call, which is used to calibrate the
+   * wheel radius and wheel base. Robots without wheel tachometers ignore it
+   * @param double distance travelled in m
+   * @param double heading change in rad, positive counterclockwise
+   */
+  virtual void set_reference_displacement(double, double) {}
+  /*
+   * @brief Follow Path
+   * Track a path from the motor control loop on the wheel tachometers, which
+   * then replaces the velocity commands until the last point is reached, a
+   * new path or a velocity command is given, or neither this nor
+   * set_robot_pose is called again within the path timeout of the robot.
+   * Robots without wheel tachometers can not follow paths
+   * @param std::vector<path_point> points in order, empty to stop following
+   * @return bool true if the robot follows paths, false if it ignores them
+   */
+  virtual bool follow_path(std::vector<Control::path_point>) { return false; }
+  /*
+   * @brief Set Robot Pose
+   * Inject an external pose estimate (ie from localization) in the frame of
+   * the paths given to follow_path, which corrects the odometry drift.
+   * Robots which do not follow paths ignore it
+   * @param double x in m
+   * @param double y in m
+   * @param double heading in rad, positive counterclockwise
+   */
+  virtual void set_robot_pose(double, double, double) {}
   /*
    * @brief Request Robot Status
    * @return structure of statusData
@@ -46,6 +86,14 @@ class RoverRobotics::BaseProtocolObject {
    * @return structure of statusData
    */
   virtual robotData info_request() = 0;
+  /*
+   * @brief Request Diagnostic Metrics
+   * Named values describing the state of the link and the motor controllers,
+   * and the contention of the library locks when they are profiled; meant
+   * for logging and diagnostics rather than control
+   * @return vector of metric name and value pairs
+   */
+  virtual std::vector<std::pair<std::string, double>> metrics_request() = 0;
   /*
    * @brief Unpack bytes from the robot
    * This is meant to use as a callback function when there are bytes available
@@ -69,4 +117,25 @@ class RoverRobotics::BaseProtocolObject {
    * @param device is the address of the device (ttyUSB0 , can0, ttyACM0)
    */
   virtual void register_comm_base(const char* device) = 0;
+  /*
+   * @brief Advance a lockstep simulation
+   * With a lockstep comm type no thread runs and the caller drives the robot:
+   * the injected frames are processed, one control tick runs and the motor
+   * commands are written, all at the given simulated time. Robots without a
+   * lockstep mode, or not constructed in it, ignore it
+   * @param double simulated time in s, never decreasing
+   */
+  virtual void step(double) {}
+  /*
+   * @brief Hand a frame from the simulated robot to the next step
+   * @param std::vector<uint8_t> frame in the layout of the robot transport
+   */
+  virtual void inject_rx(std::vector<uint8_t>) {}
+  /*
+   * @brief Take the frames written to the simulated robot by the previous
+   * steps
+   * @return frames in the layout of the robot transport, oldest first, none
+   * without a lockstep mode
+   */
+  virtual std::vector<std::vector<uint8_t>> take_tx() { return {}; }
 };
@@ -35,6 +35,11 @@ class RoverRobotics::ProProtocolObject
    * @return structure of statusData
    */
   robotData info_request() override;
+  /*
+   * @brief Request Diagnostic Metrics
+   * @return vector of metric name and value pairs
+   */
+  std::vector<std::pair<std::string, double>> metrics_request() override;
   /*
    * @brief Set Robot velocity
    * Set Robot velocity: IF robot_mode_ TRUE, this function will attempt a
@@ -79,6 +84,11 @@ class RoverRobotics::ProProtocolObject
    * @param datalist list of data to request
    */
   void send_command(int sleeptime, std::vector<uint32_t> datalist);
+  /*
+   * @brief 8 bit command of a motor for the next frame
+   * @param motor index in motors_speeds_
+   */
+  unsigned char motor_command_byte(int motor);
   /*
    * @brief Thread Driven function update the robot motors using pid
    * @param sleeptime sleep time between each cycle
@@ -93,13 +103,24 @@ class RoverRobotics::ProProtocolObject
   const int requestbyte_ = 10;
   const int termios_baud_code_ = 4097;  // THIS = baudrate of 57600
   const int RECEIVE_MSG_LEN_ = 5;
-  const double odom_angular_coef_ = 2.3;
-  const double odom_traction_factor_ = 0.7;
+  /* metric units (meters) */
+  const Control::robot_geometry ROBOT_GEOMETRY_ = {
+      .intra_axle_distance = 0.4191,
+      .wheel_base = 0.46355,
+      .wheel_radius = 0.1397,
+      .center_of_mass_x_offset = 0,
+      .center_of_mass_y_offset = 0};
+  /* the motor rpm to m/s ratio already accounts for longitudinal slip */
+  const Control::skid_steer_params SKID_STEER_PARAMS_ = {
+      .track_expansion = 0.42, .traction_factor = 1};
   const double CONTROL_LOOP_TIMEOUT_MS_ = 200;
+  /* dither the 8 bit motor commands so their average tracks the controller
+   * output between two command steps */
+  const bool USE_COMMAND_DITHERING_ = false;
   std::unique_ptr<CommBase> comm_base_;
   std::string comm_type_;
 
-  std::mutex robotstatus_mutex_;
+  Utilities::ProfiledMutex robotstatus_mutex_{"pro_robotstatus"};
   robotData robotstatus_;
   double motors_speeds_[3];
   double trimvalue_;
@@ -111,6 +132,7 @@ class RoverRobotics::ProProtocolObject
   // Motor PID variables
   OdomControl motor1_control_;
   OdomControl motor2_control_;
+  SigmaDeltaQuantizer command_quantizers_[2];
   Control::robot_motion_mode_t robot_mode_;
   Control::pid_gains pid_;
 
@@ -46,6 +46,11 @@ class RoverRobotics::Pro2ProtocolObject
    * @return structure of statusData
    */
   robotData info_request() override;
+  /*
+   * @brief Request Diagnostic Metrics
+   * @return vector of metric name and value pairs
+   */
+  std::vector<std::pair<std::string, double>> metrics_request() override;
   /*
    * @brief Set Robot velocity
    * Set Robot velocity: IF robot_mode_ TRUE, this function will attempt a
@@ -54,10 +59,46 @@ class RoverRobotics::Pro2ProtocolObject
    * robot_mode_ FALSE, this function simply translates the commanded
    * velocities into motor duty cycles and there is no expectation that the
    * commanded velocities will be realized by the robot. In robot_mode_ FALSE
-   * mode, motor power is roughly proportional to commanded velocity.
+   * mode, motor power is roughly proportional to commanded velocity. A
+   * velocity command also ends a path being followed.
    * @param controllarray an double array of control in m/s
    */
   void set_robot_velocity(double *controllarray) override;
+  /*
+   * @brief Set Measured Yaw Rate
+   * Inject an externally measured yaw rate (ie from a gyro) which is used as
+   * heading rate feedback instead of the rate derived from the wheels
+   * @param double yaw rate in rad/s, positive counterclockwise
+   */
+  void set_measured_yaw_rate(double) override;
+  /*
+   * @brief Set Reference Displacement
+   * Inject a ground-truth displacement (ie from motion capture or a surveyed
+   * course) travelled since the previous call, which is used to calibrate the
+   * wheel radius and wheel base
+   * @param double distance travelled in m
+   * @param double heading change in rad, positive counterclockwise
+   */
+  void set_reference_displacement(double, double) override;
+  /*
+   * @brief Follow Path
+   * Track a path from the motor control loop on the wheel tachometers, which
+   * then replaces the velocity commands until the last point is reached, a
+   * new path or a velocity command is given, or neither this nor
+   * set_robot_pose is called again within the path timeout of the robot
+   * @param std::vector<path_point> points in order, empty to stop following
+   * @return bool true, the robot follows paths
+   */
+  bool follow_path(std::vector<Control::path_point>) override;
+  /*
+   * @brief Set Robot Pose
+   * Inject an external pose estimate (ie from localization) in the frame of
+   * the paths given to follow_path, which corrects the odometry drift
+   * @param double x in m
+   * @param double y in m
+   * @param double heading in rad, positive counterclockwise
+   */
+  void set_robot_pose(double, double, double) override;
   /*
    * @brief Unpack bytes from the robot
    * This is meant to use as a callback function when there are bytes available
@@ -81,6 +122,25 @@ class RoverRobotics::Pro2ProtocolObject
    * @param device is the address of the device (ttyUSB0 , can0, ttyACM0, etc)
    */
   void register_comm_base(const char *device) override;
+  /*
+   * @brief Advance a lockstep simulation
+   * Only with the "lockstep" comm type, where no thread runs: processes the
+   * injected frames, runs one control tick and writes the motor commands, all
+   * at the given simulated time
+   * @param sim_time simulated time in s, never decreasing
+   */
+  void step(double sim_time) override;
+  /*
+   * @brief Hand a frame from the simulated robot to the next step
+   * @param frame CAN frame in the CommCan layout
+   */
+  void inject_rx(std::vector<uint8_t> frame) override;
+  /*
+   * @brief Take the frames written to the simulated robot by the previous
+   * steps
+   * @return CAN frames in the CommCan layout, oldest first
+   */
+  std::vector<std::vector<uint8_t>> take_tx() override;
 
  private:
   /*
@@ -90,11 +150,25 @@ class RoverRobotics::Pro2ProtocolObject
    * @param datalist list of data to request
    */
   void send_command(int sleeptime);
+  /*
+   * @brief write the latest motor commands to the robot once
+   */
+  void write_motor_commands();
   /*
    * @brief Thread Driven function update the robot motors using pid
    * @param sleeptime sleep time between each cycle
    */
   void motors_control_loop(int sleeptime);
+  /*
+   * @brief compute the motor commands once from the latest status
+   * @param command_delay expected time from now until the commands are sent,
+   * in s
+   */
+  void run_control_tick(float command_delay);
+  /*
+   * @brief time of the velocity commands, simulated in lockstep mode
+   */
+  std::chrono::milliseconds command_clock();
 
   /*
    * @brief loads the persistent parameters from a non-volatile config file
@@ -102,6 +176,31 @@ class RoverRobotics::Pro2ProtocolObject
    */
   void load_persistent_params();
 
+  /*
+   * @brief apply a (calibrated) geometry to the controller and odometry, only
+   * call from the constructor or the motor control loop
+   * @param robot_geometry is the new robot geometry
+   */
+  void apply_robot_geometry(Control::robot_geometry robot_geometry);
+
+  /*
+   * @brief persist the latest calibrated geometry and hand it to the motor
+   * control loop
+   */
+  void publish_calibration();
+
+  /*
+   * @brief keep and persist the trim found by the automatic trim
+   * @param trim is the settled trim value
+   */
+  void save_auto_trim(double trim);
+
+  /*
+   * @brief whether every motor reported a tachometer count recently enough to
+   * move the odometry, call with robotstatus_mutex_ held
+   */
+  bool tachometer_fresh();
+
   std::unique_ptr<Utilities::PersistentParams> persistent_params_;
 
   const std::string ROBOT_PARAM_PATH = strcat(std::getenv("HOME"), "/robot.config");
@@ -113,9 +212,17 @@ class RoverRobotics::Pro2ProtocolObject
                                              .wheel_radius = 0.1397,
                                              .center_of_mass_x_offset = 0,
                                              .center_of_mass_y_offset = 0};
+  const Control::skid_steer_params SKID_STEER_PARAMS_ =
+      Control::IDEAL_SKID_STEER;
+  const Control::pure_pursuit_params PURE_PURSUIT_PARAMS_ =
+      Control::DEFAULT_PURE_PURSUIT;
   const float MOTOR_RPM_TO_MPS_RATIO_ = 13749 / 1.26 / 0.72;
   const int MOTOR_NEUTRAL_ = 0;
 
+  /* tachometer counts per revolution of the wheel */
+  const float TACH_COUNTS_PER_WHEEL_REV_ =
+      vesc::TACH_COUNTS_PER_ELECTRICAL_REV / vesc::RPM_SCALING_FACTOR;
+
   /* max: 1.0, min: 0.0  */
   const float MOTOR_MAX_ = .97;
   const float MOTOR_MIN_ = .02;
@@ -129,24 +236,86 @@ class RoverRobotics::Pro2ProtocolObject
   /* empirically measured */
   const float OPEN_LOOP_MAX_RPM_ = 600;
 
+  /* first-order response of a wheel to a step in duty, used by the predictor */
+  const float WHEEL_TIME_CONSTANT_ = 0.1;
+  const bool USE_LATENCY_COMPENSATION_ = false;
+  /* keep the duty to speed relation over the discharge; referenced to the
+   * voltage of the sysid run when persisted, otherwise to the first reading */
+  const bool USE_VOLTAGE_COMPENSATION_ = true;
+  float nominal_battery_voltage_ = 0;
+  /* breakaway duties are identified by the sysid tool, none by default */
+  Control::deadband_compensation<4> deadband_compensation_ = {
+      .breakaway_duty = {0, 0, 0, 0}, .blend_duty = 0.02};
+  /* identified by the sysid tool when persisted, otherwise nominal */
+  Control::plant_model plant_model_ = {.gain = OPEN_LOOP_MAX_RPM_,
+                                       .time_constant = WHEEL_TIME_CONSTANT_,
+                                       .dead_time = 0};
+
+  /* outer heading rate loop in traction control mode */
+  const bool USE_YAW_RATE_CONTROL_ = false;
+  const Control::pid_gains YAW_RATE_PID_GAINS_ = {0.5, 1.0, 0};
+
+  /* fit wheel radius and wheel base against the yaw rate and displacement
+   * references, and persist them; opt in only, the yaw rate is also injected
+   * for the yaw rate loop and the automatic trim */
+  const bool USE_KINEMATIC_CALIBRATION_ = false;
+
+  /* estimate the trim while driving straight, until it settles, and persist
+   * it over the operator trim; opt in only, it continues from the loaded trim */
+  const bool USE_AUTO_TRIM_ = false;
+  const float AUTO_TRIM_SAVE_TOLERANCE_ = 0.001;
   /* limit to the trim that can be applied; more than this means a robot issue*/
   const float MAX_CURVATURE_CORRECTION_ = .15;
 
   int robotmode_num_ = Control::INDEPENDENT_WHEEL;
 
   const double CONTROL_LOOP_TIMEOUT_MS_ = 400;
+  /* a path is dropped unless follow_path or set_robot_pose comes again
+   * within this time */
+  const double PATH_TIMEOUT_MS_ = 1000;
+  /* older tachometer counts do not move the odometry nor the path */
+  const float TACHOMETER_TIMEOUT_ = 0.2; /* s */
 
-  std::unique_ptr<Control::SkidRobotMotionController> skid_control_;
+  std::unique_ptr<Control::SkidRobotMotionController<4>> skid_control_;
   std::unique_ptr<CommBase> comm_base_;
   std::string comm_type_;
 
+  /* set in lockstep mode, where the caller drives the robot through step() */
+  CommLockstep *lockstep_comm_ = nullptr;
+  /* written by step(), read by the commands, which may come from another
+   * thread */
+  std::atomic<std::chrono::steady_clock::time_point> sim_time_{
+      std::chrono::steady_clock::time_point()};
+
   std::thread write_to_robot_thread_;
   std::thread motor_speed_update_thread_;
-  std::mutex robotstatus_mutex_;
+  Utilities::ProfiledMutex robotstatus_mutex_{"pro_2_robotstatus"};
 
   /* main data structure */
   robotData robotstatus_;
 
+  /* arrival time of the latest wheelspeed feedback */
+  std::chrono::steady_clock::time_point feedback_ts_;
+
+  /* tachometer odometry, valid once every motor has reported a count */
+  std::unique_ptr<Control::TachometerOdometry<4>> tach_odometry_;
+  Control::wheel_counts<4> tachometer_counts_;
+  uint8_t tachometer_received_ = 0;
+  /* one bit per VESC which sent its wheelspeed status */
+  uint8_t status_received_ = 0;
+  std::array<std::chrono::steady_clock::time_point, 4> tachometer_ts_;
+
+  /* online calibration of the geometry, applied by the motor control loop */
+  std::unique_ptr<Control::KinematicCalibrator> calibrator_;
+  std::optional<Control::robot_geometry> pending_geometry_;
+  /* tachometer counts at the last reference, under robotstatus_mutex_ */
+  std::optional<Control::wheel_counts<4>> reference_counts_;
+
+  /* path tracking, run by the motor control loop on the tachometer odometry */
+  std::unique_ptr<Control::PathFollower> path_follower_;
+  /* last follow_path or set_robot_pose, the heartbeat of the path */
+  std::chrono::milliseconds path_ts_{0};
+
   double motors_speeds_[4];
   double trimvalue_ = 0;
   
@@ -2,6 +2,7 @@
 
 #include "protocol_base.hpp"
 #include "utilities.hpp"
+#include "vesc.hpp"
 namespace RoverRobotics
 {
   class Zero2ProtocolObject;
@@ -17,17 +18,49 @@ private:
                                              .wheel_radius = 0.2667,
                                              .center_of_mass_x_offset = 0,
                                              .center_of_mass_y_offset = 0};
+  const Control::skid_steer_params SKID_STEER_PARAMS_ =
+      Control::IDEAL_SKID_STEER;
+  const Control::pure_pursuit_params PURE_PURSUIT_PARAMS_ =
+      Control::DEFAULT_PURE_PURSUIT;
   const float MOTOR_RPM_TO_WHEEL_RPM_RATIO_ = 96 *2; 
   const float OPEN_LOOP_MAX_RPM_ = 17000 / MOTOR_RPM_TO_WHEEL_RPM_RATIO_;
+  /* first-order response of a wheel to a step in duty, used by the predictor */
+  const float WHEEL_TIME_CONSTANT_ = 0.15;
+  const bool USE_LATENCY_COMPENSATION_ = false;
+  /* keep the duty to speed relation over the discharge; referenced to the
+   * voltage of the sysid run when persisted, otherwise to the first reading */
+  const bool USE_VOLTAGE_COMPENSATION_ = true;
+  float nominal_battery_voltage_ = 0;
+  /* breakaway duties are identified by the sysid tool, none by default */
+  Control::deadband_compensation<2> deadband_compensation_ = {
+      .breakaway_duty = {0, 0}, .blend_duty = 0.02};
+  /* identified by the sysid tool when persisted, otherwise nominal */
+  Control::plant_model plant_model_ = {.gain = OPEN_LOOP_MAX_RPM_,
+                                       .time_constant = WHEEL_TIME_CONSTANT_,
+                                       .dead_time = 0};
+  /* tachometer counts per revolution of the wheel */
+  const float TACH_COUNTS_PER_WHEEL_REV_ =
+      6 * MOTOR_RPM_TO_WHEEL_RPM_RATIO_;
+  /* fit wheel radius and wheel base against the yaw rate and displacement
+   * references, and persist them; opt in only, the yaw rate is also injected
+   * for the yaw rate loop and the automatic trim */
+  const bool USE_KINEMATIC_CALIBRATION_ = false;
+  /* estimate the trim while driving straight, until it settles, and persist
+   * it over the operator trim; opt in only, it continues from the loaded trim */
+  const bool USE_AUTO_TRIM_ = false;
+  const float AUTO_TRIM_SAVE_TOLERANCE_ = 0.001;
   /* limit to the trim that can be applied; more than this means a robot issue*/
   const float MAX_CURVATURE_CORRECTION_ = .15;
   const int MOTOR_NEUTRAL_ = 0;
   const float MOTOR_MAX_ = 0.95;
   const float MOTOR_MIN_ = -0.95;
   const float LINEAR_JERK_LIMIT_ = 5;
-  const double odom_angular_coef_ = 2.3;    
-  const double odom_traction_factor_ = 0.7; 
   const double CONTROL_LOOP_TIMEOUT_MS_ = 200;
+  /* a path is dropped unless follow_path or set_robot_pose comes again
+   * within this time */
+  const double PATH_TIMEOUT_MS_ = 1000;
+  /* older tachometer counts do not move the odometry nor the path */
+  const float TACHOMETER_TIMEOUT_ = 0.2; /* s */
   const uint8_t PAYLOAD_BYTE_SIZE_ = 2;
   const uint8_t STOP_BYTE_ = 3;
   const uint8_t MSG_SIZE_ = 5;
@@ -35,19 +68,55 @@ private:
   const uint8_t START_BYTE_ = 2;
   const int termios_baud_code_ = 4098; // THIS = baudrate of 115200
   const int RECEIVE_MSG_LEN_ = 1;
+  /* each controller gets a few tries to report its firmware at connect */
+  const int FIRMWARE_PROBE_ATTEMPTS_ = 3;
+  const int FIRMWARE_PROBE_TIMEOUT_MS_ = 100;
+  /* on CAN, each controller has to broadcast its status within this time */
+  const int STATUS_BROADCAST_TIMEOUT_MS_ = 500;
+  /* fields the control loop and status use, the rest is not polled when the
+   * firmware can select */
+  const uint32_t SELECTIVE_VALUES_MASK_ =
+      (1 << VALUES_TEMP_FET) | (1 << VALUES_TEMP_MOTOR) |
+      (1 << VALUES_INPUT_CURRENT) | (1 << VALUES_RPM) | (1 << VALUES_V_IN) |
+      (1 << VALUES_TACHOMETER) | (1 << VALUES_FAULT) |
+      (1 << VALUES_CONTROLLER_ID);
   float left_trim_ = 1;
   float right_trim_ = 1;
   float geometric_decay_ = .99;
   int robotmode_num_ = 0;
   const int ROBOT_MODES_ = 2;
-  std::unique_ptr<Control::SkidRobotMotionController> skid_control_;
+  std::unique_ptr<Control::SkidRobotMotionController<2>> skid_control_;
   std::unique_ptr<CommBase> comm_base_;
   std::string comm_type_;
 
-  std::mutex robotstatus_mutex_;
+  Utilities::ProfiledMutex robotstatus_mutex_{"zero_2_robotstatus"};
   robotData robotstatus_;
+  /* arrival time of the latest wheelspeed feedback */
+  std::chrono::steady_clock::time_point feedback_ts_;
+  /* tachometer odometry, valid once both motors have reported a count */
+  std::unique_ptr<Control::TachometerOdometry<2>> tach_odometry_;
+  int32_t left_tachometer_;
+  int32_t right_tachometer_;
+  uint8_t tachometer_received_ = 0;
+  std::array<std::chrono::steady_clock::time_point, 2> tachometer_ts_;
+  /* online calibration of the geometry, applied by the motor control loop */
+  std::unique_ptr<Control::KinematicCalibrator> calibrator_;
+  std::optional<Control::robot_geometry> pending_geometry_;
+  /* tachometer counts at the last reference, under robotstatus_mutex_ */
+  std::optional<Control::wheel_counts<2>> reference_counts_;
+  /* path tracking, run by the motor control loop on the tachometer odometry */
+  std::unique_ptr<Control::PathFollower> path_follower_;
+  /* last follow_path or set_robot_pose, the heartbeat of the path */
+  std::chrono::milliseconds path_ts_{0};
   double motors_speeds_[2];
-  double trimvalue_;
+  /* firmware of each controller, probed at connect */
+  vesc::vescFirmware firmware_[2];
+  vesc::vescCapabilities capabilities_[2];
+  /* side the next COMM_FW_VERSION reply belongs to, it carries no id */
+  int probe_side_ = LEFT_SIDE;
+  /* encode and decode the native VESC CAN frames */
+  vesc::BridgedVescArray vescArray_;
+  double trimvalue_ = 0;
   std::thread write_to_robot_thread_;
   std::thread slow_data_write_thread_;
   std::thread motor_speed_update_thread_;
@@ -59,42 +128,105 @@ private:
   Control::robot_motion_mode_t robot_mode_;
   Control::angular_scaling_params angular_scaling_params_;
   Control::pid_gains pid_;
-  double vesc_fet_temp_;
-  double vesc_motor_temp_;
-  float vesc_all_motor_current_;
-  float vesc_all_input_current_;
-  double vesc_id_;
-  double vesc_iq_;
-  float vesc_duty_;
-  int vesc_rpm_;
-  double vesc_v_in_;
-  double vesc_amp_hours_;
-  double vesc_amp_hours_charged_;
-  double vesc_watt_hours_;
-  double vesc_watt_hours_charged_;
-  int vesc_tach_;
-  int vesc_tach_abs_;
-  int vesc_fault_;
-  double vesc_speed_;
-  uint vesc_dev_id_;
-  double vesc_pid_pos_;
+  /* fields of a values reply */
+  struct vesc_values
+  {
+    double fet_temp;
+    double motor_temp;
+    float motor_current;
+    float input_current;
+    double id;
+    double iq;
+    float duty;
+    int rpm;
+    double v_in;
+    double amp_hours;
+    double amp_hours_charged;
+    double watt_hours;
+    double watt_hours_charged;
+    int tach;
+    int tach_abs;
+    int fault;
+    double pid_pos;
+    uint dev_id;
+  };
+  /* latest validated values reply of a controller, kept raw and only decoded
+   * once something reads the status */
+  struct values_frame
+  {
+    uint8_t fields[256];
+    int length;
+    uint32_t mask;
+    std::chrono::steady_clock::time_point received_ts;
+    bool valid;
+    bool decoded;
+    vesc_values values;
+  };
+  values_frame values_frames_[2] = {};
 
+  /* VESC controller ids, on the UART forwarding and the CAN bus */
   enum robot_motors
   {
     LEFT_MOTOR = 1,
     RIGHT_MOTOR = 8
   };
+  /* index of each side in motors_speeds_ */
+  enum robot_sides
+  {
+    LEFT_SIDE = 0,
+    RIGHT_SIDE = 1
+  };
+  /* how the status of both controllers is collected, fastest last */
+  enum telemetry_mode
+  {
+    FULL_VALUES_POLLING = 0,
+    SELECTIVE_VALUES_POLLING = 1,
+    STATUS_BROADCAST = 2
+  };
+  telemetry_mode telemetry_mode_ = FULL_VALUES_POLLING;
   /*
    * @brief Thread Driven function that will send commands to the robot at set
    * interval to get its data
    * @param sleeptime sleep time between each cycle
    */
   void send_getvalues_command(int sleeptime);
+  /*
+   * @brief Query the firmware of both controllers and pick the telemetry mode
+   * they support, must run before the polling thread starts. On CAN, wait for
+   * the status broadcasts of both controllers instead
+   */
+  void probe_firmware();
+  /*
+   * @brief Write a payload to a controller over UART, forwarded over CAN by
+   * the left controller when addressed to the right one
+   * @param vesc_id is the id of the controller
+   * @param payload is the command id followed by its arguments
+   */
+  void send_vesc_payload(uint8_t vesc_id, std::vector<uint8_t> payload);
+  /*
+   * @brief Decode the fields of a COMM_GET_VALUES(_SELECTIVE) reply
+   * @param fields points to the first field of the reply
+   * @param length is the size of the fields in bytes
+   * @param mask has a bit set for every field present, see values_field
+   * @param values receives the decoded fields, missing ones are left as is
+   */
+  void decode_values(const uint8_t *fields, int length, uint32_t mask,
+                     vesc_values &values);
+  /*
+   * @brief Decode the values replies received since the last call into the
+   * status, call with robotstatus_mutex_ held before reading it
+   */
+  void refresh_values();
   /*
    * @brief Helper function that will send motors commands to the robot at set
    * interval of the motor control loops thread
    */
   void send_motors_commands();
+  /*
+   * @brief Decode a status broadcast received over the CAN transport
+   * @param robotmsg is a CAN frame in the CommCan layout
+   */
+  void unpack_can_response(std::vector<uint8_t> robotmsg);
   /*
    * @brief Thread Driven function update the robot motors using pid
    * @param sleeptime sleep time between each cycle
@@ -107,6 +239,31 @@ private:
    */
   void load_persistent_params();
 
+  /*
+   * @brief apply a (calibrated) geometry to the controller and odometry, only
+   * call from the constructor or the motor control loop
+   * @param robot_geometry is the new robot geometry
+   */
+  void apply_robot_geometry(Control::robot_geometry robot_geometry);
+
+  /*
+   * @brief persist the latest calibrated geometry and hand it to the motor
+   * control loop
+   */
+  void publish_calibration();
+
+  /*
+   * @brief keep and persist the trim found by the automatic trim
+   * @param trim is the settled trim value
+   */
+  void save_auto_trim(double trim);
+
+  /*
+   * @brief whether every motor reported a tachometer count recently enough to
+   * move the odometry, call with robotstatus_mutex_ held
+   */
+  bool tachometer_fresh();
+
   const unsigned short crc16_tab[256] = {0x0000, 0x1021, 0x2042, 0x3063, 0x4084,
                                          0x50a5, 0x60c6, 0x70e7, 0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad,
                                          0xe1ce, 0xf1ef, 0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7,
@@ -167,6 +324,11 @@ public:
    * @return structure of statusData
    */
   robotData info_request() override;
+  /*
+   * @brief Request Diagnostic Metrics
+   * @return vector of metric name and value pairs
+   */
+  std::vector<std::pair<std::string, double>> metrics_request() override;
   /*
    * @brief Set Robot velocity
    * Set Robot velocity: IF robot_mode_ TRUE, this function will attempt a
@@ -175,10 +337,46 @@ public:
    * robot_mode_ FALSE, this function simply translates the commanded
    * velocities into motor duty cycles and there is no expectation that the
    * commanded velocities will be realized by the robot. In robot_mode_ FALSE
-   * mode, motor power is roughly proportional to commanded velocity.
+   * mode, motor power is roughly proportional to commanded velocity. A
+   * velocity command also ends a path being followed.
    * @param controllarray an double array of control in m/s
    */
   void set_robot_velocity(double *controllarray) override;
+  /*
+   * @brief Set Measured Yaw Rate
+   * Inject an externally measured yaw rate (ie from a gyro) which is used as
+   * heading rate feedback instead of the rate derived from the wheels
+   * @param double yaw rate in rad/s, positive counterclockwise
+   */
+  void set_measured_yaw_rate(double) override;
+  /*
+   * @brief Set Reference Displacement
+   * Inject a ground-truth displacement (ie from motion capture or a surveyed
+   * course) travelled since the previous call, which is used to calibrate the
+   * wheel radius and wheel base
+   * @param double distance travelled in m
+   * @param double heading change in rad, positive counterclockwise
+   */
+  void set_reference_displacement(double, double) override;
+  /*
+   * @brief Follow Path
+   * Track a path from the motor control loop on the wheel tachometers, which
+   * then replaces the velocity commands until the last point is reached, a
+   * new path or a velocity command is given, or neither this nor
+   * set_robot_pose is called again within the path timeout of the robot
+   * @param std::vector<path_point> points in order, empty to stop following
+   * @return bool true, the robot follows paths
+   */
+  bool follow_path(std::vector<Control::path_point>) override;
+  /*
+   * @brief Set Robot Pose
+   * Inject an external pose estimate (ie from localization) in the frame of
+   * the paths given to follow_path, which corrects the odometry drift
+   * @param double x in m
+   * @param double y in m
+   * @param double heading in rad, positive counterclockwise
+   */
+  void set_robot_pose(double, double, double) override;
   /*
    * @brief Unpack bytes from the robot
    * This is meant to use as a callback function when there are bytes available
@@ -205,8 +403,37 @@ public:
 
   enum uart_param
   {
+    COMM_FW_VERSION = 0,
     COMM_GET_VALUES = 4,
     COMM_SET_DUTY = 5,
-    COMM_CAN_FORWARD = 34
+    COMM_CAN_FORWARD = 34,
+    COMM_GET_VALUES_SELECTIVE = 50
+  };
+
+  /* bit of each field in a COMM_GET_VALUES(_SELECTIVE) mask, in reply order */
+  enum values_field
+  {
+    VALUES_TEMP_FET = 0,
+    VALUES_TEMP_MOTOR,
+    VALUES_MOTOR_CURRENT,
+    VALUES_INPUT_CURRENT,
+    VALUES_ID,
+    VALUES_IQ,
+    VALUES_DUTY,
+    VALUES_RPM,
+    VALUES_V_IN,
+    VALUES_AMP_HOURS,
+    VALUES_AMP_HOURS_CHARGED,
+    VALUES_WATT_HOURS,
+    VALUES_WATT_HOURS_CHARGED,
+    VALUES_TACHOMETER,
+    VALUES_TACHOMETER_ABS,
+    VALUES_FAULT,
+    VALUES_PID_POS,
+    VALUES_CONTROLLER_ID,
+    VALUES_TEMP_MOSFETS,
+    VALUES_VD,
+    VALUES_VQ,
+    NUM_VALUES_FIELDS
   };
 };
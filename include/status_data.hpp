@@ -52,6 +52,13 @@ struct robotData {
   double linear_vel;
   double angular_vel;
 
+  // Odometry Info (from motor controller tachometers)
+  double odom_left_distance;
+  double odom_right_distance;
+  double odom_x;
+  double odom_y;
+  double odom_heading;
+
   // Velocity Info
   double cmd_linear_vel;
   double cmd_angular_vel;
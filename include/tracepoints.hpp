@@ -0,0 +1,84 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+/*
+ * USDT static tracepoints of the "librover" provider, for bpftrace or perf
+ * without rebuilding or logging. Every probe carries (id, value, timestamp):
+ *
+ *   frame_receive    device id (can id, 0 on serial or lockstep), bytes read
+ *   parse_complete   device id (vesc id, 0 when unknown), message type
+ *   control_begin    wheel count, operating mode
+ *   control_end      wheel count, operating mode
+ *   command_enqueue  device id (can id, 0 on serial or lockstep), bytes
+ *                    handed to comm
+ *   tx_write         device id (can id, 0 on serial or lockstep), bytes
+ *                    written
+ *
+ * The timestamp is the steady clock in ns, the clock of bpftrace's nsecs.
+ * Each probe is guarded by its semaphore, which the tracer raises when it
+ * attaches: until then a probe is a nop, a load and a predicted branch, and
+ * its arguments are not evaluated. Without <sys/sdt.h> (systemtap-sdt-dev)
+ * or with LIBROVER_NO_TRACEPOINTS defined (the LIBROVER_TRACEPOINTS cmake
+ * option), the probes compile to nothing.
+ *
+ * A build with the probes lists them, each with a semaphore address, in
+ *
+ *   readelf -n /usr/lib/liblibrover.so      (stapsdt notes)
+ *   bpftrace -l 'usdt:/usr/lib/liblibrover.so:librover:*'
+ *
+ *   bpftrace -e 'usdt:/usr/lib/liblibrover.so:librover:tx_write
+ *                { @bytes[arg0] = sum(arg1); }'
+ */
+
+#if defined(__has_include) && !defined(LIBROVER_NO_TRACEPOINTS)
+#if __has_include(<sys/sdt.h>)
+#define LIBROVER_TRACEPOINTS
+#endif
+#endif
+
+#ifdef LIBROVER_TRACEPOINTS
+/* the notes only carry the semaphore addresses with this set */
+#ifndef _SDT_HAS_SEMAPHORES
+#define _SDT_HAS_SEMAPHORES 1
+#endif
+#include <sys/sdt.h>
+
+/* one semaphore per probe, named as sys/sdt.h expects */
+#define LIBROVER_TRACE_SEMAPHORE(probe)                                        \
+  extern "C" __extension__ unsigned short librover_##probe##_semaphore        \
+      __attribute__((unused)) __attribute__((section(".probes")))
+
+LIBROVER_TRACE_SEMAPHORE(frame_receive);
+LIBROVER_TRACE_SEMAPHORE(parse_complete);
+LIBROVER_TRACE_SEMAPHORE(control_begin);
+LIBROVER_TRACE_SEMAPHORE(control_end);
+LIBROVER_TRACE_SEMAPHORE(command_enqueue);
+LIBROVER_TRACE_SEMAPHORE(tx_write);
+
+#define LIBROVER_TRACE(probe, id, value)                                       \
+  do {                                                                         \
+    if (__builtin_expect(librover_##probe##_semaphore, 0)) {                   \
+      STAP_PROBE3(librover, probe, static_cast<int64_t>(id),                   \
+                  static_cast<int64_t>(value), Utilities::traceTimestamp());   \
+    }                                                                          \
+  } while (0)
+#else
+/* the arguments stay used, but unevaluated, as behind an idle semaphore */
+#define LIBROVER_TRACE(probe, id, value) \
+  do {                                   \
+    (void)sizeof(id);                    \
+    (void)sizeof(value);                 \
+  } while (0)
+#endif
+
+namespace Utilities {
+/*
+ * @brief timestamp of the tracepoints, steady clock in ns
+ */
+inline uint64_t traceTimestamp() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+}  // namespace Utilities
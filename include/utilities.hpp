@@ -4,6 +4,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
 #include <string>
@@ -14,8 +18,114 @@
 namespace Utilities {
 /* classes */
 class PersistentParams;
+class ProfiledMutex;
 }  // namespace Utilities
 
+class Utilities::ProfiledMutex {
+ public:
+  /* constructors */
+
+  /*
+   * @brief a mutex that can record how long it is waited for and held, and
+   * from where. Profiling is off unless the library is built with
+   * PROFILE_LOCKS, LIBROVER_PROFILE_LOCKS is set in the environment, or it
+   * is switched on with setProfiling; when off a lock costs one atomic load
+   * more than a std::mutex.
+   * @param name is the name of the lock in the metrics
+   */
+  ProfiledMutex(std::string name);
+  ~ProfiledMutex();
+  ProfiledMutex(const ProfiledMutex &) = delete;
+  ProfiledMutex &operator=(const ProfiledMutex &) = delete;
+
+  /*
+   * @brief lock, recording the wait at the call site when profiling. The
+   * call site is filled in by the compiler; locks taken through a standard
+   * guard (std::scoped_lock) are attributed to the guard.
+   */
+  void lock(const char *file = __builtin_FILE(), int line = __builtin_LINE());
+
+  /*
+   * @brief lock without waiting
+   * @return true if the lock was taken
+   */
+  bool try_lock(const char *file = __builtin_FILE(),
+                int line = __builtin_LINE());
+
+  /*
+   * @brief unlock, recording the hold time when profiling
+   */
+  void unlock();
+
+  /*
+   * @brief switch the profiling of every lock on or off
+   */
+  static void setProfiling(bool enabled);
+
+  /*
+   * @brief get whether the locks are profiled
+   */
+  static bool getProfiling();
+
+  /*
+   * @brief report every lock of the process that was profiled: counts, wait
+   * and hold histograms (s), and the wait and hold time of each call site
+   * @return vector of metric name and value pairs
+   */
+  static std::vector<std::pair<std::string, double>> metrics();
+
+ private:
+  /* histogram bucket upper bounds are 1us, 10us, 100us, 1ms, 10ms, more */
+  static const int HISTOGRAM_BUCKETS_ = 6;
+  /* call sites beyond this are counted on the last one */
+  static const int MAX_SITES_ = 16;
+
+  struct site_stats {
+    const char *file;
+    int line;
+    uint64_t acquisitions;
+    uint64_t contended;
+    double wait_time; /* s */
+    double hold_time; /* s */
+  };
+
+  static std::atomic<bool> profiling_;
+
+  std::string name_;
+  std::mutex mutex_;
+
+  /* only touched by the holder of mutex_ */
+  std::chrono::steady_clock::time_point hold_start_;
+  int holder_site_;
+
+  /* statistics, read by the metrics while the lock may be held */
+  std::mutex stats_mutex_;
+  uint64_t acquisitions_;
+  uint64_t contended_;
+  double wait_max_;
+  double hold_max_;
+  std::array<uint64_t, HISTOGRAM_BUCKETS_> wait_histogram_;
+  std::array<uint64_t, HISTOGRAM_BUCKETS_> hold_histogram_;
+  std::array<site_stats, MAX_SITES_> sites_;
+  int site_count_;
+
+  /*
+   * @brief record an acquisition by the caller, who now holds mutex_
+   */
+  void recordAcquisition_(const char *file, int line, bool contended,
+                          std::chrono::steady_clock::time_point wait_start);
+
+  /*
+   * @brief get the histogram bucket of a duration
+   */
+  static int bucket_(double seconds);
+
+  /*
+   * @brief append the metrics of this lock
+   */
+  void appendMetrics_(std::vector<std::pair<std::string, double>> &metrics);
+};
+
 class Utilities::PersistentParams {
  private:
   std::string robot_param_path_;
@@ -24,7 +134,7 @@ class Utilities::PersistentParams {
   std::vector<std::pair<std::string, double>> read_params_from_file_();
 
   std::vector<std::string> split_(std::string str, std::string token);
-  std::mutex file_mutex;
+  ProfiledMutex file_mutex{"persistent_params"};
 
  public:
   PersistentParams(std::string robot_param_path);
@@ -98,4 +98,29 @@ class OdomControl {
   double PID(double error, double dt);
   double feedThroughControl();
 };
+
+class SigmaDeltaQuantizer {
+ public:
+  /*
+   * @brief Sigma Delta Quantizer default constructor
+   */
+  SigmaDeltaQuantizer();
+  /*
+   * @brief round a value to an integer command, carrying the rounding error
+   * over to the next call so the average of the commands matches the average
+   * of the values
+   * @param value A double, the continuous command
+   * @param max A int, the largest command
+   * @param min A int, the smallest command
+   * @return the integer command
+   */
+  int quantize(double value, int max, int min);
+  /*
+   * @brief drop the carried rounding error
+   */
+  void reset();
+
+ private:
+  double residual_;
+};
 }  // namespace RoverRobotics
\ No newline at end of file
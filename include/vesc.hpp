@@ -1,26 +1,31 @@
 #pragma once
 #include <cstdint>
 #include <optional>
+#include <string>
 #include <vector>
 
 namespace vesc {
 class BridgedVescArray;
 
+enum vescPacketFlags : uint32_t {
+  PACKET_FLAG = 0x80000000,
+  RPM = 0x00000900,
+  CURRENT = 0x00000100,
+  DUTY = 0x00000000,
+  STATUS_5 = 0x00001B00
+};
+
 typedef struct {
   int vescId;
+  vescPacketFlags packetType;
   float current;
   float rpm;
   float duty;
+  int32_t tachometer;
+  float voltage;
   bool dataValid;
 } vescChannelStatus;
 
-enum vescPacketFlags : uint32_t {
-  PACKET_FLAG = 0x80000000,
-  RPM = 0x00000900,
-  CURRENT = 0x00000100,
-  DUTY = 0x00000000
-};
-
 typedef struct {
   uint8_t vescId;
   vescPacketFlags commandType;
@@ -37,6 +42,37 @@ const float RPM_SCALING_FACTOR = 60.0 / 1000.0;
 const float DUTY_SCALING_FACTOR = 1.0 / 10.0;
 const float CURRENT_SCALING_FACTOR = 1.0 / 10.0;
 const float DUTY_COMMAND_SCALING_FACTOR = 100000.0;
+const float VOLTAGE_SCALING_FACTOR = 1.0 / 10.0;
+
+/* the tachometer advances 6 counts per electrical revolution */
+const float TACH_COUNTS_PER_ELECTRICAL_REV = 6.0;
+
+/* firmware reported by COMM_FW_VERSION */
+typedef struct {
+  uint8_t major;
+  uint8_t minor;
+  std::string hardware;
+  bool valid;
+} vescFirmware;
+
+/* telemetry features the firmware of a controller supports */
+typedef struct {
+  bool selectiveValues;
+  bool statusBroadcasts;
+} vescCapabilities;
+
+/* first firmware with COMM_GET_VALUES_SELECTIVE */
+const uint8_t SELECTIVE_VALUES_MIN_FW_MAJOR = 3;
+const uint8_t SELECTIVE_VALUES_MIN_FW_MINOR = 40;
+/* first firmware broadcasting the full status family, up to STATUS_5 */
+const uint8_t STATUS_BROADCASTS_MIN_FW_MAJOR = 5;
+const uint8_t STATUS_BROADCASTS_MIN_FW_MINOR = 0;
+
+/*
+ * @brief capabilities of a controller from its firmware version, none if the
+ * firmware is unknown
+ */
+vescCapabilities capabilitiesFromFirmware(vescFirmware firmware);
 
 const uint32_t CONTENT_MASK = 0xFFFFFF00;
 const uint32_t ID_MASK = 0x000000FF;
@@ -0,0 +1,268 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "protocol_pro_2.hpp"
+using namespace RoverRobotics;
+
+/*
+ * Heap allocation guard. Replaces operator new and malloc for the whole
+ * process and counts the allocations each thread makes while it is armed.
+ * Every protocol object that runs on an in-memory transport is driven in
+ * each motion mode: a warm-up lets the first-use allocations happen, then
+ * the RX path (frames handed to unpack_comm_response) and a lockstep step
+ * (control tick and motor commands) are armed for the steady state. Any
+ * allocation there is reported and fails the run.
+ *
+ * usage: alloc_guard.out [warmup_ticks] [ticks] [--abort]
+ *
+ * --abort stops at the first armed allocation, so a debugger shows where it
+ * came from. Only the Pro 2 has a lockstep transport so far; the protocols
+ * bound to a serial port or a CAN bus need hardware to run.
+ */
+
+/* glibc's allocator underneath the replacements */
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+
+/* per thread, constant initialized so the allocator can use it anytime */
+static thread_local bool armed_ = false;
+static thread_local uint64_t allocations_ = 0;
+static thread_local uint64_t allocated_bytes_ = 0;
+static bool abort_on_allocation_ = false;
+
+static void count_allocation(size_t size) {
+  if (!armed_) return;
+  allocations_++;
+  allocated_bytes_ += size;
+  if (abort_on_allocation_) {
+    armed_ = false;
+    fprintf(stderr, "allocation of %zu bytes in an armed phase\n", size);
+    abort();
+  }
+}
+
+extern "C" void *malloc(size_t size) {
+  count_allocation(size);
+  return __libc_malloc(size);
+}
+
+extern "C" void *calloc(size_t count, size_t size) {
+  count_allocation(count * size);
+  return __libc_calloc(count, size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size) {
+  count_allocation(size);
+  return __libc_realloc(pointer, size);
+}
+
+static void *new_allocation(size_t size) {
+  count_allocation(size);
+  void *pointer = __libc_malloc(size ? size : 1);
+  if (!pointer) throw std::bad_alloc();
+  return pointer;
+}
+
+static void *new_aligned_allocation(size_t size, std::align_val_t align) {
+  count_allocation(size);
+  size_t alignment = static_cast<size_t>(align);
+  void *pointer =
+      aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+  if (!pointer) throw std::bad_alloc();
+  return pointer;
+}
+
+void *operator new(size_t size) { return new_allocation(size); }
+void *operator new[](size_t size) { return new_allocation(size); }
+void *operator new(size_t size, std::align_val_t align) {
+  return new_aligned_allocation(size, align);
+}
+void *operator new[](size_t size, std::align_val_t align) {
+  return new_aligned_allocation(size, align);
+}
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+  count_allocation(size);
+  return __libc_malloc(size ? size : 1);
+}
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+  count_allocation(size);
+  return __libc_malloc(size ? size : 1);
+}
+void operator delete(void *pointer) noexcept { free(pointer); }
+void operator delete[](void *pointer) noexcept { free(pointer); }
+void operator delete(void *pointer, size_t) noexcept { free(pointer); }
+void operator delete[](void *pointer, size_t) noexcept { free(pointer); }
+void operator delete(void *pointer, std::align_val_t) noexcept {
+  free(pointer);
+}
+void operator delete[](void *pointer, std::align_val_t) noexcept {
+  free(pointer);
+}
+void operator delete(void *pointer, size_t, std::align_val_t) noexcept {
+  free(pointer);
+}
+void operator delete[](void *pointer, size_t, std::align_val_t) noexcept {
+  free(pointer);
+}
+
+/* allocations counted by one armed phase */
+struct guard_phase {
+  std::string name;
+  uint64_t ticks;
+  uint64_t allocations;
+  uint64_t bytes;
+};
+
+/* arms the calling thread for its lifetime, adding the count to a phase */
+class ArmedScope {
+ public:
+  ArmedScope(guard_phase &phase, bool counted) : phase_(phase) {
+    allocations_ = 0;
+    allocated_bytes_ = 0;
+    armed_ = counted;
+  }
+  ~ArmedScope() {
+    armed_ = false;
+    phase_.allocations += allocations_;
+    phase_.bytes += allocated_bytes_;
+  }
+
+ private:
+  guard_phase &phase_;
+};
+
+const float TICK_PERIOD_ = 0.03; /* s, the rate of the motor control loop */
+const int DEFAULT_WARMUP_TICKS_ = 200;
+const int DEFAULT_TICKS_ = 1000;
+
+/* simulated drive, close enough to keep every controller busy */
+const float WHEEL_RPM_ = 120;
+const float MOTOR_CURRENT_ = 4;           /* A */
+const float BUS_VOLTAGE_ = 25;            /* V */
+/* per s, from the tachometer counts per wheel rev of the Pro 2 */
+const float TACH_COUNTS_PER_WHEEL_RPM_ =
+    vesc::TACH_COUNTS_PER_ELECTRICAL_REV / vesc::RPM_SCALING_FACTOR / 60;
+
+/*
+ * @brief CAN frame of a VESC status broadcast, in the CommCan layout
+ */
+static std::vector<uint8_t> status_frame(uint32_t packet, uint8_t vesc_id,
+                                         int32_t value32, int16_t value16a,
+                                         int16_t value16b) {
+  uint32_t can_id = vesc::vescPacketFlags::PACKET_FLAG | packet | vesc_id;
+  return {static_cast<uint8_t>(can_id >> 24),
+          static_cast<uint8_t>(can_id >> 16),
+          static_cast<uint8_t>(can_id >> 8),
+          static_cast<uint8_t>(can_id),
+          8,
+          static_cast<uint8_t>(value32 >> 24),
+          static_cast<uint8_t>(value32 >> 16),
+          static_cast<uint8_t>(value32 >> 8),
+          static_cast<uint8_t>(value32),
+          static_cast<uint8_t>(value16a >> 8),
+          static_cast<uint8_t>(value16a),
+          static_cast<uint8_t>(value16b >> 8),
+          static_cast<uint8_t>(value16b)};
+}
+
+/*
+ * @brief run a Pro 2 in lockstep in one motion mode, arming its RX and step
+ */
+static void guard_pro2(Control::robot_motion_mode_t mode, int warmup_ticks,
+                       int ticks, std::vector<guard_phase> &phases) {
+  Control::pid_gains gains = {0.0005, 0.002, 0};
+  Control::angular_scaling_params angular_scaling_params = {0, 1, 0, 1, 1};
+  /* owned and destroyed through the base, by the destructor in the library;
+   * this tool may be built with other flags (DEBUG) than the library */
+  std::unique_ptr<BaseProtocolObject> robot =
+      std::make_unique<Pro2ProtocolObject>("sim", "lockstep", mode, gains,
+                                           angular_scaling_params);
+
+  std::string mode_name = "pro2_mode_" + std::to_string(mode);
+  phases.push_back({mode_name + "_rx", 0, 0, 0});
+  phases.push_back({mode_name + "_step", 0, 0, 0});
+  guard_phase &rx_phase = phases[phases.size() - 2];
+  guard_phase &step_phase = phases.back();
+
+  double command[2] = {0.5, 0.2};
+  std::vector<std::vector<uint8_t>> frames;
+  for (int tick = 0; tick < warmup_ticks + ticks; tick++) {
+    double sim_time = tick * TICK_PERIOD_;
+    bool counted = tick >= warmup_ticks;
+
+    /* the frames of this tick are made before arming */
+    frames.clear();
+    int32_t tachometer = static_cast<int32_t>(sim_time * WHEEL_RPM_ *
+                                              TACH_COUNTS_PER_WHEEL_RPM_);
+    for (uint8_t vesc_id = FRONT_LEFT; vesc_id <= BACK_RIGHT; vesc_id++) {
+      frames.push_back(status_frame(
+          vesc::vescPacketFlags::RPM, vesc_id,
+          static_cast<int32_t>(WHEEL_RPM_ / vesc::RPM_SCALING_FACTOR),
+          static_cast<int16_t>(MOTOR_CURRENT_ / vesc::CURRENT_SCALING_FACTOR),
+          0));
+      frames.push_back(status_frame(
+          vesc::vescPacketFlags::STATUS_5, vesc_id, tachometer,
+          static_cast<int16_t>(BUS_VOLTAGE_ / vesc::VOLTAGE_SCALING_FACTOR),
+          0));
+    }
+    robot->set_robot_velocity(command);
+
+    {
+      ArmedScope armed(rx_phase, counted);
+      for (auto &frame : frames) robot->unpack_comm_response(std::move(frame));
+    }
+    {
+      ArmedScope armed(step_phase, counted);
+      robot->step(sim_time);
+    }
+    robot->take_tx();
+
+    if (counted) {
+      rx_phase.ticks++;
+      step_phase.ticks++;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<std::string> args;
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) == "--abort") {
+      abort_on_allocation_ = true;
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+  int warmup_ticks = args.size() > 0 ? std::stoi(args[0])
+                                     : DEFAULT_WARMUP_TICKS_;
+  int ticks = args.size() > 1 ? std::stoi(args[1]) : DEFAULT_TICKS_;
+
+  /* the phases are reserved so the armed scopes keep valid references */
+  std::vector<guard_phase> phases;
+  phases.reserve(2 * Control::NUM_MOTION_MODES);
+  for (int mode = 0; mode < Control::NUM_MOTION_MODES; mode++) {
+    guard_pro2(static_cast<Control::robot_motion_mode_t>(mode), warmup_ticks,
+               ticks, phases);
+  }
+
+  int failed_phases = 0;
+  printf("%-24s %8s %12s %12s\n", "phase", "ticks", "allocations", "bytes");
+  for (auto &phase : phases) {
+    printf("%-24s %8lu %12lu %12lu\n", phase.name.c_str(), phase.ticks,
+           phase.allocations, phase.bytes);
+    if (phase.allocations > 0) failed_phases++;
+  }
+  if (failed_phases > 0) {
+    printf("%d of %zu phases allocate in their steady state\n", failed_phases,
+           phases.size());
+    return 1;
+  }
+  printf("no allocation in any steady state\n");
+  return 0;
+}
@@ -1,16 +1,68 @@
 #include "comm_can.hpp"
+#include "tracepoints.hpp"
+
+#include <linux/can/error.h>
+
+#include <algorithm>
 
 namespace RoverRobotics {
 CommCan::CommCan(const char *device,
                  std::function<void(std::vector<uint8_t>)> parsefunction,
                  std::vector<uint8_t> setting)
-    : is_connected_(false) {
+    : is_connected_(false),
+      can_state_(ERROR_ACTIVE),
+      bus_off_count_(0),
+      error_passive_count_(0),
+      error_warning_count_(0),
+      restart_count_(0),
+      protocol_error_count_(0),
+      ack_error_count_(0),
+      lost_arbitration_count_(0),
+      tx_timeout_count_(0),
+      rx_overflow_count_(0),
+      transceiver_error_count_(0),
+      read_error_count_(0),
+      tx_error_counter_(0),
+      rx_error_counter_(0),
+      pending_frames_{},
+      pending_count_(0),
+      next_sequence_(0),
+      tx_sent_count_(0),
+      tx_deferred_count_(0),
+      tx_replaced_count_(0),
+      tx_dropped_count_(0),
+      tx_error_count_(0) {
   if ((fd = socket(PF_CAN, SOCK_RAW, CAN_RAW)) < 0) {
     // failed to create socket
     throw(-1);
   }
   strcpy(ifr.ifr_name, device);
   ioctl(fd, SIOCGIFINDEX, &ifr);
+
+  /* deliver the error frames of the controller along with the data */
+  can_err_mask_t err_mask = CAN_ERR_MASK;
+  if (setsockopt(fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask,
+                 sizeof(err_mask)) < 0) {
+    std::cerr << "error frames are not available on " << device << std::endl;
+  }
+
+  /* commands go out ahead of other traffic, and the queue can be sized */
+  int send_buffer = 0;
+  int priority = DEFAULT_TX_PRIORITY_;
+  if (setting.size() >= 5) {
+    send_buffer = (setting[0] << 24) + (setting[1] << 16) + (setting[2] << 8) +
+                  setting[3];
+    priority = setting[4];
+  }
+  if (send_buffer > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &send_buffer,
+                                    sizeof(send_buffer)) < 0) {
+    std::cerr << "can not set the send buffer of " << device << std::endl;
+  }
+  if (setsockopt(fd, SOL_SOCKET, SO_PRIORITY, &priority, sizeof(priority)) <
+      0) {
+    std::cerr << "can not set the priority of " << device << std::endl;
+  }
+
   addr.can_family = AF_CAN;
   addr.can_ifindex = ifr.ifr_ifindex;
 
@@ -34,11 +86,75 @@ void CommCan::write_to_device(std::vector<uint8_t> msg) {
     frame.data[1] = msg[6];
     frame.data[2] = msg[7];
     frame.data[3] = msg[8];
-    write(fd, &frame, sizeof(struct can_frame));
+    LIBROVER_TRACE(command_enqueue, frame.can_id, frame.can_dlc);
+
+    /* older frames go first, and a waiting frame of this id is stale now */
+    flush_pending();
+    bool waiting = false;
+    for (int i = 0; i < MAX_PENDING_FRAMES_ && pending_count_ > 0; i++) {
+      waiting |= pending_frames_[i].valid &&
+                 pending_frames_[i].frame.can_id == frame.can_id;
+    }
+    int error = waiting ? EAGAIN : send_frame(frame);
+    if (error == EAGAIN || error == EWOULDBLOCK || error == ENOBUFS) {
+      defer_frame(frame);
+    } else if (error != 0) {
+      tx_error_count_++;
+    }
   }
   Can_write_mutex_.unlock();
 }
 
+int CommCan::send_frame(const struct can_frame &tx_frame) {
+  if (send(fd, &tx_frame, sizeof(struct can_frame), MSG_DONTWAIT) < 0) {
+    return errno;
+  }
+  LIBROVER_TRACE(tx_write, tx_frame.can_id, tx_frame.can_dlc);
+  tx_sent_count_++;
+  return 0;
+}
+
+void CommCan::flush_pending() {
+  while (pending_count_ > 0) {
+    /* the oldest frame, robust to the sequence wrapping around */
+    int oldest = -1;
+    for (int i = 0; i < MAX_PENDING_FRAMES_; i++) {
+      if (!pending_frames_[i].valid) continue;
+      if (oldest < 0 ||
+          static_cast<int32_t>(pending_frames_[i].sequence -
+                               pending_frames_[oldest].sequence) < 0) {
+        oldest = i;
+      }
+    }
+    if (oldest < 0) return;
+    int error = send_frame(pending_frames_[oldest].frame);
+    if (error == EAGAIN || error == EWOULDBLOCK || error == ENOBUFS) return;
+    if (error != 0) tx_error_count_++;
+    pending_frames_[oldest].valid = false;
+    pending_count_--;
+  }
+}
+
+void CommCan::defer_frame(const struct can_frame &tx_frame) {
+  int free_slot = -1;
+  for (int i = 0; i < MAX_PENDING_FRAMES_; i++) {
+    if (pending_frames_[i].valid &&
+        pending_frames_[i].frame.can_id == tx_frame.can_id) {
+      pending_frames_[i].frame = tx_frame;
+      tx_replaced_count_++;
+      return;
+    }
+    if (!pending_frames_[i].valid && free_slot < 0) free_slot = i;
+  }
+  if (free_slot < 0) {
+    tx_dropped_count_++;
+    return;
+  }
+  pending_frames_[free_slot] = {tx_frame, next_sequence_++, true};
+  pending_count_++;
+  tx_deferred_count_++;
+}
+
 void CommCan::read_device_loop(
     std::function<void(std::vector<uint8_t>)> parsefunction) {
   std::chrono::milliseconds time_last =
@@ -50,11 +166,32 @@ void CommCan::read_device_loop(
         std::chrono::duration_cast<std::chrono::milliseconds>(
             std::chrono::system_clock::now().time_since_epoch());
     if (num_bytes <= 0) {
+      if (num_bytes < 0) {
+        /* the interface went down or away, report it right away */
+        read_error_count_++;
+        if (errno == ENETDOWN || errno == ENODEV) is_connected_ = false;
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(READ_ERROR_BACKOFF_MS_));
+      }
       if ((time_now - time_last).count() > TIMEOUT_MS_) {
         is_connected_ = false;
       }
       continue;
     }
+    if (robot_frame.can_id & CAN_ERR_FLAG) {
+      handle_error_frame(robot_frame);
+      continue;
+    }
+    LIBROVER_TRACE(frame_receive, robot_frame.can_id, robot_frame.can_dlc);
+    /* data made it through, so the controller is back on the bus */
+    if (can_state_ == BUS_OFF) {
+      can_state_ = ERROR_ACTIVE;
+    }
+    /* the queue drains while frames arrive, never wait on a writer here */
+    if (pending_count_ > 0 && Can_write_mutex_.try_lock()) {
+      flush_pending();
+      Can_write_mutex_.unlock();
+    }
     is_connected_ = true;
     time_last = time_now;
     std::vector<uint8_t> msg;
@@ -72,6 +209,90 @@ void CommCan::read_device_loop(
   }
 }
 
-bool CommCan::is_connected() { return (is_connected_); }
+void CommCan::handle_error_frame(const struct can_frame &error_frame) {
+  canid_t error_class = error_frame.can_id & CAN_ERR_MASK;
+
+  if (error_class & CAN_ERR_TX_TIMEOUT) tx_timeout_count_++;
+  if (error_class & CAN_ERR_LOSTARB) lost_arbitration_count_++;
+  if (error_class & CAN_ERR_PROT) protocol_error_count_++;
+  if (error_class & CAN_ERR_TRX) transceiver_error_count_++;
+  if (error_class & CAN_ERR_ACK) ack_error_count_++;
+
+  if (error_class & CAN_ERR_CRTL) {
+    uint8_t status = error_frame.data[1];
+    if (status & (CAN_ERR_CRTL_RX_OVERFLOW | CAN_ERR_CRTL_TX_OVERFLOW)) {
+      rx_overflow_count_++;
+    }
+    if (status & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE)) {
+      if (can_state_ < ERROR_PASSIVE) {
+        std::cerr << "can controller is error passive" << std::endl;
+      }
+      error_passive_count_++;
+      can_state_ = ERROR_PASSIVE;
+    } else if (status & (CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING)) {
+      error_warning_count_++;
+      if (can_state_ < ERROR_WARNING) can_state_ = ERROR_WARNING;
+    }
+#ifdef CAN_ERR_CRTL_ACTIVE
+    if (status & CAN_ERR_CRTL_ACTIVE) can_state_ = ERROR_ACTIVE;
+#endif
+  }
+
+  if (error_class & CAN_ERR_BUSOFF) {
+    if (can_state_ != BUS_OFF) {
+      /* recovery is up to the driver, see restart-ms of the interface */
+      std::cerr << "can controller is bus off" << std::endl;
+      bus_off_count_++;
+    }
+    can_state_ = BUS_OFF;
+  }
+
+  if (error_class & CAN_ERR_RESTARTED) {
+    std::cerr << "can controller restarted" << std::endl;
+    restart_count_++;
+    can_state_ = ERROR_ACTIVE;
+  }
+
+#ifdef CAN_ERR_CNT
+  if (error_class & CAN_ERR_CNT) {
+    tx_error_counter_ = error_frame.data[6];
+    rx_error_counter_ = error_frame.data[7];
+    /* the counters also tell when the controller left the passive state */
+    uint8_t worst_counter = std::max(error_frame.data[6], error_frame.data[7]);
+    if (can_state_ != BUS_OFF && worst_counter < ERROR_WARNING_LIMIT_) {
+      can_state_ = ERROR_ACTIVE;
+    } else if (can_state_ == ERROR_PASSIVE &&
+               worst_counter < ERROR_PASSIVE_LIMIT_) {
+      can_state_ = ERROR_WARNING;
+    }
+  }
+#endif
+}
+
+bool CommCan::is_connected() { return is_connected_ && can_state_ != BUS_OFF; }
+
+std::vector<std::pair<std::string, double>> CommCan::metrics() {
+  return {{"can_connected", is_connected()},
+          {"can_state", can_state_},
+          {"can_bus_off_count", bus_off_count_},
+          {"can_error_passive_count", error_passive_count_},
+          {"can_error_warning_count", error_warning_count_},
+          {"can_restart_count", restart_count_},
+          {"can_protocol_errors", protocol_error_count_},
+          {"can_ack_errors", ack_error_count_},
+          {"can_lost_arbitration", lost_arbitration_count_},
+          {"can_tx_timeouts", tx_timeout_count_},
+          {"can_overflows", rx_overflow_count_},
+          {"can_transceiver_errors", transceiver_error_count_},
+          {"can_read_errors", read_error_count_},
+          {"can_tx_error_counter", tx_error_counter_},
+          {"can_rx_error_counter", rx_error_counter_},
+          {"can_tx_sent", tx_sent_count_},
+          {"can_tx_deferred", tx_deferred_count_},
+          {"can_tx_replaced", tx_replaced_count_},
+          {"can_tx_dropped", tx_dropped_count_},
+          {"can_tx_errors", tx_error_count_},
+          {"can_tx_pending", pending_count_}};
+}
 
 }  // namespace RoverRobotics
\ No newline at end of file
@@ -0,0 +1,57 @@
+#include "comm_lockstep.hpp"
+#include "tracepoints.hpp"
+
+namespace RoverRobotics {
+CommLockstep::CommLockstep()
+    : is_connected_(false),
+      rx_count_(0),
+      tx_count_(0) {}
+
+void CommLockstep::write_to_device(std::vector<uint8_t> msg) {
+  LIBROVER_TRACE(command_enqueue, 0, msg.size());
+  lockstep_mutex_.lock();
+  written_.push_back(msg);
+  tx_count_++;
+  lockstep_mutex_.unlock();
+  /* the message is on the simulated wire once queued for the caller */
+  LIBROVER_TRACE(tx_write, 0, msg.size());
+}
+
+void CommLockstep::read_device_loop(
+    std::function<void(std::vector<uint8_t>)> parsefunction) {
+  lockstep_mutex_.lock();
+  std::vector<std::vector<uint8_t>> received;
+  received.swap(received_);
+  lockstep_mutex_.unlock();
+
+  /* the parser takes the protocol lock, so run it without ours */
+  for (auto &msg : received) {
+    LIBROVER_TRACE(frame_receive, 0, msg.size());
+    parsefunction(msg);
+  }
+}
+
+void CommLockstep::inject(std::vector<uint8_t> msg) {
+  lockstep_mutex_.lock();
+  received_.push_back(msg);
+  rx_count_++;
+  lockstep_mutex_.unlock();
+  is_connected_ = true;
+}
+
+std::vector<std::vector<uint8_t>> CommLockstep::take_written() {
+  lockstep_mutex_.lock();
+  std::vector<std::vector<uint8_t>> written;
+  written.swap(written_);
+  lockstep_mutex_.unlock();
+  return written;
+}
+
+bool CommLockstep::is_connected() { return (is_connected_); }
+
+std::vector<std::pair<std::string, double>> CommLockstep::metrics() {
+  return {{"lockstep_rx_messages", rx_count_},
+          {"lockstep_tx_messages", tx_count_}};
+}
+
+}  // namespace RoverRobotics
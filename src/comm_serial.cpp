@@ -1,5 +1,6 @@
 
 #include "comm_serial.hpp"
+#include "tracepoints.hpp"
 
 namespace RoverRobotics {
 CommSerial::CommSerial(const char *device,
@@ -58,13 +59,15 @@ CommSerial::CommSerial(const char *device,
 }
 
 void CommSerial::write_to_device(std::vector<uint8_t> msg) {
+  LIBROVER_TRACE(command_enqueue, 0, msg.size());
   serial_write_mutex_.lock();
   if (serial_port_ >= 0) {
     uint8_t write_buffer[msg.size()];
     for (int x = 0; x < msg.size(); x++) {
       write_buffer[x] = msg[x];
     }
-    write(serial_port_, write_buffer, msg.size());
+    ssize_t written = write(serial_port_, write_buffer, msg.size());
+    if (written > 0) LIBROVER_TRACE(tx_write, 0, written);
   }
   serial_write_mutex_.unlock();
 }
@@ -86,6 +89,7 @@ void CommSerial::read_device_loop(
       }
       continue;
     }
+    LIBROVER_TRACE(frame_receive, 0, num_bytes);
     is_connected_ = true;
     time_last = time_now;
     static std::vector<uint8_t> output;
@@ -99,4 +103,8 @@ void CommSerial::read_device_loop(
 
 bool CommSerial::is_connected() { return (is_connected_); }
 
+std::vector<std::pair<std::string, double>> CommSerial::metrics() {
+  return {{"serial_connected", is_connected_}};
+}
+
 }  // namespace RoverRobotics
\ No newline at end of file
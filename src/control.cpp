@@ -1,4 +1,5 @@
 #include "control.hpp"
+#include "tracepoints.hpp"
 
 #include <math.h>
 
@@ -7,15 +8,61 @@
 namespace Control {
 /* functions */
 
-motor_data computeSkidSteerWheelSpeeds(robot_velocities target_velocities,
-                                       robot_geometry robot_geometry) {
+/* set while a lockstep simulation steps the controllers on this thread */
+thread_local std::optional<std::chrono::steady_clock::time_point>
+    simulated_time_;
+
+std::chrono::steady_clock::time_point clockNow() {
+  if (simulated_time_) return simulated_time_.value();
+  return std::chrono::steady_clock::now();
+}
+
+void setSimulatedTime(
+    std::optional<std::chrono::steady_clock::time_point> simulated_time) {
+  simulated_time_ = simulated_time;
+}
+
+float computeEffectiveWheelBase(robot_geometry robot_geometry,
+                                skid_steer_params skid_steer_params) {
+  /* the further the wheels sit from the rotation center along the robot, the
+   * more they scrub sideways and the wider the sides appear to be */
+  float longitudinal_spread =
+      pow(robot_geometry.intra_axle_distance, 2) +
+      4 * pow(robot_geometry.center_of_mass_x_offset, 2);
+  return robot_geometry.wheel_base *
+         (1 + skid_steer_params.track_expansion * longitudinal_spread /
+                  pow(robot_geometry.wheel_base, 2));
+}
+
+template <int WHEELS>
+wheel_data<WHEELS> computeSkidSteerWheelSpeeds(
+    robot_velocities target_velocities, robot_geometry robot_geometry) {
+  return computeSkidSteerWheelSpeeds<WHEELS>(target_velocities, robot_geometry,
+                                             IDEAL_SKID_STEER);
+}
+
+template <int WHEELS>
+wheel_data<WHEELS> computeSkidSteerWheelSpeeds(
+    robot_velocities target_velocities, robot_geometry robot_geometry,
+    skid_steer_params skid_steer_params) {
+  /* lateral position of each side's instantaneous center of rotation,
+   * measured from the center of mass */
+  float effective_wheel_base =
+      computeEffectiveWheelBase(robot_geometry, skid_steer_params);
+  float left_icr =
+      0.5 * effective_wheel_base - robot_geometry.center_of_mass_y_offset;
+  float right_icr =
+      0.5 * effective_wheel_base + robot_geometry.center_of_mass_y_offset;
+
   /* travel rate(m/s) */
-  float left_travel_rate =
-      target_velocities.linear_velocity -
-      (0.5 * target_velocities.angular_velocity * robot_geometry.wheel_base);
-  float right_travel_rate =
-      target_velocities.linear_velocity +
-      (0.5 * target_velocities.angular_velocity * robot_geometry.wheel_base);
+  float left_travel_rate = target_velocities.linear_velocity -
+                           (target_velocities.angular_velocity * left_icr);
+  float right_travel_rate = target_velocities.linear_velocity +
+                            (target_velocities.angular_velocity * right_icr);
+
+  /* wheels have to spin faster than the ground moves by the traction factor */
+  left_travel_rate /= skid_steer_params.traction_factor;
+  right_travel_rate /= skid_steer_params.traction_factor;
 
   /* convert (m/s) -> rpm */
   float left_wheel_speed =
@@ -23,29 +70,42 @@ motor_data computeSkidSteerWheelSpeeds(robot_velocities target_velocities,
   float right_wheel_speed =
       (right_travel_rate / robot_geometry.wheel_radius) / RPM_TO_RADS_SEC;
 
-  motor_data returnstruct = {left_wheel_speed, right_wheel_speed,
-                             left_wheel_speed, right_wheel_speed};
-  return returnstruct;
+  return fillSides<WHEELS>(left_wheel_speed, right_wheel_speed);
 }
 
+template <int WHEELS>
 robot_velocities computeVelocitiesFromWheelspeeds(
-    motor_data wheel_speeds, robot_geometry robot_geometry) {
-  float left_magnitude = (wheel_speeds.fl + wheel_speeds.rl) / 2;
-  float right_magnitude = (wheel_speeds.fr + wheel_speeds.rr) / 2;
+    wheel_data<WHEELS> wheel_speeds, robot_geometry robot_geometry) {
+  return computeVelocitiesFromWheelspeeds<WHEELS>(wheel_speeds, robot_geometry,
+                                                  IDEAL_SKID_STEER);
+}
 
-  float left_travel_rate =
-      left_magnitude * RPM_TO_RADS_SEC * robot_geometry.wheel_radius;
-  float right_travel_rate =
-      right_magnitude * RPM_TO_RADS_SEC * robot_geometry.wheel_radius;
+template <int WHEELS>
+robot_velocities computeVelocitiesFromWheelspeeds(
+    wheel_data<WHEELS> wheel_speeds, robot_geometry robot_geometry,
+    skid_steer_params skid_steer_params) {
+  float left_magnitude = averageSide<WHEELS>(wheel_speeds, LEFT_WHEELS);
+  float right_magnitude = averageSide<WHEELS>(wheel_speeds, RIGHT_WHEELS);
+
+  /* ground travel rates, wheels slip by the traction factor */
+  float left_travel_rate = left_magnitude * RPM_TO_RADS_SEC *
+                           robot_geometry.wheel_radius *
+                           skid_steer_params.traction_factor;
+  float right_travel_rate = right_magnitude * RPM_TO_RADS_SEC *
+                            robot_geometry.wheel_radius *
+                            skid_steer_params.traction_factor;
 
   /* difference between left and right travel rates */
   float travel_differential = right_travel_rate - left_travel_rate;
 
-  /* compute velocities */
-  float linear_velocity = (right_travel_rate + left_travel_rate) / 2;
-  float angular_velocity =
-      travel_differential /
-      robot_geometry.wheel_base;  // possibly add traction factor here
+  /* compute velocities about the center of mass */
+  float effective_wheel_base =
+      computeEffectiveWheelBase(robot_geometry, skid_steer_params);
+  float angular_velocity = travel_differential / effective_wheel_base;
+  float linear_velocity =
+      left_travel_rate +
+      angular_velocity *
+          (0.5 * effective_wheel_base - robot_geometry.center_of_mass_y_offset);
 
   robot_velocities returnstruct;
   returnstruct.linear_velocity = linear_velocity;
@@ -53,6 +113,22 @@ robot_velocities computeVelocitiesFromWheelspeeds(
   return returnstruct;
 }
 
+template <int WHEELS>
+float averageSide(const wheel_data<WHEELS> &wheel_values, wheel_side_t side) {
+  float sum = 0;
+  for (int wheel = side; wheel < WHEELS; wheel += 2) sum += wheel_values[wheel];
+  return sum / (WHEELS / 2);
+}
+
+template <int WHEELS>
+wheel_data<WHEELS> fillSides(float left, float right) {
+  wheel_data<WHEELS> wheel_values;
+  for (int wheel = 0; wheel < WHEELS; wheel++) {
+    wheel_values[wheel] = (wheelSide(wheel) == LEFT_WHEELS) ? left : right;
+  }
+  return wheel_values;
+}
+
 robot_velocities limitAcceleration(robot_velocities target_velocities,
                                    robot_velocities measured_velocities,
                                    robot_velocities delta_v_limits, float dt) {
@@ -118,12 +194,19 @@ PidController::PidController(struct pid_gains pid_gains, std::string name)
     : /* defaults */
       integral_error_(0),
       previous_error_(0),
+      previous_derivative_signal_(0),
+      filtered_derivative_(0),
+      last_output_({0}),
+      pid_tuning_(DEFAULT_PID_TUNING),
+      incremental_(false),
+      tracking_dt_(0),
       integral_error_limit_(std::numeric_limits<float>::max()),
       pos_max_output_(std::numeric_limits<float>::max()),
       neg_max_output_(std::numeric_limits<float>::lowest()),
-      time_last_(std::chrono::steady_clock::now()),
-      time_origin_(std::chrono::steady_clock::now()) {
+      time_last_(clockNow()),
+      time_origin_(clockNow()) {
   name_ = name;
+  last_output_.name = name_.c_str();
   kp_ = pid_gains.kp;
   kd_ = pid_gains.kd;
   ki_ = pid_gains.ki;
@@ -135,10 +218,17 @@ PidController::PidController(struct pid_gains pid_gains,
     : /* defaults */
       integral_error_(0),
       previous_error_(0),
+      previous_derivative_signal_(0),
+      filtered_derivative_(0),
+      last_output_({0}),
+      pid_tuning_(DEFAULT_PID_TUNING),
+      incremental_(false),
+      tracking_dt_(0),
       integral_error_limit_(std::numeric_limits<float>::max()),
-      time_last_(std::chrono::steady_clock::now()),
-      time_origin_(std::chrono::steady_clock::now()) {
+      time_last_(clockNow()),
+      time_origin_(clockNow()) {
   name_ = name;
+  last_output_.name = name_.c_str();
   kp_ = pid_gains.kp;
   kd_ = pid_gains.kd;
   ki_ = pid_gains.ki;
@@ -160,14 +250,18 @@ pid_gains PidController::getGains() {
   return pid_gains;
 }
 
-void SkidRobotMotionController::setTrim(float left_trim, float right_trim) {
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setTrim(float left_trim,
+                                                float right_trim) {
   left_trim_value_ = left_trim;
   right_trim_value_ = right_trim;
 }
-float SkidRobotMotionController::getLeftTrim() {
+template <int WHEELS>
+float SkidRobotMotionController<WHEELS>::getLeftTrim() {
   return left_trim_value_;
 }
-float SkidRobotMotionController::getRightTrim() {
+template <int WHEELS>
+float SkidRobotMotionController<WHEELS>::getRightTrim() {
   return right_trim_value_;
 }
 
@@ -189,6 +283,45 @@ void PidController::setIntegralErrorLimit(float error_limit) {
 
 float PidController::getIntegralErrorLimit() { return integral_error_limit_; }
 
+void PidController::setTuning(pid_tuning pid_tuning) {
+  pid_tuning_ = pid_tuning;
+}
+
+pid_tuning PidController::getTuning() { return pid_tuning_; }
+
+void PidController::setIncremental(bool incremental) {
+  incremental_ = incremental;
+}
+
+void PidController::trackAppliedOutput(float applied_output) {
+  if (ki_ == 0 || pid_tuning_.antiwindup_gain <= 0 ||
+      isnan(applied_output) || isnan(last_output_.pid_output)) {
+    return;
+  }
+  /* same tracking as the output limits, over the time of the last update */
+  float tracking = (pid_tuning_.antiwindup_gain / ki_) *
+                   (applied_output - last_output_.pid_output) * tracking_dt_;
+  float tracked_error = integral_error_ + tracking;
+
+  /* in the velocity form the P term already integrates the error, so the
+   * integrator is bled to zero but not past it to cancel the P term */
+  if (incremental_ && tracked_error * integral_error_ < 0) tracked_error = 0;
+
+  integral_error_ = std::clamp(tracked_error, -integral_error_limit_,
+                               integral_error_limit_);
+  last_output_.integral_error = integral_error_;
+}
+
+void PidController::reset() {
+  integral_error_ = 0;
+  previous_error_ = 0;
+  previous_derivative_signal_ = 0;
+  filtered_derivative_ = 0;
+  last_output_.pid_output = 0;
+  tracking_dt_ = 0;
+  time_last_ = clockNow();
+}
+
 void PidController::writePidDataToCsv(std::ofstream &log_file,
                                       pid_outputs data) {
   log_file << "pid," << data.name << "," << data.time << ","
@@ -201,66 +334,94 @@ void PidController::writePidDataToCsv(std::ofstream &log_file,
 
 pid_outputs PidController::runControl(float target, float measured) {
   /* current time */
-  std::chrono::steady_clock::time_point time_now =
-      std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point time_now = clockNow();
 
   /* delta time (S) */
   float delta_time =
       std::chrono::duration<float>(time_now - time_last_).count();
 
+  /* too soon to produce a meaningful update; hold the last output (nothing
+   * more to add in the velocity form) and let the time accumulate */
+  if (delta_time < pid_tuning_.min_dt) {
+    tracking_dt_ = 0;
+    if (incremental_) last_output_.pid_output = 0;
+    return last_output_;
+  }
+
   /* update time bookkeeping */
   time_last_ = time_now;
 
+  /* a long gap means the loop was not running; don't integrate or
+   * differentiate across it */
+  bool restart = delta_time > pid_tuning_.max_dt;
+
   /* error */
   float error = target - measured;
 
   /* integrate */
-  integral_error_ += error * delta_time;
-
-  /* differentiate */
-  float delta_error = error - previous_error_;
+  if (!restart) integral_error_ += error * delta_time;
 
   /* clip integral error */
   integral_error_ = std::clamp(integral_error_, -integral_error_limit_,
                                integral_error_limit_);
 
+  /* differentiate the setpoint-weighted error, then low-pass filter it */
+  float derivative_signal = pid_tuning_.setpoint_weight_d * target - measured;
+  float raw_derivative =
+      restart ? 0 : (derivative_signal - previous_derivative_signal_) /
+                        delta_time;
+  float filter_alpha =
+      delta_time / (pid_tuning_.derivative_filter_time + delta_time);
+  filtered_derivative_ += filter_alpha * (raw_derivative - filtered_derivative_);
+
   /* P I D terms */
-  float p = kp_ * error;
+  float p = kp_ * (pid_tuning_.setpoint_weight_p * target - measured);
   float i = ki_ * integral_error_;
-  float d = kd_ * (delta_error / delta_time);
+  float d = kd_ * filtered_derivative_;
 
   /* compute output */
-  float output = p + i + d;
+  float unclipped_output = p + i + d;
 
   /* clip output */
-  output = std::clamp(output, neg_max_output_, pos_max_output_);
+  float output =
+      std::clamp(unclipped_output, neg_max_output_, pos_max_output_);
+
+  /* back-calculation: bleed the integrator while the output is saturated */
+  tracking_dt_ = restart ? 0 : delta_time;
+  if (!restart && ki_ != 0 && pid_tuning_.antiwindup_gain > 0) {
+    integral_error_ += (pid_tuning_.antiwindup_gain / ki_) *
+                       (output - unclipped_output) * delta_time;
+  }
 
-  pid_outputs returnstruct;
-  returnstruct.pid_output = output;
-  returnstruct.name = name_;
-  returnstruct.dt = delta_time;
-  returnstruct.time =
+  last_output_.pid_output = output;
+  last_output_.name = name_.c_str();
+  last_output_.dt = delta_time;
+  last_output_.time =
       std::chrono::duration<double>(time_now - time_origin_).count();
-  returnstruct.error = error;
-  returnstruct.integral_error = integral_error_;
-  returnstruct.delta_error = (delta_error / delta_time);
-  returnstruct.target_value = target;
-  returnstruct.measured_value = measured;
-  returnstruct.kp = kp_;
-  returnstruct.ki = ki_;
-  returnstruct.kd = kd_;
+  last_output_.error = error;
+  last_output_.integral_error = integral_error_;
+  last_output_.delta_error = filtered_derivative_;
+  last_output_.target_value = target;
+  last_output_.measured_value = measured;
+  last_output_.kp = kp_;
+  last_output_.ki = ki_;
+  last_output_.kd = kd_;
 
   previous_error_ = error;
-  return returnstruct;
+  previous_derivative_signal_ = derivative_signal;
+  return last_output_;
 }
 
-SkidRobotMotionController::SkidRobotMotionController() {}
-SkidRobotMotionController::SkidRobotMotionController(
+template <int WHEELS>
+SkidRobotMotionController<WHEELS>::SkidRobotMotionController() {}
+template <int WHEELS>
+SkidRobotMotionController<WHEELS>::SkidRobotMotionController(
     robot_motion_mode_t operating_mode, robot_geometry robot_geometry,
     float max_motor_duty, float min_motor_duty, float left_trim,
     float right_trim, float open_loop_max_wheel_rpm)
     : log_folder_path_("~/Documents/"),
       duty_cycles_({0}),
+      pid_tuning_(DEFAULT_PID_TUNING),
       measured_velocities_({0}),
       angular_scaling_params_((angular_scaling_params){.a_coef = 0,
                                                        .b_coef = 0,
@@ -269,8 +430,22 @@ SkidRobotMotionController::SkidRobotMotionController(
                                                        .max_scale_val = 1.0}),
       max_linear_acceleration_(std::numeric_limits<float>::max()),
       max_angular_acceleration_(std::numeric_limits<float>::max()),
-      time_last_(std::chrono::steady_clock::now()),
-      time_origin_(std::chrono::steady_clock::now()) {
+      yaw_rate_control_(false),
+      yaw_rate_pid_gains_({0, 0, 0}),
+      measured_yaw_rate_(0),
+      latency_compensation_(false),
+      plant_model_((plant_model){
+          .gain = 600, .time_constant = 0.1, .dead_time = 0}),
+      feedback_delay_(0),
+      applied_duty_cycles_({0}),
+      mpc_params_(DEFAULT_MPC_PARAMS),
+      time_last_(clockNow()),
+      time_origin_(clockNow()) {
+  yaw_rate_time_ = time_origin_ - std::chrono::hours(1);
+  traction_params_ = DEFAULT_TRACTION_PARAMS;
+  motor_currents_.fill(0);
+  current_times_.fill(time_origin_ - std::chrono::hours(1));
+  wheel_grip_.fill(1);
   open_loop_max_wheel_rpm_ = open_loop_max_wheel_rpm;
   min_motor_duty_ = min_motor_duty;
   max_motor_duty_ = max_motor_duty;
@@ -278,6 +453,10 @@ SkidRobotMotionController::SkidRobotMotionController(
   right_trim_value_ = right_trim;
   operating_mode_ = operating_mode;
   robot_geometry_ = robot_geometry;
+  pid_controller_yaw_ =
+      std::make_unique<PidController>(yaw_rate_pid_gains_, "pid_yaw_rate");
+  initializePredictors();
+  initializeSlipDetectors();
 #ifdef DEBUG
   /*open a log file to store control data*/
   auto t = std::time(nullptr);
@@ -307,12 +486,14 @@ SkidRobotMotionController::SkidRobotMotionController(
 #endif
 }
 
-SkidRobotMotionController::SkidRobotMotionController(
+template <int WHEELS>
+SkidRobotMotionController<WHEELS>::SkidRobotMotionController(
     robot_motion_mode_t operating_mode, robot_geometry robot_geometry,
     pid_gains pid_gains, float max_motor_duty, float min_motor_duty,
     float left_trim, float right_trim, float geometric_decay)
     : log_folder_path_("~/Documents/"),
       duty_cycles_({0}),
+      pid_tuning_(DEFAULT_PID_TUNING),
       measured_velocities_({0}),
       angular_scaling_params_((angular_scaling_params){.a_coef = 0,
                                                        .b_coef = 0,
@@ -321,8 +502,22 @@ SkidRobotMotionController::SkidRobotMotionController(
                                                        .max_scale_val = 1.0}),
       max_linear_acceleration_(std::numeric_limits<float>::max()),
       max_angular_acceleration_(std::numeric_limits<float>::max()),
-      time_last_(std::chrono::steady_clock::now()),
-      time_origin_(std::chrono::steady_clock::now()) {
+      yaw_rate_control_(false),
+      yaw_rate_pid_gains_({0, 0, 0}),
+      measured_yaw_rate_(0),
+      latency_compensation_(false),
+      plant_model_((plant_model){
+          .gain = 600, .time_constant = 0.1, .dead_time = 0}),
+      feedback_delay_(0),
+      applied_duty_cycles_({0}),
+      mpc_params_(DEFAULT_MPC_PARAMS),
+      time_last_(clockNow()),
+      time_origin_(clockNow()) {
+  yaw_rate_time_ = time_origin_ - std::chrono::hours(1);
+  traction_params_ = DEFAULT_TRACTION_PARAMS;
+  motor_currents_.fill(0);
+  current_times_.fill(time_origin_ - std::chrono::hours(1));
+  wheel_grip_.fill(1);
 #ifdef DEBUG
   /*open a log file to store control data*/
   auto t = std::time(nullptr);
@@ -361,30 +556,48 @@ SkidRobotMotionController::SkidRobotMotionController(
   geometric_decay_ = geometric_decay;
 
   initializePids();
+  pid_controller_yaw_ =
+      std::make_unique<PidController>(yaw_rate_pid_gains_, "pid_yaw_rate");
+  initializePredictors();
+  initializeSlipDetectors();
 }
 
-void SkidRobotMotionController::initializePids() {
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::initializePids() {
+  /* a duty increment never needs to exceed the duty range; the sum of the
+   * increments saturating is fed back by accumulateDuties_ */
+  pid_output_limits duty_limits = {.posmax = max_motor_duty_,
+                                   .negmax = -max_motor_duty_};
   pid_mutex_.lock();
   switch (operating_mode_) {
     case OPEN_LOOP:
       break;
     case INDEPENDENT_WHEEL:
       /* one pid per wheel */
-      pid_controller_fl_ =
-          std::make_unique<PidController>(pid_gains_, "pid_front_left");
-      pid_controller_fr_ =
-          std::make_unique<PidController>(pid_gains_, "pid_front_right");
-      pid_controller_rl_ =
-          std::make_unique<PidController>(pid_gains_, "pid_rear_left");
-      pid_controller_rr_ =
-          std::make_unique<PidController>(pid_gains_, "pid_rear_right");
+      for (int wheel = 0; wheel < WHEELS; wheel++) {
+        pid_controller_wheels_[wheel] = std::make_unique<PidController>(
+            pid_gains_, duty_limits, "pid_wheel_" + std::to_string(wheel));
+        pid_controller_wheels_[wheel]->setTuning(pid_tuning_);
+        pid_controller_wheels_[wheel]->setIncremental(true);
+      }
       break;
     case TRACTION_CONTROL:
       /* one pid per side */
       pid_controller_left_ =
-          std::make_unique<PidController>(pid_gains_, "pid_left");
-      pid_controller_right_ =
-          std::make_unique<PidController>(pid_gains_, "pid_right");
+          std::make_unique<PidController>(pid_gains_, duty_limits, "pid_left");
+      pid_controller_right_ = std::make_unique<PidController>(
+          pid_gains_, duty_limits, "pid_right");
+      pid_controller_left_->setTuning(pid_tuning_);
+      pid_controller_right_->setTuning(pid_tuning_);
+      pid_controller_left_->setIncremental(true);
+      pid_controller_right_->setIncremental(true);
+      break;
+    case MODEL_PREDICTIVE:
+      /* one mpc per side */
+      mpc_left_ = std::make_unique<WheelSpeedMpc>(plant_model_, mpc_params_,
+                                                  max_motor_duty_);
+      mpc_right_ = std::make_unique<WheelSpeedMpc>(plant_model_, mpc_params_,
+                                                   max_motor_duty_);
       break;
     default:
       /* probably throw exception here */
@@ -392,91 +605,670 @@ void SkidRobotMotionController::initializePids() {
   }
   pid_mutex_.unlock();
 }
-void SkidRobotMotionController::setAccelerationLimits(robot_velocities limits) {
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::initializePredictors() {
+  /* one predictor per wheel */
+  for (auto &predictor : predictors_) {
+    predictor = std::make_unique<WheelSpeedPredictor>(plant_model_);
+  }
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::initializeSlipDetectors() {
+  /* one detector per wheel */
+  for (auto &detector : slip_detectors_) {
+    detector = std::make_unique<SlipDetector>(traction_params_);
+  }
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setAccelerationLimits(
+    robot_velocities limits) {
   max_linear_acceleration_ = limits.linear_velocity;
   max_angular_acceleration_ = limits.angular_velocity;
 }
 
-robot_velocities SkidRobotMotionController::getAccelerationLimits() {
+template <int WHEELS>
+robot_velocities SkidRobotMotionController<WHEELS>::getAccelerationLimits() {
   robot_velocities returnstruct;
   returnstruct.angular_velocity = max_angular_acceleration_;
   returnstruct.linear_velocity = max_linear_acceleration_;
   return returnstruct;
 }
 
-void SkidRobotMotionController::setOperatingMode(
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setOperatingMode(
     robot_motion_mode_t operating_mode) {
   operating_mode_ = operating_mode;
   initializePids();
 }
 
-robot_motion_mode_t SkidRobotMotionController::getOperatingMode() {
+template <int WHEELS>
+robot_motion_mode_t SkidRobotMotionController<WHEELS>::getOperatingMode() {
   return operating_mode_;
 }
 
-void SkidRobotMotionController::setRobotGeometry(
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setRobotGeometry(
     robot_geometry robot_geometry) {
   robot_geometry_ = robot_geometry;
 }
 
-robot_geometry SkidRobotMotionController::getRobotGeometry() {
+template <int WHEELS>
+robot_geometry SkidRobotMotionController<WHEELS>::getRobotGeometry() {
   return robot_geometry_;
 }
 
-void SkidRobotMotionController::setPidGains(pid_gains pid_gains) {
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setSkidSteerParams(
+    skid_steer_params skid_steer_params) {
+  skid_steer_params_ = skid_steer_params;
+}
+
+template <int WHEELS>
+skid_steer_params SkidRobotMotionController<WHEELS>::getSkidSteerParams() {
+  return skid_steer_params_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setPidGains(pid_gains pid_gains) {
   pid_gains_ = pid_gains;
 }
 
-pid_gains SkidRobotMotionController::getPidGains() { return pid_gains_; }
+template <int WHEELS>
+pid_gains SkidRobotMotionController<WHEELS>::getPidGains() {
+  return pid_gains_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setPidTuning(pid_tuning pid_tuning) {
+  pid_tuning_ = pid_tuning;
+  initializePids();
+}
+
+template <int WHEELS>
+pid_tuning SkidRobotMotionController<WHEELS>::getPidTuning() {
+  return pid_tuning_;
+}
+
+template <int WHEELS>
+bool SkidRobotMotionController<WHEELS>::startAutotune(
+    autotune_params autotune_params) {
+  /* the relay has to swing the duty and switch on something it can reach */
+  if (autotune_params.cycles == 0 ||
+      !std::isfinite(autotune_params.wheel_rpm) ||
+      !(autotune_params.relay_amplitude > 0) ||
+      autotune_params.relay_amplitude > max_motor_duty_ ||
+      !(autotune_params.hysteresis >= 0) ||
+      !std::isfinite(autotune_params.hysteresis)) {
+    std::cerr << "invalid autotune parameters, not starting" << std::endl;
+    return false;
+  }
+
+  std::scoped_lock lock(autotune_mutex_);
+  autotune_params_ = autotune_params;
+  autotune_start_time_ =
+      std::chrono::duration<float>(clockNow() - time_origin_).count();
+  autotune_dt_sum_ = 0;
+  autotune_ticks_ = 0;
+  relay_left_ = {1, -std::numeric_limits<float>::max(),
+                 std::numeric_limits<float>::max(), -1, 0, 0, 0, 0};
+  relay_right_ = relay_left_;
+  autotuning_ = true;
+  return true;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::stopAutotune() {
+  std::scoped_lock lock(autotune_mutex_);
+  autotuning_ = false;
+}
+
+template <int WHEELS>
+bool SkidRobotMotionController<WHEELS>::isAutotuning() {
+  std::scoped_lock lock(autotune_mutex_);
+  return autotuning_;
+}
+
+template <int WHEELS>
+std::optional<autotune_result>
+SkidRobotMotionController<WHEELS>::getAutotuneResult() {
+  std::scoped_lock lock(autotune_mutex_);
+  return autotune_result_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::updateRelay_(relay_state &relay,
+                                                     float wheel_speed,
+                                                     float time) {
+  float error = autotune_params_.wheel_rpm - wheel_speed;
+  relay.peak_high = std::max(relay.peak_high, wheel_speed);
+  relay.peak_low = std::min(relay.peak_low, wheel_speed);
+
+  if (relay.output < 0 && error > autotune_params_.hysteresis) {
+    /* a rise closes a period; the first one is still settling */
+    relay.output = 1;
+    relay.rises++;
+    if (relay.rises > 2) {
+      relay.amplitude_sum += (relay.peak_high - relay.peak_low) / 2;
+      relay.period_sum += time - relay.last_rise_time;
+      relay.periods++;
+    }
+    relay.last_rise_time = time;
+    relay.peak_high = wheel_speed;
+    relay.peak_low = wheel_speed;
+  } else if (relay.output > 0 && error < -autotune_params_.hysteresis) {
+    relay.output = -1;
+  }
+}
+
+template <int WHEELS>
+std::optional<autotune_result>
+SkidRobotMotionController<WHEELS>::computeAutotuneResult_(
+    const relay_state &relay) {
+  if (relay.periods == 0 || autotune_ticks_ == 0) return {};
+  float amplitude = relay.amplitude_sum / relay.periods;
+
+  /* describing function of a relay with hysteresis, which needs the
+   * oscillation to swing past the hysteresis band */
+  if (!(amplitude > autotune_params_.hysteresis)) return {};
+  autotune_result result;
+  result.ultimate_gain =
+      4 * autotune_params_.relay_amplitude /
+      (M_PI * sqrt(pow(amplitude, 2) - pow(autotune_params_.hysteresis, 2)));
+  result.ultimate_period = relay.period_sum / relay.periods;
+  if (!std::isfinite(result.ultimate_gain) ||
+      !(result.ultimate_period > 0) ||
+      !std::isfinite(result.ultimate_period)) {
+    return {};
+  }
+
+  /* positional PI gains from the tuning rule */
+  float kp, ti;
+  switch (autotune_params_.rule) {
+    case TYREUS_LUYBEN:
+      kp = result.ultimate_gain / 3.2;
+      ti = 2.2 * result.ultimate_period;
+      break;
+    case ZIEGLER_NICHOLS:
+    default:
+      kp = 0.45 * result.ultimate_gain;
+      ti = result.ultimate_period / 1.2;
+      break;
+  }
+
+  /* the wheel pids are incremental, their output is summed into the duty
+   * every tick, so their P acts as the integral and their D as the
+   * proportional term of the positional controller */
+  float tick = autotune_dt_sum_ / autotune_ticks_;
+  result.gains.kp = tick * kp / ti;
+  result.gains.ki = 0;
+  result.gains.kd = tick * kp;
+  return result;
+}
+
+template <int WHEELS>
+std::optional<wheel_data<WHEELS>>
+SkidRobotMotionController<WHEELS>::runAutotune_(
+    wheel_data<WHEELS> current_wheel_speeds, float accumulated_time,
+    float delta_time) {
+  std::unique_lock lock(autotune_mutex_);
+  if (!autotuning_) return {};
+
+  if (accumulated_time - autotune_start_time_ > AUTOTUNE_TIMEOUT_) {
+    std::cerr << "autotune timed out without a steady oscillation" << std::endl;
+    autotuning_ = false;
+    duty_cycles_.fill(0);
+    return duty_cycles_;
+  }
+  autotune_dt_sum_ += delta_time;
+  autotune_ticks_++;
+
+  updateRelay_(relay_left_,
+               averageSide<WHEELS>(current_wheel_speeds, LEFT_WHEELS),
+               accumulated_time);
+  updateRelay_(relay_right_,
+               averageSide<WHEELS>(current_wheel_speeds, RIGHT_WHEELS),
+               accumulated_time);
+
+  /* relay around the open-loop duty of the target */
+  float bias = autotune_params_.wheel_rpm / open_loop_max_wheel_rpm_;
+  float left_duty =
+      bias + relay_left_.output * autotune_params_.relay_amplitude;
+  float right_duty =
+      bias + relay_right_.output * autotune_params_.relay_amplitude;
+  duty_cycles_ = fillSides<WHEELS>(left_duty, right_duty);
+
+  if (relay_left_.periods < autotune_params_.cycles ||
+      relay_right_.periods < autotune_params_.cycles) {
+    return clipDutyCycles_(duty_cycles_);
+  }
 
-void SkidRobotMotionController::setMotorMaxDuty(float max_motor_duty) {
+  /* tune for the side closest to instability */
+  auto left = computeAutotuneResult_(relay_left_);
+  auto right = computeAutotuneResult_(relay_right_);
+  autotuning_ = false;
+  if (!left || !right) {
+    std::cerr << "autotune oscillation too small to tune from" << std::endl;
+    duty_cycles_.fill(0);
+    return duty_cycles_;
+  }
+  autotune_result_ =
+      left->ultimate_gain < right->ultimate_gain ? left : right;
+
+  /* hand over to the pids from the bias */
+  duty_cycles_.fill(bias);
+  if (autotune_params_.apply) {
+    pid_gains_ = autotune_result_->gains;
+    lock.unlock();
+    initializePids();
+  }
+  return clipDutyCycles_(duty_cycles_);
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setMotorMaxDuty(float max_motor_duty) {
   max_motor_duty_ = max_motor_duty;
+  /* the duty limit is a constraint of the mpc */
+  if (operating_mode_ == MODEL_PREDICTIVE) initializePids();
+}
+template <int WHEELS>
+float SkidRobotMotionController<WHEELS>::getMotorMaxDuty() {
+  return max_motor_duty_;
 }
-float SkidRobotMotionController::getMotorMaxDuty() { return max_motor_duty_; }
 
-void SkidRobotMotionController::setMotorMinDuty(float min_motor_duty) {
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setMotorMinDuty(float min_motor_duty) {
   min_motor_duty_ = min_motor_duty;
 }
-float SkidRobotMotionController::getMotorMinDuty() { return min_motor_duty_; }
+template <int WHEELS>
+float SkidRobotMotionController<WHEELS>::getMotorMinDuty() {
+  return min_motor_duty_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setDeadbandCompensation(
+    deadband_compensation<WHEELS> deadband_compensation) {
+  /* without a blend every residual duty would jump to the breakaway */
+  bool compensated = false;
+  for (auto breakaway_duty : deadband_compensation.breakaway_duty) {
+    if (breakaway_duty > 0) compensated = true;
+  }
+  if (compensated && !(deadband_compensation.blend_duty > 0)) {
+    std::cerr << "deadband compensation needs a positive blend duty, ignoring"
+              << std::endl;
+    return;
+  }
+  deadband_compensation_ = deadband_compensation;
+}
+
+template <int WHEELS>
+deadband_compensation<WHEELS>
+SkidRobotMotionController<WHEELS>::getDeadbandCompensation() {
+  return deadband_compensation_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setVoltageCompensation(
+    bool voltage_compensation, float nominal_voltage) {
+  std::scoped_lock lock(voltage_mutex_);
+  voltage_compensation_ = voltage_compensation;
+  nominal_bus_voltage_ = nominal_voltage;
+
+  /* latch the first settled measurement as the reference */
+  if (nominal_bus_voltage_ <= 0 &&
+      bus_voltage_samples_ >= VOLTAGE_SETTLE_SAMPLES_) {
+    nominal_bus_voltage_ = filtered_bus_voltage_;
+  }
+}
+
+template <int WHEELS>
+bool SkidRobotMotionController<WHEELS>::getVoltageCompensation() {
+  std::scoped_lock lock(voltage_mutex_);
+  return voltage_compensation_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setBusVoltage(float voltage) {
+  if (voltage <= 0 || isnan(voltage)) return;
+
+  std::scoped_lock lock(voltage_mutex_);
+  if (!bus_voltage_filter_) {
+    bus_voltage_filter_ =
+        std::make_unique<AlphaBetaFilter>(VOLTAGE_FILTER_ALPHA_);
+  }
+  filtered_bus_voltage_ = bus_voltage_filter_->update(voltage);
+  bus_voltage_samples_++;
+
+  if (nominal_bus_voltage_ <= 0 &&
+      bus_voltage_samples_ >= VOLTAGE_SETTLE_SAMPLES_) {
+    nominal_bus_voltage_ = filtered_bus_voltage_;
+  }
+}
+
+template <int WHEELS>
+float SkidRobotMotionController<WHEELS>::getBusVoltage() {
+  std::scoped_lock lock(voltage_mutex_);
+  return filtered_bus_voltage_;
+}
+
+template <int WHEELS>
+float SkidRobotMotionController<WHEELS>::voltageScale_() {
+  std::scoped_lock lock(voltage_mutex_);
+  if (!voltage_compensation_ || nominal_bus_voltage_ <= 0 ||
+      bus_voltage_samples_ < VOLTAGE_SETTLE_SAMPLES_) {
+    return 1;
+  }
+  return std::clamp(nominal_bus_voltage_ / filtered_bus_voltage_,
+                    MIN_VOLTAGE_SCALE_, MAX_VOLTAGE_SCALE_);
+}
+
+template <int WHEELS>
+float SkidRobotMotionController<WHEELS>::compensateDeadband_(
+    float duty, float breakaway_duty) {
+  float blend_duty =
+      std::min(deadband_compensation_.blend_duty, breakaway_duty);
+  if (breakaway_duty <= 0 || breakaway_duty >= max_motor_duty_ || duty == 0) {
+    return duty;
+  }
+
+  /* what the minimum duty would drop stays dropped, not lifted */
+  float magnitude = std::abs(duty);
+  if (magnitude < min_motor_duty_) return 0;
+
+  /* ramp up to the breakaway duty, then scale the rest of the range */
+  float compensated;
+  if (magnitude < blend_duty) {
+    compensated = breakaway_duty * magnitude / blend_duty;
+  } else {
+    compensated = breakaway_duty + (magnitude - blend_duty) *
+                                       (max_motor_duty_ - breakaway_duty) /
+                                       (max_motor_duty_ - blend_duty);
+  }
+  return std::copysign(compensated, duty);
+}
 
-void SkidRobotMotionController::setOutputDecay(float geometric_decay) {
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setOutputDecay(float geometric_decay) {
   geometric_decay_ = geometric_decay;
 }
-float SkidRobotMotionController::getOutputDecay() { return geometric_decay_; }
+template <int WHEELS>
+float SkidRobotMotionController<WHEELS>::getOutputDecay() {
+  return geometric_decay_;
+}
 
-void SkidRobotMotionController::setOpenLoopMaxRpm(
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setOpenLoopMaxRpm(
     float open_loop_max_wheel_rpm) {
   open_loop_max_wheel_rpm_ = open_loop_max_wheel_rpm;
 }
-float SkidRobotMotionController::getOpenLoopMaxRpm() {
+template <int WHEELS>
+float SkidRobotMotionController<WHEELS>::getOpenLoopMaxRpm() {
   return open_loop_max_wheel_rpm_;
 }
 
-void SkidRobotMotionController::setAngularScaling(
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setAngularScaling(
     angular_scaling_params angular_scaling_params) {
   angular_scaling_params_ = angular_scaling_params;
 }
 
-angular_scaling_params SkidRobotMotionController::getAngularScaling() {
+template <int WHEELS>
+angular_scaling_params SkidRobotMotionController<WHEELS>::getAngularScaling() {
   return angular_scaling_params_;
 }
 
-motor_data SkidRobotMotionController::computeMotorCommandsDual_(
-    motor_data target_wheel_speeds, motor_data current_wheel_speeds) {
-  /* average front and rear wheels */
-  float left_magnitude =
-      (current_wheel_speeds.fl + current_wheel_speeds.rl) / 2;
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setLatencyCompensation(bool enabled) {
+  /* start from a clean model history when switching on */
+  if (enabled && !latency_compensation_) {
+    for (auto &predictor : predictors_) predictor->reset();
+  }
+  latency_compensation_ = enabled;
+}
+
+template <int WHEELS>
+bool SkidRobotMotionController<WHEELS>::getLatencyCompensation() {
+  return latency_compensation_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setPlantModel(plant_model plant_model) {
+  plant_model_ = plant_model;
+  for (auto &predictor : predictors_) predictor->setPlantModel(plant_model_);
+  /* the mpc predicts with the same model */
+  if (operating_mode_ == MODEL_PREDICTIVE) initializePids();
+}
+
+template <int WHEELS>
+plant_model SkidRobotMotionController<WHEELS>::getPlantModel() {
+  return plant_model_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setMpcParams(mpc_params mpc_params) {
+  mpc_params_ = mpc_params;
+  initializePids();
+}
+
+template <int WHEELS>
+mpc_params SkidRobotMotionController<WHEELS>::getMpcParams() {
+  return mpc_params_;
+}
+
+template <int WHEELS>
+mpc_timing SkidRobotMotionController<WHEELS>::getMpcTiming() {
+  std::scoped_lock lock(pid_mutex_);
+  if (operating_mode_ != MODEL_PREDICTIVE || !mpc_left_ || !mpc_right_) {
+    return (mpc_timing){.last_solve_time = 0, .worst_solve_time = 0};
+  }
+  auto left = mpc_left_->getTiming();
+  auto right = mpc_right_->getTiming();
+  return (mpc_timing){
+      .last_solve_time = std::max(left.last_solve_time, right.last_solve_time),
+      .worst_solve_time =
+          std::max(left.worst_solve_time, right.worst_solve_time)};
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setFeedbackDelay(float feedback_delay) {
+  feedback_delay_ = std::max(feedback_delay, 0.0f);
+}
+
+template <int WHEELS>
+float SkidRobotMotionController<WHEELS>::getFeedbackDelay() {
+  return feedback_delay_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setYawRateControl(bool enabled) {
+  yaw_rate_control_ = enabled;
+}
+
+template <int WHEELS>
+bool SkidRobotMotionController<WHEELS>::getYawRateControl() {
+  return yaw_rate_control_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setYawRatePidGains(
+    pid_gains pid_gains) {
+  yaw_rate_pid_gains_ = pid_gains;
+  pid_mutex_.lock();
+  pid_controller_yaw_->setGains(yaw_rate_pid_gains_);
+  pid_mutex_.unlock();
+}
+
+template <int WHEELS>
+pid_gains SkidRobotMotionController<WHEELS>::getYawRatePidGains() {
+  return yaw_rate_pid_gains_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setAutoTrim(bool auto_trim,
+                                                    float max_trim) {
+  std::scoped_lock lock(auto_trim_mutex_);
+  if (!auto_trim) {
+    trim_estimator_.reset();
+    return;
+  }
+
+  /* continue from the trim currently applied */
+  float trim = left_trim_value_ < 1 ? left_trim_value_ - 1
+                                    : 1 - right_trim_value_;
+  trim_estimator_ = std::make_unique<TrimEstimator>(max_trim, trim);
+  auto_trim_straight_time_ = 0;
+}
+
+template <int WHEELS>
+bool SkidRobotMotionController<WHEELS>::getAutoTrim() {
+  std::scoped_lock lock(auto_trim_mutex_);
+  return trim_estimator_ != nullptr;
+}
+
+template <int WHEELS>
+std::optional<float> SkidRobotMotionController<WHEELS>::takeStableTrim() {
+  std::scoped_lock lock(auto_trim_mutex_);
+  if (!trim_estimator_ || !trim_estimator_->isStable()) return {};
+  float trim = trim_estimator_->getTrim();
+  trim_estimator_.reset();
+  return trim;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::updateAutoTrim_(
+    robot_velocities velocity_targets, wheel_data<WHEELS> current_wheel_speeds,
+    float delta_time) {
+  std::scoped_lock lock(auto_trim_mutex_);
+  if (!trim_estimator_) return;
+
+  /* only a straight, steady run says anything about the trim */
+  if (std::abs(velocity_targets.angular_velocity) >
+          AUTO_TRIM_MAX_ANGULAR_VELOCITY_ ||
+      std::abs(velocity_targets.linear_velocity) <
+          AUTO_TRIM_MIN_LINEAR_VELOCITY_ ||
+      std::abs(measured_velocities_.linear_velocity) <
+          AUTO_TRIM_MIN_LINEAR_VELOCITY_) {
+    auto_trim_straight_time_ = 0;
+    return;
+  }
+  auto_trim_straight_time_ += delta_time;
+  if (auto_trim_straight_time_ < AUTO_TRIM_SETTLE_TIME_) return;
+
+  /* the wheels track their (trimmed) targets in closed loop, so only the yaw
+   * rate shows the drift there; without it there is no sample, which keeps
+   * the estimator from settling (and the trim from being saved) */
+  float imbalance;
+  float yaw_rate;
+  if (readMeasuredYawRate_(yaw_rate)) {
+    imbalance = yaw_rate *
+                computeEffectiveWheelBase(robot_geometry_, skid_steer_params_) /
+                (2 * measured_velocities_.linear_velocity);
+  } else if (operating_mode_ == OPEN_LOOP) {
+    float left = averageSide<WHEELS>(current_wheel_speeds, LEFT_WHEELS);
+    float right = averageSide<WHEELS>(current_wheel_speeds, RIGHT_WHEELS);
+    imbalance = (right - left) / (right + left);
+  } else {
+    return;
+  }
+
+  float trim = trim_estimator_->update(imbalance, delta_time);
+
+  /* reduce power to right wheels */
+  if (trim >= 0) {
+    left_trim_value_ = 1;
+    right_trim_value_ = 1 - trim;
+  }
+  /* reduce power to left wheels */
+  else {
+    right_trim_value_ = 1;
+    left_trim_value_ = 1 + trim;
+  }
+}
+
+template <int WHEELS>
+bool SkidRobotMotionController<WHEELS>::readMeasuredYawRate_(float &yaw_rate) {
+  std::scoped_lock lock(yaw_rate_mutex_);
+  if (std::chrono::duration<float>(clockNow() - yaw_rate_time_).count() >=
+      YAW_RATE_TIMEOUT_) {
+    return false;
+  }
+  yaw_rate = measured_yaw_rate_;
+  return true;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setMeasuredYawRate(float yaw_rate) {
+  yaw_rate_mutex_.lock();
+  measured_yaw_rate_ = yaw_rate;
+  yaw_rate_time_ = clockNow();
+  yaw_rate_mutex_.unlock();
+}
+
+template <int WHEELS>
+wheel_data<WHEELS> SkidRobotMotionController<WHEELS>::correctYawRate_(
+    wheel_data<WHEELS> target_wheel_speeds, float angular_velocity_target) {
+  /* prefer an injected yaw rate, fall back to the wheels when it is stale */
+  float yaw_rate = measured_velocities_.angular_velocity;
+  readMeasuredYawRate_(yaw_rate);
+
+  pid_mutex_.lock();
+  pid_outputs yaw_pid_output =
+      pid_controller_yaw_->runControl(angular_velocity_target, yaw_rate);
+  pid_mutex_.unlock();
+
+#ifdef DEBUG
+  pid_controller_yaw_->writePidDataToCsv(log_file_, yaw_pid_output);
+#endif
+
+  if (isnan(yaw_pid_output.pid_output)) return target_wheel_speeds;
+
+  /* convert the yaw rate correction (rad/s) to a differential wheelspeed */
+  float differential =
+      (0.5 * yaw_pid_output.pid_output *
+       computeEffectiveWheelBase(robot_geometry_, skid_steer_params_) /
+       (robot_geometry_.wheel_radius * skid_steer_params_.traction_factor)) /
+      RPM_TO_RADS_SEC;
+
+  for (int wheel = 0; wheel < WHEELS; wheel++) {
+    target_wheel_speeds[wheel] +=
+        (wheelSide(wheel) == LEFT_WHEELS) ? -differential : differential;
+  }
+  return target_wheel_speeds;
+}
+
+template <int WHEELS>
+wheel_data<WHEELS> SkidRobotMotionController<WHEELS>::predictWheelSpeeds_(
+    wheel_data<WHEELS> current_wheel_speeds, float delta_time) {
+  /* the duties applied since the last tick drive the models forward */
+  wheel_data<WHEELS> predicted_wheel_speeds;
+  for (int wheel = 0; wheel < WHEELS; wheel++) {
+    predicted_wheel_speeds[wheel] = predictors_[wheel]->predict(
+        current_wheel_speeds[wheel], applied_duty_cycles_[wheel],
+        feedback_delay_, delta_time);
+  }
+  return predicted_wheel_speeds;
+}
+
+template <int WHEELS>
+wheel_data<WHEELS>
+SkidRobotMotionController<WHEELS>::computeMotorCommandsDual_(
+    wheel_data<WHEELS> target_wheel_speeds,
+    wheel_data<WHEELS> current_wheel_speeds) {
+  /* average the wheels of each side */
+  float left_magnitude = averageSide<WHEELS>(current_wheel_speeds, LEFT_WHEELS);
   float right_magnitude =
-      (current_wheel_speeds.fr + current_wheel_speeds.rr) / 2;
+      averageSide<WHEELS>(current_wheel_speeds, RIGHT_WHEELS);
 
   /* run pid, 1 per side */
 
   pid_mutex_.lock();
-  pid_outputs l_pid_output =
-      pid_controller_left_->runControl(target_wheel_speeds.fl, left_magnitude);
+  pid_outputs l_pid_output = pid_controller_left_->runControl(
+      target_wheel_speeds[LEFT_WHEELS], left_magnitude);
 
   pid_outputs r_pid_output = pid_controller_right_->runControl(
-      target_wheel_speeds.fr, right_magnitude);
+      target_wheel_speeds[RIGHT_WHEELS], right_magnitude);
   pid_mutex_.unlock();
 
 #ifdef DEBUG
@@ -485,139 +1277,247 @@ motor_data SkidRobotMotionController::computeMotorCommandsDual_(
 #endif
 
   /* math to split the torque distribution */
-  motor_data power_proposals = (motor_data){.fl = l_pid_output.pid_output,
-                                            .fr = r_pid_output.pid_output,
-                                            .rl = l_pid_output.pid_output,
-                                            .rr = r_pid_output.pid_output};
-
-  isnan(power_proposals.fr) ? power_proposals.fr = 0
-                            : power_proposals.fr = power_proposals.fr;
-  isnan(power_proposals.fl) ? power_proposals.fl = 0
-                            : power_proposals.fl = power_proposals.fl;
-  isnan(power_proposals.rr) ? power_proposals.rr = 0
-                            : power_proposals.rr = power_proposals.rr;
-  isnan(power_proposals.rl) ? power_proposals.rl = 0
-                            : power_proposals.rl = power_proposals.rl;
+  wheel_data<WHEELS> power_proposals = fillSides<WHEELS>(
+      isnan(l_pid_output.pid_output) ? 0 : l_pid_output.pid_output,
+      isnan(r_pid_output.pid_output) ? 0 : r_pid_output.pid_output);
 
   /* add here */
 
   return power_proposals;
 }
 
-motor_data SkidRobotMotionController::computeMotorCommandsQuad_(
-    motor_data target_wheel_speeds, motor_data current_wheel_speeds) {
+template <int WHEELS>
+wheel_data<WHEELS>
+SkidRobotMotionController<WHEELS>::computeMotorCommandsWheels_(
+    wheel_data<WHEELS> target_wheel_speeds,
+    wheel_data<WHEELS> current_wheel_speeds) {
   /* run pid, 1 per wheel */
+  std::array<pid_outputs, WHEELS> pid_output;
   pid_mutex_.lock();
-  pid_outputs fl_pid_output = pid_controller_fl_->runControl(
-      target_wheel_speeds.fl, current_wheel_speeds.fl);
-
-  pid_outputs fr_pid_output = pid_controller_fr_->runControl(
-      target_wheel_speeds.fr, current_wheel_speeds.fr);
-
-  pid_outputs rl_pid_output = pid_controller_rl_->runControl(
-      target_wheel_speeds.rl, current_wheel_speeds.rl);
-
-  pid_outputs rr_pid_output = pid_controller_rr_->runControl(
-      target_wheel_speeds.rr, current_wheel_speeds.rr);
+  for (int wheel = 0; wheel < WHEELS; wheel++) {
+    pid_output[wheel] = pid_controller_wheels_[wheel]->runControl(
+        target_wheel_speeds[wheel], current_wheel_speeds[wheel]);
+  }
   pid_mutex_.unlock();
 #ifdef DEBUG
-  pid_controller_fl_->writePidDataToCsv(log_file_, fl_pid_output);
-  pid_controller_fr_->writePidDataToCsv(log_file_, fr_pid_output);
-  pid_controller_rl_->writePidDataToCsv(log_file_, rl_pid_output);
-  pid_controller_rr_->writePidDataToCsv(log_file_, rr_pid_output);
+  for (int wheel = 0; wheel < WHEELS; wheel++) {
+    pid_controller_wheels_[wheel]->writePidDataToCsv(log_file_,
+                                                     pid_output[wheel]);
+  }
 #endif
 
   /* math to split the torque distribution */
-  motor_data power_proposals = (motor_data){.fl = fl_pid_output.pid_output,
-                                            .fr = fr_pid_output.pid_output,
-                                            .rl = rl_pid_output.pid_output,
-                                            .rr = rr_pid_output.pid_output};
-
-  isnan(power_proposals.fr) ? power_proposals.fr = 0
-                            : power_proposals.fr = power_proposals.fr;
-  isnan(power_proposals.fl) ? power_proposals.fl = 0
-                            : power_proposals.fl = power_proposals.fl;
-  isnan(power_proposals.rr) ? power_proposals.rr = 0
-                            : power_proposals.rr = power_proposals.rr;
-  isnan(power_proposals.rl) ? power_proposals.rl = 0
-                            : power_proposals.rl = power_proposals.rl;
+  wheel_data<WHEELS> power_proposals;
+  for (int wheel = 0; wheel < WHEELS; wheel++) {
+    power_proposals[wheel] =
+        isnan(pid_output[wheel].pid_output) ? 0 : pid_output[wheel].pid_output;
+  }
 
   /* add here */
 
   return power_proposals;
 }
 
-motor_data SkidRobotMotionController::clipDutyCycles_(
-    motor_data proposed_duties) {
-  /* clip extreme duty cycles in either direction (positive or negative) */
-  proposed_duties.fr =
-      std::clamp(proposed_duties.fr, -max_motor_duty_, max_motor_duty_);
-  proposed_duties.fl =
-      std::clamp(proposed_duties.fl, -max_motor_duty_, max_motor_duty_);
-  proposed_duties.rr =
-      std::clamp(proposed_duties.rr, -max_motor_duty_, max_motor_duty_);
-  proposed_duties.rl =
-      std::clamp(proposed_duties.rl, -max_motor_duty_, max_motor_duty_);
-
-  /* enforce minimum magnitude (positive or negative) */
-  if (std::abs(proposed_duties.fl) < min_motor_duty_) proposed_duties.fl = 0;
-  if (std::abs(proposed_duties.fr) < min_motor_duty_) proposed_duties.fr = 0;
-  if (std::abs(proposed_duties.rl) < min_motor_duty_) proposed_duties.rl = 0;
-  if (std::abs(proposed_duties.rr) < min_motor_duty_) proposed_duties.rr = 0;
+template <int WHEELS>
+wheel_data<WHEELS> SkidRobotMotionController<WHEELS>::computeMotorCommandsMpc_(
+    wheel_data<WHEELS> target_wheel_speeds,
+    wheel_data<WHEELS> current_wheel_speeds) {
+  /* average the wheels of each side */
+  float left_target = averageSide<WHEELS>(target_wheel_speeds, LEFT_WHEELS);
+  float right_target = averageSide<WHEELS>(target_wheel_speeds, RIGHT_WHEELS);
+  float left_speed = averageSide<WHEELS>(current_wheel_speeds, LEFT_WHEELS);
+  float right_speed = averageSide<WHEELS>(current_wheel_speeds, RIGHT_WHEELS);
+
+  /* solve the horizon, 1 per side */
+  pid_mutex_.lock();
+  float left_duty = mpc_left_->update(left_target, left_speed);
+  float right_duty = mpc_right_->update(right_target, right_speed);
+  pid_mutex_.unlock();
+
+  return fillSides<WHEELS>(left_duty, right_duty);
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::accumulateDuties_(
+    wheel_data<WHEELS> motor_duties_add) {
+  /* the largest duty clipDutyCycles_ can apply, before the voltage scaling */
+  float duty_limit = max_motor_duty_ / voltageScale_();
+
+  /* keep the sum within it, the rest of the increment is rejected */
+  wheel_data<WHEELS> rejected_duties;
+  for (int wheel = 0; wheel < WHEELS; wheel++) {
+    float duty =
+        (duty_cycles_[wheel] + motor_duties_add[wheel]) * geometric_decay_;
+    duty_cycles_[wheel] = std::clamp(duty, -duty_limit, duty_limit);
+    rejected_duties[wheel] = duty_cycles_[wheel] - duty;
+  }
+
+  /* the pids wind up on the saturated sum, not on their increment limits */
+  pid_mutex_.lock();
+  if (operating_mode_ == INDEPENDENT_WHEEL) {
+    for (int wheel = 0; wheel < WHEELS; wheel++) {
+      pid_controller_wheels_[wheel]->trackAppliedOutput(
+          motor_duties_add[wheel] + rejected_duties[wheel]);
+    }
+  } else if (operating_mode_ == TRACTION_CONTROL) {
+    pid_controller_left_->trackAppliedOutput(
+        motor_duties_add[LEFT_WHEELS] +
+        averageSide<WHEELS>(rejected_duties, LEFT_WHEELS));
+    pid_controller_right_->trackAppliedOutput(
+        motor_duties_add[RIGHT_WHEELS] +
+        averageSide<WHEELS>(rejected_duties, RIGHT_WHEELS));
+  }
+  pid_mutex_.unlock();
+}
+
+template <int WHEELS>
+wheel_data<WHEELS> SkidRobotMotionController<WHEELS>::clipDutyCycles_(
+    wheel_data<WHEELS> proposed_duties) {
+  /* the duties are referenced to the nominal bus voltage */
+  float voltage_scale = voltageScale_();
+
+  for (int wheel = 0; wheel < WHEELS; wheel++) {
+    float duty = proposed_duties[wheel] * voltage_scale;
+
+    /* clip extreme duty cycles in either direction (positive or negative) */
+    duty = std::clamp(duty, -max_motor_duty_, max_motor_duty_);
+
+    /* overcome static friction instead of dropping small requests */
+    duty = compensateDeadband_(duty,
+                               deadband_compensation_.breakaway_duty[wheel]);
+
+    /* enforce minimum magnitude (positive or negative) */
+    if (std::abs(duty) < min_motor_duty_) duty = 0;
+
+    proposed_duties[wheel] = duty;
+  }
 
   return proposed_duties;
 }
 
-motor_data SkidRobotMotionController::computeTorqueDistribution_(
-    motor_data current_wheel_speeds, motor_data power_proposals) {
-  /* right side */
-  /* if both wheels are moving then ... */
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setTractionParams(
+    traction_params traction_params) {
+  std::scoped_lock lock(traction_mutex_);
+  traction_params_ = traction_params;
+  for (auto &detector : slip_detectors_) detector->setParams(traction_params);
+}
 
-  /* if front wheel is spinning faster ... */
-  if (std::abs(current_wheel_speeds.fr) >= std::abs(current_wheel_speeds.rr)) {
-    /* scale down FRONT RIGHT power */
-    power_proposals.fr *=
-        (isnan(std::abs(current_wheel_speeds.rr / current_wheel_speeds.fr))
-             ? 1.0
-             : std::abs(current_wheel_speeds.rr / current_wheel_speeds.fr));
-  } else {
-    /* scale down REAR RIGHT power */
-    power_proposals.rr *=
-        (isnan(std::abs(current_wheel_speeds.fr / current_wheel_speeds.rr))
-             ? 1.0
-             : std::abs(current_wheel_speeds.fr / current_wheel_speeds.rr));
-  }
-
-  /* left side */
-  if (std::abs(current_wheel_speeds.fl) >= std::abs(current_wheel_speeds.rl)) {
-    /* scale down FRONT LEFT power */
-    power_proposals.fl *=
-        (isnan(std::abs(current_wheel_speeds.rl / current_wheel_speeds.fl))
-             ? 1.0
-             : std::abs(current_wheel_speeds.rl / current_wheel_speeds.fl));
-  } else {
-    /* scale down REAR LEFT power */
-    power_proposals.rl *=
-        (isnan(std::abs(current_wheel_speeds.fl / current_wheel_speeds.rl))
-             ? 1.0
-             : std::abs(current_wheel_speeds.fl / current_wheel_speeds.rl));
+template <int WHEELS>
+traction_params SkidRobotMotionController<WHEELS>::getTractionParams() {
+  std::scoped_lock lock(traction_mutex_);
+  return traction_params_;
+}
+
+template <int WHEELS>
+void SkidRobotMotionController<WHEELS>::setMotorCurrent(int wheel,
+                                                        float current) {
+  if (wheel < 0 || wheel >= WHEELS || isnan(current)) return;
+
+  std::scoped_lock lock(traction_mutex_);
+  motor_currents_[wheel] = std::abs(current);
+  current_times_[wheel] = clockNow();
+}
+
+template <int WHEELS>
+wheel_data<WHEELS> SkidRobotMotionController<WHEELS>::getWheelGrip() {
+  std::scoped_lock lock(traction_mutex_);
+  return wheel_grip_;
+}
+
+template <int WHEELS>
+wheel_data<WHEELS>
+SkidRobotMotionController<WHEELS>::computeTorqueDistribution_(
+    wheel_data<WHEELS> current_wheel_speeds,
+    wheel_data<WHEELS> power_proposals, float delta_time) {
+  /* a single wheel per side has nothing to share its torque with */
+  if constexpr (WHEELS > 2) {
+    std::scoped_lock lock(traction_mutex_);
+    std::chrono::steady_clock::time_point time_now = clockNow();
+
+    for (int side = LEFT_WHEELS; side <= RIGHT_WHEELS; side++) {
+      /* the slowest wheel of the side has the most grip; the currents are
+       * only judged when every wheel of the side reported one */
+      float slowest = std::numeric_limits<float>::max();
+      float fastest = 0;
+      float current_sum = 0;
+      bool currents_fresh = true;
+      for (int wheel = side; wheel < WHEELS; wheel += 2) {
+        slowest = std::min(slowest, std::abs(current_wheel_speeds[wheel]));
+        fastest = std::max(fastest, std::abs(current_wheel_speeds[wheel]));
+        current_sum += motor_currents_[wheel];
+        currents_fresh &= std::chrono::duration<float>(
+                              time_now - current_times_[wheel])
+                              .count() <= MOTOR_CURRENT_TIMEOUT_;
+      }
+      float mean_current = current_sum / (WHEELS / 2);
+      bool currents_valid =
+          currents_fresh && mean_current >= traction_params_.min_current;
+
+      /* a side at rest is not judged, and one with a wheel at rest (ie
+       * spinning up from a standstill) is judged without learning from it */
+      if (!(fastest >= traction_params_.min_speed)) {
+        for (int wheel = side; wheel < WHEELS; wheel += 2) {
+          wheel_grip_[wheel] = 1;
+        }
+        continue;
+      }
+      float reference_speed = std::max(slowest, traction_params_.min_speed);
+      float learning_time =
+          (slowest >= traction_params_.min_speed) ? delta_time : 0;
+
+      /* take duty from the wheels spinning faster than their grip ... */
+      float taken_duty = 0;
+      int gripping_wheels = 0;
+      for (int wheel = side; wheel < WHEELS; wheel += 2) {
+        float speed_excess =
+            std::abs(current_wheel_speeds[wheel]) / reference_speed - 1;
+        std::optional<float> current_share;
+        if (currents_valid) {
+          current_share = motor_currents_[wheel] / mean_current;
+        }
+
+        float grip = slip_detectors_[wheel]->update(
+            speed_excess, current_share, learning_time);
+        wheel_grip_[wheel] = grip;
+        if (slip_detectors_[wheel]->isSlipping()) {
+          taken_duty += power_proposals[wheel] * (1 - grip);
+          power_proposals[wheel] *= grip;
+        } else {
+          gripping_wheels++;
+        }
+      }
+
+      /* ... and give it to the wheels that can put it on the ground */
+      if (gripping_wheels == 0) continue;
+      float given_duty =
+          traction_params_.redistribution * taken_duty / gripping_wheels;
+      for (int wheel = side; wheel < WHEELS; wheel += 2) {
+        if (!slip_detectors_[wheel]->isSlipping()) {
+          power_proposals[wheel] += given_duty;
+        }
+      }
+    }
   }
 
   return power_proposals;
 }
 
-robot_velocities SkidRobotMotionController::getMeasuredVelocities(
-    motor_data current_wheel_speeds) {
-  return computeVelocitiesFromWheelspeeds(current_wheel_speeds,
-                                          robot_geometry_);
+template <int WHEELS>
+robot_velocities SkidRobotMotionController<WHEELS>::getMeasuredVelocities(
+    wheel_data<WHEELS> current_wheel_speeds) {
+  return computeVelocitiesFromWheelspeeds<WHEELS>(
+      current_wheel_speeds, robot_geometry_, skid_steer_params_);
 }
 
-motor_data SkidRobotMotionController::runMotionControl(
-    robot_velocities velocity_targets, motor_data current_duty_cycles,
-    motor_data current_wheel_speeds) {
+template <int WHEELS>
+wheel_data<WHEELS> SkidRobotMotionController<WHEELS>::runMotionControl(
+    robot_velocities velocity_targets, wheel_data<WHEELS> current_duty_cycles,
+    wheel_data<WHEELS> current_wheel_speeds) {
+  LIBROVER_TRACE(control_begin, WHEELS, operating_mode_);
+
   /* take the time*/
-  std::chrono::steady_clock::time_point time_now =
-      std::chrono::steady_clock::now();
+  std::chrono::steady_clock::time_point time_now = clockNow();
 
   /* delta time (S) */
   float delta_time =
@@ -629,40 +1529,66 @@ motor_data SkidRobotMotionController::runMotionControl(
   time_last_ = time_now;
 
   /* get estimated robot velocities */
-  measured_velocities_ =
-      computeVelocitiesFromWheelspeeds(current_wheel_speeds, robot_geometry_);
+  measured_velocities_ = computeVelocitiesFromWheelspeeds<WHEELS>(
+      current_wheel_speeds, robot_geometry_, skid_steer_params_);
+
+  /* a relay experiment replaces normal control while it runs */
+  if (auto relay_duties =
+          runAutotune_(current_wheel_speeds, accumulated_time, delta_time)) {
+    applied_duty_cycles_ = relay_duties.value();
+    LIBROVER_TRACE(control_end, WHEELS, operating_mode_);
+    return relay_duties.value();
+  }
 
   /* limit acceleration */
   robot_velocities velocity_commands;
   robot_velocities acceleration_limits = {max_linear_acceleration_,
                                           max_angular_acceleration_};
 
-  velocity_commands = limitAcceleration(velocity_targets, measured_velocities_,
-                                        acceleration_limits, delta_time);
+  if (operating_mode_ == MODEL_PREDICTIVE) {
+    /* acceleration and jerk are constraints of the mpc instead */
+    velocity_commands = velocity_targets;
+  } else {
+    velocity_commands = limitAcceleration(
+        velocity_targets, measured_velocities_, acceleration_limits,
+        delta_time);
+  }
 
   /* scale the angular command */
   velocity_commands = scaleAngularCommand(
       velocity_commands, measured_velocities_, angular_scaling_params_);
 
   /* get target wheelspeeds from velocities */
-  motor_data target_wheel_speeds =
-      computeSkidSteerWheelSpeeds(velocity_commands, robot_geometry_);
+  wheel_data<WHEELS> target_wheel_speeds =
+      computeSkidSteerWheelSpeeds<WHEELS>(velocity_commands, robot_geometry_,
+                                          skid_steer_params_);
+
+  /* compensate for the delay of the wheelspeed feedback */
+  wheel_data<WHEELS> feedback_wheel_speeds = current_wheel_speeds;
+  if (latency_compensation_ && operating_mode_ != OPEN_LOOP) {
+    feedback_wheel_speeds =
+        predictWheelSpeeds_(current_wheel_speeds, delta_time);
+  }
+
+  /* refine the trim while driving straight */
+  updateAutoTrim_(velocity_targets, current_wheel_speeds, delta_time);
 
   /* apply trim value to targets */
-  target_wheel_speeds.fl *= left_trim_value_;
-  target_wheel_speeds.rl *= left_trim_value_;
-  target_wheel_speeds.fr *= right_trim_value_;
-  target_wheel_speeds.rr *= right_trim_value_;
+  for (int wheel = 0; wheel < WHEELS; wheel++) {
+    target_wheel_speeds[wheel] *= (wheelSide(wheel) == LEFT_WHEELS)
+                                      ? left_trim_value_
+                                      : right_trim_value_;
+  }
 
   /* do control */
-  motor_data motor_duties_add;
-  motor_data modified_duties;
+  wheel_data<WHEELS> motor_duties_add;
+  wheel_data<WHEELS> modified_duties;
   switch (operating_mode_) {
     case OPEN_LOOP:
-      duty_cycles_.fr = target_wheel_speeds.fr / open_loop_max_wheel_rpm_;
-      duty_cycles_.fl = target_wheel_speeds.fl / open_loop_max_wheel_rpm_;
-      duty_cycles_.rr = target_wheel_speeds.rr / open_loop_max_wheel_rpm_;
-      duty_cycles_.rl = target_wheel_speeds.rl / open_loop_max_wheel_rpm_;
+      for (int wheel = 0; wheel < WHEELS; wheel++) {
+        duty_cycles_[wheel] =
+            target_wheel_speeds[wheel] / open_loop_max_wheel_rpm_;
+      }
 
       /* don't allow duties higher than the limits */
       modified_duties = clipDutyCycles_(duty_cycles_);
@@ -670,20 +1596,11 @@ motor_data SkidRobotMotionController::runMotionControl(
       break;
 
     case INDEPENDENT_WHEEL:
-      motor_duties_add =
-          computeMotorCommandsQuad_(target_wheel_speeds, current_wheel_speeds);
+      motor_duties_add = computeMotorCommandsWheels_(target_wheel_speeds,
+                                                     feedback_wheel_speeds);
 
-      /* add the change to the duty cycles */
-      duty_cycles_.fl += motor_duties_add.fl;
-      duty_cycles_.fr += motor_duties_add.fr;
-      duty_cycles_.rr += motor_duties_add.rr;
-      duty_cycles_.rl += motor_duties_add.rl;
-
-      /* add a geometric decay to the duty cycles */
-      duty_cycles_.fl *= geometric_decay_;
-      duty_cycles_.fr *= geometric_decay_;
-      duty_cycles_.rr *= geometric_decay_;
-      duty_cycles_.rl *= geometric_decay_;
+      /* add the change to the duty cycles, with a geometric decay */
+      accumulateDuties_(motor_duties_add);
 
       /* don't allow duties higher or lower than the limits */
       modified_duties = clipDutyCycles_(duty_cycles_);
@@ -691,35 +1608,44 @@ motor_data SkidRobotMotionController::runMotionControl(
       break;
 
     case TRACTION_CONTROL:
+      /* close the loop on heading rate around the wheelspeed loops */
+      if (yaw_rate_control_) {
+        target_wheel_speeds = correctYawRate_(
+            target_wheel_speeds, velocity_commands.angular_velocity);
+      }
+
       /* determine how much change is needed to the duty cycles */
       motor_duties_add =
-          computeMotorCommandsDual_(target_wheel_speeds, current_wheel_speeds);
-
-      /* add the change to the duty cycles */
-      duty_cycles_.fl += motor_duties_add.fl;
-      duty_cycles_.fr += motor_duties_add.fr;
-      duty_cycles_.rr += motor_duties_add.rr;
-      duty_cycles_.rl += motor_duties_add.rl;
+          computeMotorCommandsDual_(target_wheel_speeds, feedback_wheel_speeds);
 
-      /* add a geometric decay to the duty cycles */
-      duty_cycles_.fl *= geometric_decay_;
-      duty_cycles_.fr *= geometric_decay_;
-      duty_cycles_.rr *= geometric_decay_;
-      duty_cycles_.rl *= geometric_decay_;
+      /* add the change to the duty cycles, with a geometric decay */
+      accumulateDuties_(motor_duties_add);
 
       /* run traction control */
       modified_duties =
-          computeTorqueDistribution_(current_wheel_speeds, duty_cycles_);
+          computeTorqueDistribution_(feedback_wheel_speeds, duty_cycles_,
+                                     delta_time);
 
       /* don't allow duties higher or lower than the limits */
       modified_duties = clipDutyCycles_(modified_duties);
 
       break;
 
+    case MODEL_PREDICTIVE:
+      /* the duties already respect the duty, acceleration and jerk limits */
+      duty_cycles_ =
+          computeMotorCommandsMpc_(target_wheel_speeds, feedback_wheel_speeds);
+
+      /* voltage, deadband and min duty still apply */
+      modified_duties = clipDutyCycles_(duty_cycles_);
+
+      break;
+
     default:
       std::cerr << "invalid motion control type.. commanding 0 motion"
                 << std::endl;
-      duty_cycles_ = {0, 0, 0, 0};
+      duty_cycles_.fill(0);
+      modified_duties = duty_cycles_;
       break;
   }
 
@@ -729,14 +1655,708 @@ motor_data SkidRobotMotionController::runMotionControl(
             << velocity_commands.linear_velocity << ","
             << velocity_commands.angular_velocity << ","
             << measured_velocities_.linear_velocity << ","
-            << measured_velocities_.angular_velocity << ","
-            << current_wheel_speeds.fl << "," << current_wheel_speeds.fr << ","
-            << current_wheel_speeds.rl << "," << current_wheel_speeds.rr << ","
-            << duty_cycles_.fl << "," << duty_cycles_.fr << ","
-            << duty_cycles_.rr << "," << duty_cycles_.rl << "," << std::endl;
+            << measured_velocities_.angular_velocity << ",";
+  for (float wheel_speed : current_wheel_speeds) {
+    log_file_ << wheel_speed << ",";
+  }
+  for (float duty_cycle : duty_cycles_) log_file_ << duty_cycle << ",";
+  log_file_ << std::endl;
   log_file_.flush();
 #endif
 
+  /* remember what was commanded for the predictors */
+  applied_duty_cycles_ = modified_duties;
+
+  LIBROVER_TRACE(control_end, WHEELS, operating_mode_);
   return modified_duties;
 }
-}  // namespace Control
\ No newline at end of file
+
+WheelSpeedPredictor::WheelSpeedPredictor(plant_model plant_model)
+    : plant_model_(plant_model) {
+  reset();
+}
+
+void WheelSpeedPredictor::setPlantModel(plant_model plant_model) {
+  plant_model_ = plant_model;
+}
+
+void WheelSpeedPredictor::reset() {
+  model_speed_ = 0;
+  history_head_ = 0;
+  model_history_.fill(0);
+  dt_history_.fill(0);
+}
+
+float WheelSpeedPredictor::predict(float measured, float applied_duty,
+                                   float feedback_delay, float dt) {
+  dt = std::max(dt, 0.0f);
+
+  /* step the first-order model with the duty that was applied */
+  float alpha = (plant_model_.time_constant > 0)
+                    ? dt / (plant_model_.time_constant + dt)
+                    : 1.0f;
+  model_speed_ += alpha * (plant_model_.gain * applied_duty - model_speed_);
+
+  /* record the model output */
+  history_head_ = (history_head_ + 1) % HISTORY_LENGTH_;
+  model_history_[history_head_] = model_speed_;
+  dt_history_[history_head_] = dt;
+
+  /* walk back through the history until the total delay is covered */
+  float delay = plant_model_.dead_time + feedback_delay;
+  float elapsed = 0;
+  int index = history_head_;
+  for (int i = 0; i < HISTORY_LENGTH_ - 1 && elapsed < delay; i++) {
+    elapsed += dt_history_[index];
+    index = (index + HISTORY_LENGTH_ - 1) % HISTORY_LENGTH_;
+  }
+
+  /* the measurement corrects the model where the model disagrees with it */
+  return measured + (model_speed_ - model_history_[index]);
+}
+
+WheelSpeedMpc::WheelSpeedMpc(plant_model plant_model, mpc_params mpc_params,
+                             float max_duty)
+    : mpc_params_(mpc_params),
+      max_duty_(max_duty),
+      last_solve_time_(0),
+      worst_solve_time_(0) {
+  setup_(plant_model);
+  reset();
+}
+
+void WheelSpeedMpc::setup_(plant_model plant_model) {
+  const int N = HORIZON;
+  float gain = std::max(std::abs(plant_model.gain), 1.0f);
+  float dt = std::max(mpc_params_.dt, 1e-3f);
+  speed_scale_ = 1 / gain;
+
+  /* discrete first-order model, speeds in units of the plant gain:
+   * speed[k + 1] = decay * speed[k] + input_gain * duty[k] + disturbance */
+  decay_ = (plant_model.time_constant > 0)
+               ? exp(-dt / plant_model.time_constant)
+               : 0.0f;
+  input_gain_ = 1 - decay_;
+  max_step_acceleration_ = mpc_params_.max_wheel_acceleration * dt / gain;
+  max_step_jerk_ = mpc_params_.max_wheel_jerk * dt * dt / gain;
+
+  /* predicted speed of step j responds to the duty of step i <= j */
+  response_.fill(0);
+  for (int j = 0; j < N; j++) {
+    for (int i = 0; i <= j; i++) {
+      response_[j * N + i] = pow(decay_, j - i) * input_gain_;
+    }
+  }
+  auto response = [this, N](int j, int i) {
+    return (j < 0) ? 0.0f : response_[j * N + i];
+  };
+
+  /* cost: tracking of every predicted speed and changes of the duty */
+  for (int r = 0; r < N; r++) {
+    for (int c = 0; c < N; c++) {
+      float tracking = 0;
+      for (int j = 0; j < N; j++) {
+        tracking += response_[j * N + r] * response_[j * N + c];
+      }
+      float duty_rate = (r == c) ? ((r < N - 1) ? 2 : 1)
+                                 : ((std::abs(r - c) == 1) ? -1 : 0);
+      hessian_[r * N + c] = 2 * (mpc_params_.tracking_weight * tracking +
+                                 mpc_params_.duty_rate_weight * duty_rate);
+    }
+  }
+
+  /* constraints: duty, change of speed and change of acceleration */
+  constraints_.fill(0);
+  for (int k = 0; k < N; k++) {
+    constraints_[k * N + k] = 1;
+    for (int i = 0; i < N; i++) {
+      constraints_[(N + k) * N + i] = response(k, i) - response(k - 1, i);
+      constraints_[(2 * N + k) * N + i] =
+          response(k, i) - 2 * response(k - 1, i) + response(k - 2, i);
+    }
+  }
+
+  /* factor the reduced kkt matrix, it does not change between ticks */
+  for (int r = 0; r < N; r++) {
+    for (int c = 0; c < N; c++) {
+      float sum = hessian_[r * N + c] + ((r == c) ? ADMM_SIGMA_ : 0);
+      for (int m = 0; m < CONSTRAINTS_; m++) {
+        sum += mpc_params_.admm_rho * constraints_[m * N + r] *
+               constraints_[m * N + c];
+      }
+      kkt_factor_[r * N + c] = sum;
+    }
+  }
+  for (int c = 0; c < N; c++) {
+    for (int k = 0; k < c; k++) {
+      kkt_factor_[c * N + c] -= kkt_factor_[c * N + k] * kkt_factor_[c * N + k];
+    }
+    kkt_factor_[c * N + c] = sqrt(kkt_factor_[c * N + c]);
+    for (int r = c + 1; r < N; r++) {
+      for (int k = 0; k < c; k++) {
+        kkt_factor_[r * N + c] -=
+            kkt_factor_[r * N + k] * kkt_factor_[c * N + k];
+      }
+      kkt_factor_[r * N + c] /= kkt_factor_[c * N + c];
+    }
+  }
+}
+
+void WheelSpeedMpc::reset() {
+  duties_.fill(0);
+  slack_.fill(0);
+  dual_.fill(0);
+  initialized_ = false;
+  previous_speed_ = 0;
+  previous_duty_ = 0;
+  disturbance_ = 0;
+}
+
+void WheelSpeedMpc::solveKkt_(std::array<float, HORIZON> &rhs) {
+  const int N = HORIZON;
+  /* forward substitution with L, then back substitution with L' */
+  for (int r = 0; r < N; r++) {
+    for (int k = 0; k < r; k++) rhs[r] -= kkt_factor_[r * N + k] * rhs[k];
+    rhs[r] /= kkt_factor_[r * N + r];
+  }
+  for (int r = N - 1; r >= 0; r--) {
+    for (int k = r + 1; k < N; k++) rhs[r] -= kkt_factor_[k * N + r] * rhs[k];
+    rhs[r] /= kkt_factor_[r * N + r];
+  }
+}
+
+float WheelSpeedMpc::update(float target_speed, float measured_speed) {
+  /* the solve time is real time, even when the control runs simulated */
+  auto solve_start = std::chrono::steady_clock::now();
+  const int N = HORIZON;
+  const float rho = mpc_params_.admm_rho;
+  float speed = measured_speed * speed_scale_;
+  float target = target_speed * speed_scale_;
+
+  /* the model mismatch is tracked as a constant disturbance, which gives the
+   * loop its integral action */
+  if (!initialized_) previous_speed_ = speed;
+  float mismatch =
+      speed - (decay_ * previous_speed_ + input_gain_ * previous_duty_);
+  if (initialized_) {
+    disturbance_ += mpc_params_.disturbance_gain * (mismatch - disturbance_);
+  }
+
+  /* speeds predicted when the duty stays zero */
+  free_response_[0] = speed;
+  for (int j = 1; j <= N; j++) {
+    free_response_[j] = decay_ * free_response_[j - 1] + disturbance_;
+  }
+
+  /* linear cost of the tracking error and of the change from the last duty */
+  for (int i = 0; i < N; i++) {
+    float sum = 0;
+    for (int j = i; j < N; j++) {
+      sum += response_[j * N + i] * (free_response_[j + 1] - target);
+    }
+    linear_cost_[i] = 2 * mpc_params_.tracking_weight * sum;
+  }
+  linear_cost_[0] -= 2 * mpc_params_.duty_rate_weight * previous_duty_;
+
+  /* bounds, less what the free response already uses */
+  for (int k = 0; k < N; k++) {
+    float acceleration = free_response_[k + 1] - free_response_[k];
+    float jerk = free_response_[k + 1] - 2 * free_response_[k] +
+                 ((k > 0) ? free_response_[k - 1] : previous_speed_);
+    lower_[k] = -max_duty_;
+    upper_[k] = max_duty_;
+    lower_[N + k] = -max_step_acceleration_ - acceleration;
+    upper_[N + k] = max_step_acceleration_ - acceleration;
+    lower_[2 * N + k] = -max_step_jerk_ - jerk;
+    upper_[2 * N + k] = max_step_jerk_ - jerk;
+  }
+
+  /* warm start from the previous solution, one step later */
+  for (int i = 0; i < N - 1; i++) duties_[i] = duties_[i + 1];
+  for (int block = 0; block < 3; block++) {
+    for (int k = 0; k < N - 1; k++) {
+      slack_[block * N + k] = slack_[block * N + k + 1];
+      dual_[block * N + k] = dual_[block * N + k + 1];
+    }
+  }
+
+  /* ADMM iterations, a fixed number so the solve time is bounded */
+  for (int iteration = 0; iteration < mpc_params_.iterations; iteration++) {
+    for (int i = 0; i < N; i++) {
+      float sum = ADMM_SIGMA_ * duties_[i] - linear_cost_[i];
+      for (int m = 0; m < CONSTRAINTS_; m++) {
+        sum += constraints_[m * N + i] * (rho * slack_[m] - dual_[m]);
+      }
+      solution_[i] = sum;
+    }
+    solveKkt_(solution_);
+
+    for (int m = 0; m < CONSTRAINTS_; m++) {
+      float constrained = 0;
+      for (int i = 0; i < N; i++) {
+        constrained += constraints_[m * N + i] * solution_[i];
+      }
+      relaxed_[m] =
+          ADMM_ALPHA_ * constrained + (1 - ADMM_ALPHA_) * slack_[m];
+    }
+    for (int i = 0; i < N; i++) {
+      duties_[i] =
+          ADMM_ALPHA_ * solution_[i] + (1 - ADMM_ALPHA_) * duties_[i];
+    }
+    for (int m = 0; m < CONSTRAINTS_; m++) {
+      slack_[m] =
+          std::clamp(relaxed_[m] + dual_[m] / rho, lower_[m], upper_[m]);
+      dual_[m] += rho * (relaxed_[m] - slack_[m]);
+    }
+  }
+
+  /* an unfinished solve can still be slightly outside the duty limit */
+  float duty = std::clamp(duties_[0], -max_duty_, max_duty_);
+  if (isnan(duty)) {
+    reset();
+    duty = 0;
+  }
+  initialized_ = true;
+  previous_speed_ = speed;
+  previous_duty_ = duty;
+
+  last_solve_time_ = std::chrono::duration<float>(
+                         std::chrono::steady_clock::now() - solve_start)
+                         .count();
+  worst_solve_time_ = std::max(worst_solve_time_, last_solve_time_);
+  return duty;
+}
+
+mpc_timing WheelSpeedMpc::getTiming() {
+  return (mpc_timing){.last_solve_time = last_solve_time_,
+                      .worst_solve_time = worst_solve_time_};
+}
+
+template <int WHEELS>
+TachometerOdometry<WHEELS>::TachometerOdometry(float meters_per_count,
+                                               robot_geometry robot_geometry)
+    : meters_per_count_(meters_per_count), robot_geometry_(robot_geometry) {
+  reset();
+}
+
+template <int WHEELS>
+void TachometerOdometry<WHEELS>::setRobotGeometry(
+    robot_geometry robot_geometry) {
+  robot_geometry_ = robot_geometry;
+}
+
+template <int WHEELS>
+void TachometerOdometry<WHEELS>::setSkidSteerParams(
+    skid_steer_params skid_steer_params) {
+  skid_steer_params_ = skid_steer_params;
+}
+
+template <int WHEELS>
+void TachometerOdometry<WHEELS>::reset() {
+  initialized_ = false;
+  last_counts_.fill(0);
+  odometry_ = {0, 0, 0, 0, 0};
+}
+
+template <int WHEELS>
+float TachometerOdometry<WHEELS>::countsToDistance_(int32_t counts_now,
+                                                    int32_t counts_last) {
+  /* unsigned subtraction handles the counter wrapping around */
+  int32_t delta_counts = static_cast<int32_t>(
+      static_cast<uint32_t>(counts_now) - static_cast<uint32_t>(counts_last));
+  return delta_counts * meters_per_count_;
+}
+
+template <int WHEELS>
+odometry_data TachometerOdometry<WHEELS>::update(
+    wheel_counts<WHEELS> tachometer_counts) {
+  /* the first counts only set the baseline */
+  if (!initialized_) {
+    last_counts_ = tachometer_counts;
+    initialized_ = true;
+    return odometry_;
+  }
+
+  /* distance travelled by each wheel since the last update */
+  wheel_data<WHEELS> distances;
+  for (int wheel = 0; wheel < WHEELS; wheel++) {
+    distances[wheel] =
+        countsToDistance_(tachometer_counts[wheel], last_counts_[wheel]);
+  }
+  last_counts_ = tachometer_counts;
+
+  /* a motor controller rebooted; keep the new counts as the baseline */
+  for (float wheel_distance : distances) {
+    if (std::abs(wheel_distance) > MAX_UPDATE_DISTANCE_) return odometry_;
+  }
+
+  /* ground distance of each side, wheels slip by the traction factor */
+  float left_distance = skid_steer_params_.traction_factor *
+                        averageSide<WHEELS>(distances, LEFT_WHEELS);
+  float right_distance = skid_steer_params_.traction_factor *
+                         averageSide<WHEELS>(distances, RIGHT_WHEELS);
+
+  /* integrate the pose about the midpoint heading */
+  float effective_wheel_base =
+      computeEffectiveWheelBase(robot_geometry_, skid_steer_params_);
+  float delta_heading = (right_distance - left_distance) / effective_wheel_base;
+  float distance =
+      left_distance +
+      delta_heading *
+          (0.5 * effective_wheel_base - robot_geometry_.center_of_mass_y_offset);
+  double midpoint_heading = odometry_.heading + delta_heading / 2;
+
+  odometry_.left_distance += left_distance;
+  odometry_.right_distance += right_distance;
+  odometry_.x += distance * cos(midpoint_heading);
+  odometry_.y += distance * sin(midpoint_heading);
+  odometry_.heading += delta_heading;
+
+  return odometry_;
+}
+
+template <int WHEELS>
+odometry_data TachometerOdometry<WHEELS>::getOdometry() { return odometry_; }
+
+template <int WHEELS>
+void TachometerOdometry<WHEELS>::setMetersPerCount(float meters_per_count) {
+  meters_per_count_ = meters_per_count;
+}
+
+KinematicCalibrator::KinematicCalibrator(robot_geometry robot_geometry,
+                                         skid_steer_params skid_steer_params)
+    : nominal_geometry_(robot_geometry),
+      skid_steer_params_(skid_steer_params),
+      applied_geometry_(robot_geometry) {
+  nominal_radius_ =
+      robot_geometry.wheel_radius * skid_steer_params.traction_factor;
+  nominal_yaw_gain_ =
+      nominal_radius_ /
+      computeEffectiveWheelBase(robot_geometry, skid_steer_params);
+  radius_estimate_ = {1, INITIAL_COVARIANCE_, 0};
+  yaw_gain_estimate_ = {1, INITIAL_COVARIANCE_, 0};
+}
+
+bool KinematicCalibrator::addYawRateSample(float left_wheel_rate,
+                                           float right_wheel_rate,
+                                           float yaw_rate) {
+  std::scoped_lock lock(calibration_mutex_);
+
+  /* driving straight says nothing about the wheel base */
+  float predicted_yaw_rate =
+      nominal_yaw_gain_ * (right_wheel_rate - left_wheel_rate);
+  if (std::abs(predicted_yaw_rate) < MIN_YAW_EXCITATION_) return false;
+
+  updateEstimate_(yaw_gain_estimate_, predicted_yaw_rate, yaw_rate);
+  return checkApply_();
+}
+
+bool KinematicCalibrator::addDisplacementSample(float left_wheel_angle,
+                                                float right_wheel_angle,
+                                                float distance,
+                                                float rotation) {
+  std::scoped_lock lock(calibration_mutex_);
+
+  /* the sides move about the rotation center, not the center of mass */
+  float predicted_distance =
+      nominal_radius_ * (left_wheel_angle + right_wheel_angle) / 2;
+  float measured_distance =
+      distance + rotation * nominal_geometry_.center_of_mass_y_offset;
+  if (std::abs(predicted_distance) >= MIN_DISTANCE_EXCITATION_) {
+    updateEstimate_(radius_estimate_, predicted_distance, measured_distance);
+  }
+
+  float predicted_rotation =
+      nominal_yaw_gain_ * (right_wheel_angle - left_wheel_angle);
+  if (std::abs(predicted_rotation) >= MIN_ROTATION_EXCITATION_) {
+    updateEstimate_(yaw_gain_estimate_, predicted_rotation, rotation);
+  }
+
+  return checkApply_();
+}
+
+robot_geometry KinematicCalibrator::getGeometry() {
+  std::scoped_lock lock(calibration_mutex_);
+  return applied_geometry_;
+}
+
+void KinematicCalibrator::updateEstimate_(scale_estimate &estimate,
+                                          float prediction,
+                                          float measurement) {
+  /* fit the relative error: every sample weighs the same whatever its size,
+   * which keeps the covariance comparable to CONVERGED_COVARIANCE_ */
+  float magnitude = std::abs(prediction);
+  prediction /= magnitude;
+  measurement /= magnitude;
+
+  /* scalar recursive least squares with exponential forgetting */
+  float gain = estimate.covariance * prediction /
+               (FORGETTING_FACTOR_ +
+                prediction * estimate.covariance * prediction);
+  estimate.scale += gain * (measurement - estimate.scale * prediction);
+  estimate.covariance =
+      (estimate.covariance - gain * prediction * estimate.covariance) /
+      FORGETTING_FACTOR_;
+  estimate.covariance = std::min(estimate.covariance, INITIAL_COVARIANCE_);
+  estimate.scale = std::clamp(estimate.scale, MIN_SCALE_, MAX_SCALE_);
+  estimate.samples++;
+}
+
+bool KinematicCalibrator::isConverged_(const scale_estimate &estimate) {
+  return estimate.samples >= MIN_SAMPLES_ &&
+         estimate.covariance <= CONVERGED_COVARIANCE_;
+}
+
+robot_geometry KinematicCalibrator::computeGeometry_() {
+  float radius_scale =
+      isConverged_(radius_estimate_) ? radius_estimate_.scale : 1;
+  float yaw_gain_scale =
+      isConverged_(yaw_gain_estimate_) ? yaw_gain_estimate_.scale : 1;
+
+  robot_geometry geometry = nominal_geometry_;
+  geometry.wheel_radius = nominal_geometry_.wheel_radius * radius_scale;
+
+  /* yaw gain is radius over effective wheel base */
+  float effective_wheel_base =
+      computeEffectiveWheelBase(nominal_geometry_, skid_steer_params_) *
+      radius_scale / yaw_gain_scale;
+
+  /* invert the effective wheel base model: W^2 - B*W + k*(L^2 + 4x^2) = 0 */
+  float expansion = skid_steer_params_.track_expansion *
+                    (pow(nominal_geometry_.intra_axle_distance, 2) +
+                     4 * pow(nominal_geometry_.center_of_mass_x_offset, 2));
+  float discriminant = pow(effective_wheel_base, 2) - 4 * expansion;
+  geometry.wheel_base =
+      (effective_wheel_base + sqrt(std::max(discriminant, 0.0f))) / 2;
+
+  return geometry;
+}
+
+bool KinematicCalibrator::checkApply_() {
+  robot_geometry geometry = computeGeometry_();
+  bool changed =
+      std::abs(geometry.wheel_radius - applied_geometry_.wheel_radius) >
+          APPLY_TOLERANCE_ * applied_geometry_.wheel_radius ||
+      std::abs(geometry.wheel_base - applied_geometry_.wheel_base) >
+          APPLY_TOLERANCE_ * applied_geometry_.wheel_base;
+  if (changed) applied_geometry_ = geometry;
+  return changed;
+}
+
+TrimEstimator::TrimEstimator(float max_trim, float initial_trim)
+    : max_trim_(max_trim),
+      trim_(std::clamp(initial_trim, -max_trim, max_trim)),
+      /* not stable until measured otherwise */
+      filtered_imbalance_(MAX_IMBALANCE_),
+      stable_time_(0) {}
+
+float TrimEstimator::update(float imbalance, float dt) {
+  if (isnan(imbalance) || std::abs(imbalance) > MAX_IMBALANCE_) return trim_;
+
+  /* a positive trim slows the right side */
+  trim_ = std::clamp(trim_ + TRIM_GAIN_ * imbalance * dt, -max_trim_,
+                     max_trim_);
+
+  /* stable once the remaining imbalance stays small */
+  float alpha = dt / (FILTER_TIME_CONSTANT_ + dt);
+  filtered_imbalance_ += alpha * (imbalance - filtered_imbalance_);
+  if (std::abs(filtered_imbalance_) < STABLE_IMBALANCE_) {
+    stable_time_ += dt;
+  } else {
+    stable_time_ = 0;
+  }
+  return trim_;
+}
+
+float TrimEstimator::getTrim() { return trim_; }
+
+bool TrimEstimator::isStable() { return stable_time_ >= STABLE_TIME_; }
+
+SlipDetector::SlipDetector(traction_params params)
+    : params_(params),
+      slipping_(false),
+      excess_mean_(0),
+      excess_variance_(0) {}
+
+void SlipDetector::setParams(traction_params params) { params_ = params; }
+
+float SlipDetector::update(float speed_excess,
+                           std::optional<float> current_share, float dt) {
+  if (isnan(speed_excess)) {
+    slipping_ = false;
+    return 1;
+  }
+
+  /* how far the wheel runs ahead of its usual excess */
+  float deviation = speed_excess - excess_mean_;
+  float threshold =
+      std::max(params_.slip_threshold,
+               params_.noise_sigmas * std::sqrt(excess_variance_));
+
+  /* slip needs an unloaded motor when the currents are known, and ends with
+   * hysteresis once the wheel is back within half the threshold */
+  if (slipping_) {
+    slipping_ = deviation > threshold / 2;
+  } else {
+    bool unloaded =
+        !current_share || current_share.value() < params_.current_ratio;
+    slipping_ = deviation > threshold && unloaded;
+  }
+
+  if (slipping_) {
+    /* slow the wheel down to the speed it turns at with grip */
+    return (1 + excess_mean_) / (1 + speed_excess);
+  }
+
+  /* exponentially weighted mean and variance while gripping; a persistent
+   * excess beyond the threshold is slip, never the norm */
+  float alpha = dt / (params_.statistics_time + dt);
+  float increment = alpha * deviation;
+  excess_mean_ = std::clamp(excess_mean_ + increment, -params_.slip_threshold,
+                            params_.slip_threshold);
+  excess_variance_ = (1 - alpha) * (excess_variance_ + deviation * increment);
+  return 1;
+}
+
+bool SlipDetector::isSlipping() { return slipping_; }
+
+void SlipDetector::reset() {
+  slipping_ = false;
+  excess_mean_ = 0;
+  excess_variance_ = 0;
+}
+
+AlphaBetaFilter::AlphaBetaFilter(float alpha)
+    : alpha_(alpha), initialized_(false), running_sum_(0) {}
+
+float AlphaBetaFilter::update(float new_value) {
+  if (!initialized_) {
+    running_sum_ = new_value;
+    initialized_ = true;
+    return running_sum_;
+  }
+  running_sum_ += alpha_ * (new_value - running_sum_);
+  return running_sum_;
+}
+
+void AlphaBetaFilter::reset() {
+  initialized_ = false;
+  running_sum_ = 0;
+}
+
+PathFollower::PathFollower(pure_pursuit_params params)
+    : params_(params),
+      progress_index_(0),
+      last_speed_(0),
+      frame_x_(0),
+      frame_y_(0),
+      frame_heading_(0) {}
+
+void PathFollower::setPath(std::vector<path_point> path) {
+  std::shared_ptr<const std::vector<path_point>> new_path;
+  if (!path.empty()) {
+    new_path = std::make_shared<const std::vector<path_point>>(std::move(path));
+  }
+  std::atomic_store(&path_, new_path);
+}
+
+void PathFollower::correctPose(odometry_data world_pose,
+                               odometry_data odometry_pose) {
+  std::scoped_lock lock(frame_mutex_);
+  frame_heading_ = world_pose.heading - odometry_pose.heading;
+  frame_x_ = world_pose.x - (cos(frame_heading_) * odometry_pose.x -
+                             sin(frame_heading_) * odometry_pose.y);
+  frame_y_ = world_pose.y - (sin(frame_heading_) * odometry_pose.x +
+                             cos(frame_heading_) * odometry_pose.y);
+}
+
+std::optional<robot_velocities> PathFollower::update(odometry_data odometry) {
+  /* a new path starts over from its first point */
+  auto path = std::atomic_load(&path_);
+  if (path != active_path_) {
+    active_path_ = path;
+    progress_index_ = 0;
+  }
+  if (!active_path_) return std::nullopt;
+  const std::vector<path_point> &points = *active_path_;
+
+  /* pose in the frame of the path */
+  float x, y, heading;
+  {
+    std::scoped_lock lock(frame_mutex_);
+    x = frame_x_ + cos(frame_heading_) * odometry.x -
+        sin(frame_heading_) * odometry.y;
+    y = frame_y_ + sin(frame_heading_) * odometry.x +
+        cos(frame_heading_) * odometry.y;
+    heading = frame_heading_ + odometry.heading;
+  }
+  auto distance_to = [&points, x, y](size_t index) {
+    return std::hypot(points[index].x - x, points[index].y - y);
+  };
+
+  /* progress only moves forward, to the closest point ahead */
+  while (progress_index_ + 1 < points.size() &&
+         distance_to(progress_index_ + 1) <= distance_to(progress_index_)) {
+    progress_index_++;
+  }
+
+  /* done once the last point is reached; a path swapped in meanwhile stays */
+  if (progress_index_ + 1 == points.size() &&
+      distance_to(progress_index_) < params_.goal_tolerance) {
+    std::atomic_compare_exchange_strong(
+        &path_, &path, std::shared_ptr<const std::vector<path_point>>());
+    last_speed_ = 0;
+    return (robot_velocities){.linear_velocity = 0, .angular_velocity = 0};
+  }
+
+  /* first point at least a lookahead away, growing with the speed */
+  float lookahead =
+      params_.min_lookahead + params_.lookahead_time * std::abs(last_speed_);
+  size_t target_index = progress_index_;
+  while (target_index + 1 < points.size() &&
+         distance_to(target_index) < lookahead) {
+    target_index++;
+  }
+
+  /* arc through the target point, in the robot frame */
+  float dx = points[target_index].x - x;
+  float dy = points[target_index].y - y;
+  float local_x = cos(heading) * dx + sin(heading) * dy;
+  float local_y = -sin(heading) * dx + cos(heading) * dy;
+  float squared_distance = local_x * local_x + local_y * local_y;
+  float curvature =
+      squared_distance > 0 ? 2 * local_y / squared_distance : 0;
+
+  float speed =
+      std::max(points[progress_index_].speed, params_.min_speed);
+  last_speed_ = speed;
+  return (robot_velocities){
+      .linear_velocity = speed,
+      .angular_velocity =
+          std::clamp(speed * curvature, -params_.max_angular_velocity,
+                     params_.max_angular_velocity)};
+}
+
+bool PathFollower::isActive() { return std::atomic_load(&path_) != nullptr; }
+
+/* wheel counts the library is built for */
+#define INSTANTIATE_WHEEL_COUNT(WHEELS)                                        \
+  template wheel_data<WHEELS> computeSkidSteerWheelSpeeds<WHEELS>(             \
+      robot_velocities, robot_geometry);                                       \
+  template wheel_data<WHEELS> computeSkidSteerWheelSpeeds<WHEELS>(             \
+      robot_velocities, robot_geometry, skid_steer_params);                    \
+  template robot_velocities computeVelocitiesFromWheelspeeds<WHEELS>(          \
+      wheel_data<WHEELS>, robot_geometry);                                     \
+  template robot_velocities computeVelocitiesFromWheelspeeds<WHEELS>(          \
+      wheel_data<WHEELS>, robot_geometry, skid_steer_params);                  \
+  template float averageSide<WHEELS>(const wheel_data<WHEELS> &,               \
+                                     wheel_side_t);                            \
+  template wheel_data<WHEELS> fillSides<WHEELS>(float, float);                 \
+  template class SkidRobotMotionController<WHEELS>;                            \
+  template class TachometerOdometry<WHEELS>;
+
+INSTANTIATE_WHEEL_COUNT(2)
+INSTANTIATE_WHEEL_COUNT(4)
+INSTANTIATE_WHEEL_COUNT(6)
+INSTANTIATE_WHEEL_COUNT(8)
+}  // namespace Control
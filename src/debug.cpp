@@ -53,6 +53,13 @@ void print_status(RoverRobotics::robotData &robotdata) {
             << "motor3_sensor2 " << robotdata.motor3_sensor2 << std::endl
             << "linear_vel " << robotdata.linear_vel << std::endl
             << "angular_vel " << robotdata.angular_vel << std::endl
+            << "odom_left_distance " << robotdata.odom_left_distance
+            << std::endl
+            << "odom_right_distance " << robotdata.odom_right_distance
+            << std::endl
+            << "odom_x " << robotdata.odom_x << std::endl
+            << "odom_y " << robotdata.odom_y << std::endl
+            << "odom_heading " << robotdata.odom_heading << std::endl
             << "cmd_linear_vel " << robotdata.cmd_linear_vel << std::endl
             << "cmd_angular_vel " << robotdata.cmd_angular_vel << std::endl
 	    << "Firmware" << robotdata.robot_firmware << std::endl;
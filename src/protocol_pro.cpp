@@ -1,4 +1,5 @@
 #include "protocol_pro.hpp"
+#include "tracepoints.hpp"
 
 namespace RoverRobotics {
 
@@ -57,6 +58,21 @@ robotData ProProtocolObject::status_request() {
 
 robotData ProProtocolObject::info_request() { return robotstatus_; }
 
+std::vector<std::pair<std::string, double>>
+ProProtocolObject::metrics_request() {
+  robotstatus_mutex_.lock();
+  std::vector<std::pair<std::string, double>> metrics = {
+      {"robot_firmware", robotstatus_.robot_firmware}};
+  robotstatus_mutex_.unlock();
+  if (comm_base_) {
+    auto comm_metrics = comm_base_->metrics();
+    metrics.insert(metrics.end(), comm_metrics.begin(), comm_metrics.end());
+  }
+  auto lock_metrics = Utilities::ProfiledMutex::metrics();
+  metrics.insert(metrics.end(), lock_metrics.begin(), lock_metrics.end());
+  return metrics;
+}
+
 void ProProtocolObject::set_robot_velocity(double *controlarray) {
   robotstatus_mutex_.lock();
   robotstatus_.cmd_linear_vel = controlarray[0];
@@ -102,6 +118,8 @@ void ProProtocolObject::motors_control_loop(int sleeptime) {
       motors_speeds_[FLIPPER_MOTOR] = MOTOR_NEUTRAL_;
       motor1_control_.reset();
       motor2_control_.reset();
+      command_quantizers_[LEFT_MOTOR].reset();
+      command_quantizers_[RIGHT_MOTOR].reset();
       robotstatus_mutex_.unlock();
       time_last = time_now;
       continue;
@@ -135,14 +153,24 @@ void ProProtocolObject::motors_control_loop(int sleeptime) {
         motor2_control_.run(motor2_vel, motor2_measured_vel,
                             pid_update_elapsedtime / 1000, firmware);
 
-    // Convert to 8 bit Command
-    motors_speeds_[LEFT_MOTOR] = motor1_control_.boundMotorSpeed(
-        int(round(motors_speeds_[LEFT_MOTOR] * 50 + MOTOR_NEUTRAL_)),
-        MOTOR_MAX_, MOTOR_MIN_);
+    // Convert to 8 bit Command, kept continuous when the TX path dithers it
+    if (USE_COMMAND_DITHERING_) {
+      motors_speeds_[LEFT_MOTOR] = motor1_control_.boundMotorSpeed(
+          motors_speeds_[LEFT_MOTOR] * 50 + MOTOR_NEUTRAL_, MOTOR_MAX_,
+          MOTOR_MIN_);
 
-    motors_speeds_[RIGHT_MOTOR] = motor2_control_.boundMotorSpeed(
-        int(round(motors_speeds_[RIGHT_MOTOR] * 50 + MOTOR_NEUTRAL_)),
-        MOTOR_MAX_, MOTOR_MIN_);
+      motors_speeds_[RIGHT_MOTOR] = motor2_control_.boundMotorSpeed(
+          motors_speeds_[RIGHT_MOTOR] * 50 + MOTOR_NEUTRAL_, MOTOR_MAX_,
+          MOTOR_MIN_);
+    } else {
+      motors_speeds_[LEFT_MOTOR] = motor1_control_.boundMotorSpeed(
+          int(round(motors_speeds_[LEFT_MOTOR] * 50 + MOTOR_NEUTRAL_)),
+          MOTOR_MAX_, MOTOR_MIN_);
+
+      motors_speeds_[RIGHT_MOTOR] = motor2_control_.boundMotorSpeed(
+          int(round(motors_speeds_[RIGHT_MOTOR] * 50 + MOTOR_NEUTRAL_)),
+          MOTOR_MAX_, MOTOR_MIN_);
+    }
     robotstatus_mutex_.unlock();
     time_last = time_now;
   }
@@ -186,6 +214,7 @@ void ProProtocolObject::unpack_comm_response(std::vector<uint8_t> robotmsg) {
     checksum = 255 - (dataNO + data1 + data2) % 255;
     read_checksum = (unsigned char)msgqueue[4];
     if (checksum == read_checksum) {  // verify checksum
+      LIBROVER_TRACE(parse_complete, 0, dataNO);
       int16_t b = (data1 << 8) + data2;
       switch (int(dataNO)) {
         case REG_PWR_TOTAL_CURRENT:
@@ -306,19 +335,23 @@ void ProProtocolObject::unpack_comm_response(std::vector<uint8_t> robotmsg) {
             0.5 * (robotstatus_.motor1_rpm * 2 / MOTOR_RPM_TO_MPS_RATIO_ +
                    robotstatus_.motor2_rpm * 2 / MOTOR_RPM_TO_MPS_RATIO_);
 
+        /* motor1 - motor2 keeps the sign existing drivers expect */
         robotstatus_.angular_vel =
             ((robotstatus_.motor1_rpm * 2 / MOTOR_RPM_TO_MPS_RATIO_) -
-             (robotstatus_.motor2_rpm * 2 / MOTOR_RPM_TO_MPS_RATIO_)) *
-            odom_angular_coef_ * odom_traction_factor_;
+             (robotstatus_.motor2_rpm * 2 / MOTOR_RPM_TO_MPS_RATIO_)) /
+            Control::computeEffectiveWheelBase(ROBOT_GEOMETRY_,
+                                               SKID_STEER_PARAMS_);
       } else {
         robotstatus_.linear_vel =
             0.5 * (robotstatus_.motor1_rpm / MOTOR_RPM_TO_MPS_RATIO_ +
                    robotstatus_.motor2_rpm / MOTOR_RPM_TO_MPS_RATIO_);
 
+        /* motor1 - motor2 keeps the sign existing drivers expect */
         robotstatus_.angular_vel =
             ((robotstatus_.motor1_rpm / MOTOR_RPM_TO_MPS_RATIO_) -
-             (robotstatus_.motor2_rpm / MOTOR_RPM_TO_MPS_RATIO_)) *
-            odom_angular_coef_ * odom_traction_factor_;
+             (robotstatus_.motor2_rpm / MOTOR_RPM_TO_MPS_RATIO_)) /
+            Control::computeEffectiveWheelBase(ROBOT_GEOMETRY_,
+                                               SKID_STEER_PARAMS_);
       }
 
       std::vector<uint32_t> temp;
@@ -375,24 +408,34 @@ void ProProtocolObject::register_comm_base(const char *device) {
   }
 }
 
+unsigned char ProProtocolObject::motor_command_byte(int motor) {
+  // Every frame gets a fresh dither step, the flipper is not dithered
+  if (USE_COMMAND_DITHERING_ && motor != FLIPPER_MOTOR) {
+    return (unsigned char)command_quantizers_[motor].quantize(
+        motors_speeds_[motor], MOTOR_MAX_, MOTOR_MIN_);
+  }
+  return (unsigned char)int(motors_speeds_[motor]);
+}
+
 void ProProtocolObject::send_command(int sleeptime,
                                      std::vector<uint32_t> datalist) {
   while (true) {
     for (int x : datalist) {
       if (comm_type_ == "serial") {
         robotstatus_mutex_.lock();
+        unsigned char left_command = motor_command_byte(LEFT_MOTOR);
+        unsigned char right_command = motor_command_byte(RIGHT_MOTOR);
+        unsigned char flipper_command = motor_command_byte(FLIPPER_MOTOR);
         std::vector<unsigned char> write_buffer = {
             (unsigned char)startbyte_,
-            (unsigned char)int(motors_speeds_[LEFT_MOTOR]),
-            (unsigned char)int(motors_speeds_[RIGHT_MOTOR]),
-            (unsigned char)int(motors_speeds_[FLIPPER_MOTOR]),
+            left_command,
+            right_command,
+            flipper_command,
             (unsigned char)requestbyte_,
             (unsigned char)x};
 
         write_buffer.push_back(
-            (char)255 - ((unsigned char)int(motors_speeds_[LEFT_MOTOR]) +
-                         (unsigned char)int(motors_speeds_[RIGHT_MOTOR]) +
-                         (unsigned char)int(motors_speeds_[FLIPPER_MOTOR]) +
+            (char)255 - (left_command + right_command + flipper_command +
                          requestbyte_ + x) %
                             255);
         comm_base_->write_to_device(write_buffer);
@@ -1,4 +1,5 @@
 #include "protocol_pro_2.hpp"
+#include "tracepoints.hpp"
 namespace RoverRobotics {
 Pro2ProtocolObject::Pro2ProtocolObject(
     const char *device, std::string new_comm_type,
@@ -30,17 +31,48 @@ Pro2ProtocolObject::Pro2ProtocolObject(
   /* register the pid gains for closed-loop modes */
   pid_ = pid;
 
+  /* a lockstep simulation starts at 0, the controllers take it from here */
+  if (comm_type_ == "lockstep") {
+    Control::setSimulatedTime(sim_time_.load());
+  }
+
   /* make and initialize the motion logic object */
-  skid_control_ = std::make_unique<Control::SkidRobotMotionController>(
+  skid_control_ = std::make_unique<Control::SkidRobotMotionController<4>>(
       Control::TRACTION_CONTROL, robot_geometry_, pid_, MOTOR_MAX_, MOTOR_MIN_,
       left_trim_, right_trim_, geometric_decay_);
 
+  /* odometry from the motor controller tachometers */
+  tach_odometry_ = std::make_unique<Control::TachometerOdometry<4>>(
+      2 * M_PI * robot_geometry_.wheel_radius / TACH_COUNTS_PER_WHEEL_REV_,
+      robot_geometry_);
+  tach_odometry_->setSkidSteerParams(SKID_STEER_PARAMS_);
+  path_follower_ = std::make_unique<Control::PathFollower>(PURE_PURSUIT_PARAMS_);
+
   /* MUST be done after skid control is constructed */
   load_persistent_params();
 
+  /* calibrate around the (persisted) geometry */
+  if (USE_KINEMATIC_CALIBRATION_) {
+    calibrator_ = std::make_unique<Control::KinematicCalibrator>(
+        robot_geometry_, SKID_STEER_PARAMS_);
+  }
+
   /* set some default params */
   skid_control_->setOpenLoopMaxRpm(OPEN_LOOP_MAX_RPM_);
   skid_control_->setAngularScaling(angular_scaling_params_);
+  skid_control_->setSkidSteerParams(SKID_STEER_PARAMS_);
+  /* overrides the loaded trim disabling it, only when opted in */
+  if (USE_AUTO_TRIM_) {
+    skid_control_->setAutoTrim(true, MAX_CURVATURE_CORRECTION_);
+  }
+  skid_control_->setPlantModel(plant_model_);
+  skid_control_->setDeadbandCompensation(deadband_compensation_);
+  skid_control_->setVoltageCompensation(USE_VOLTAGE_COMPENSATION_,
+                                        nominal_battery_voltage_);
+  skid_control_->setLatencyCompensation(USE_LATENCY_COMPENSATION_);
+  skid_control_->setYawRatePidGains(YAW_RATE_PID_GAINS_);
+  skid_control_->setYawRateControl(USE_YAW_RATE_CONTROL_);
+  feedback_ts_ = Control::clockNow();
 
   /* make an object to decode and encode motor controller messages*/
   vescArray_ = vesc::BridgedVescArray(
@@ -64,11 +96,23 @@ Pro2ProtocolObject::Pro2ProtocolObject(
       skid_control_->setAccelerationLimits(
           {LINEAR_JERK_LIMIT_, std::numeric_limits<float>::max()});
       break;
+    case Control::MODEL_PREDICTIVE:
+      /* the mpc limits acceleration and jerk itself */
+      skid_control_->setOperatingMode(Control::MODEL_PREDICTIVE);
+      skid_control_->setAccelerationLimits({std::numeric_limits<float>::max(),
+                                            std::numeric_limits<float>::max()});
+      break;
   }
 
   /* set up the comm port */
   register_comm_base(device);
 
+  /* the simulation steps the protocol, nothing runs on its own */
+  if (lockstep_comm_) {
+    Control::setSimulatedTime(std::nullopt);
+    return;
+  }
+
   /* create a dedicated write thread to send commands to the robot on fixed
    * interval */
   write_to_robot_thread_ = std::thread([this]() { this->send_command(30); });
@@ -86,9 +130,72 @@ void Pro2ProtocolObject::load_persistent_params() {
     update_drivetrim(param.value());
     std::cout << "Loaded trim from persistent param file: " << param.value() << std::endl;
   }
+
+  /* calibrated geometry */
+  Control::robot_geometry robot_geometry = robot_geometry_;
+  if (auto param = persistent_params_->read_param("wheel_radius")) {
+    robot_geometry.wheel_radius = param.value();
+  }
+  if (auto param = persistent_params_->read_param("wheel_base")) {
+    robot_geometry.wheel_base = param.value();
+  }
+  apply_robot_geometry(robot_geometry);
+
+  /* drive model identified by the sysid tool */
+  if (auto param = persistent_params_->read_param("plant_gain")) {
+    plant_model_.gain = param.value();
+  }
+  if (auto param = persistent_params_->read_param("plant_time_constant")) {
+    plant_model_.time_constant = param.value();
+  }
+  if (auto param = persistent_params_->read_param("plant_dead_time")) {
+    plant_model_.dead_time = param.value();
+  }
+  if (auto param = persistent_params_->read_param("plant_voltage")) {
+    nominal_battery_voltage_ = param.value();
+  }
+
+  /* static friction of each wheel */
+  if (auto param = persistent_params_->read_param("breakaway_duty_fl")) {
+    deadband_compensation_.breakaway_duty[FRONT_LEFT] = param.value();
+  }
+  if (auto param = persistent_params_->read_param("breakaway_duty_fr")) {
+    deadband_compensation_.breakaway_duty[FRONT_RIGHT] = param.value();
+  }
+  if (auto param = persistent_params_->read_param("breakaway_duty_rl")) {
+    deadband_compensation_.breakaway_duty[BACK_LEFT] = param.value();
+  }
+  if (auto param = persistent_params_->read_param("breakaway_duty_rr")) {
+    deadband_compensation_.breakaway_duty[BACK_RIGHT] = param.value();
+  }
+}
+
+void Pro2ProtocolObject::apply_robot_geometry(
+    Control::robot_geometry robot_geometry) {
+  robot_geometry_ = robot_geometry;
+  skid_control_->setRobotGeometry(robot_geometry_);
+  tach_odometry_->setRobotGeometry(robot_geometry_);
+  tach_odometry_->setMetersPerCount(2 * M_PI * robot_geometry_.wheel_radius /
+                                    TACH_COUNTS_PER_WHEEL_REV_);
+}
+
+void Pro2ProtocolObject::publish_calibration() {
+  auto robot_geometry = calibrator_->getGeometry();
+  std::cout << "writing calibrated wheel radius " << robot_geometry.wheel_radius
+            << " and wheel base " << robot_geometry.wheel_base << " to file"
+            << std::endl;
+  persistent_params_->write_param("wheel_radius", robot_geometry.wheel_radius);
+  persistent_params_->write_param("wheel_base", robot_geometry.wheel_base);
+
+  robotstatus_mutex_.lock();
+  pending_geometry_ = robot_geometry;
+  robotstatus_mutex_.unlock();
 }
 
 void Pro2ProtocolObject::update_drivetrim(double delta) {
+  /* the operator takes over from the automatic trim */
+  skid_control_->setAutoTrim(false, MAX_CURVATURE_CORRECTION_);
+
 
   if (-MAX_CURVATURE_CORRECTION_ < (trimvalue_ + delta) && (trimvalue_ + delta) < MAX_CURVATURE_CORRECTION_) {
     trimvalue_ += delta;
@@ -110,6 +217,36 @@ void Pro2ProtocolObject::update_drivetrim(double delta) {
   
 }
 
+bool Pro2ProtocolObject::tachometer_fresh() {
+  if (tachometer_received_ != 0x0F) return false;
+  auto time_now = Control::clockNow();
+  for (auto &tachometer_ts : tachometer_ts_) {
+    if (std::chrono::duration<float>(time_now - tachometer_ts).count() >
+        TACHOMETER_TIMEOUT_) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Pro2ProtocolObject::save_auto_trim(double trim) {
+  /* the controller already applies it, only the record needs updating */
+  bool changed = std::abs(trim - trimvalue_) > AUTO_TRIM_SAVE_TOLERANCE_;
+  trimvalue_ = trim;
+  if (trimvalue_ >= 0) {
+    left_trim_ = 1;
+    right_trim_ = 1 - trimvalue_;
+  } else {
+    right_trim_ = 1;
+    left_trim_ = 1 + trimvalue_;
+  }
+  if (changed) {
+    std::cout << "writing automatic trim " << trimvalue_ << " to file "
+              << std::endl;
+    persistent_params_->write_param("trim", trimvalue_);
+  }
+}
+
 void Pro2ProtocolObject::send_estop(bool estop) {
   robotstatus_mutex_.lock();
   estop_ = estop;
@@ -130,19 +267,87 @@ robotData Pro2ProtocolObject::info_request() {
   return returnData; 
 }
 
+std::vector<std::pair<std::string, double>>
+Pro2ProtocolObject::metrics_request() {
+  /* wheelspeed depends on the STATUS broadcast of each VESC, tachometer and
+   * voltage on the STATUS_5 one */
+  robotstatus_mutex_.lock();
+  std::vector<std::pair<std::string, double>> metrics = {
+      {"front_left_status", (status_received_ >> FRONT_LEFT) & 1},
+      {"front_right_status", (status_received_ >> FRONT_RIGHT) & 1},
+      {"back_left_status", (status_received_ >> BACK_LEFT) & 1},
+      {"back_right_status", (status_received_ >> BACK_RIGHT) & 1},
+      {"front_left_status_5", (tachometer_received_ >> FRONT_LEFT) & 1},
+      {"front_right_status_5", (tachometer_received_ >> FRONT_RIGHT) & 1},
+      {"back_left_status_5", (tachometer_received_ >> BACK_LEFT) & 1},
+      {"back_right_status_5", (tachometer_received_ >> BACK_RIGHT) & 1},
+      /* duty sent to each VESC, after trim and compensation */
+      {"front_left_duty", motors_speeds_[FRONT_LEFT]},
+      {"front_right_duty", motors_speeds_[FRONT_RIGHT]},
+      {"back_left_duty", motors_speeds_[BACK_LEFT]},
+      {"back_right_duty", motors_speeds_[BACK_RIGHT]}};
+  robotstatus_mutex_.unlock();
+  auto mpc_timing = skid_control_->getMpcTiming();
+  metrics.push_back({"mpc_last_solve_time", mpc_timing.last_solve_time});
+  metrics.push_back({"mpc_worst_solve_time", mpc_timing.worst_solve_time});
+  auto wheel_grip = skid_control_->getWheelGrip();
+  metrics.push_back({"front_left_grip", wheel_grip[FRONT_LEFT]});
+  metrics.push_back({"front_right_grip", wheel_grip[FRONT_RIGHT]});
+  metrics.push_back({"back_left_grip", wheel_grip[BACK_LEFT]});
+  metrics.push_back({"back_right_grip", wheel_grip[BACK_RIGHT]});
+  if (comm_base_) {
+    auto comm_metrics = comm_base_->metrics();
+    metrics.insert(metrics.end(), comm_metrics.begin(), comm_metrics.end());
+  }
+  auto lock_metrics = Utilities::ProfiledMutex::metrics();
+  metrics.insert(metrics.end(), lock_metrics.begin(), lock_metrics.end());
+  return metrics;
+}
+
 void Pro2ProtocolObject::set_robot_velocity(double *control_array) {
   robotstatus_mutex_.lock();
   robotstatus_.cmd_linear_vel = control_array[0];
   robotstatus_.cmd_angular_vel = control_array[1];
-  robotstatus_.cmd_ts = std::chrono::duration_cast<std::chrono::milliseconds>(
-      std::chrono::system_clock::now().time_since_epoch());
+  robotstatus_.cmd_ts = command_clock();
+  /* a velocity command takes over from a path, a zero one stops it */
+  path_follower_->setPath({});
   robotstatus_mutex_.unlock();
 }
 
 void Pro2ProtocolObject::unpack_comm_response(std::vector<uint8_t> robotmsg) {
   auto parsedMsg = vescArray_.parseReceivedMessage(robotmsg);
   if (parsedMsg.dataValid) {
+    LIBROVER_TRACE(parse_complete, parsedMsg.vescId, parsedMsg.packetType);
+  }
+  if (parsedMsg.dataValid &&
+      parsedMsg.packetType == vesc::vescPacketFlags::STATUS_5) {
     robotstatus_mutex_.lock();
+    switch (parsedMsg.vescId) {
+      case (FRONT_LEFT):
+        tachometer_counts_[FRONT_LEFT] = parsedMsg.tachometer;
+        break;
+      case (FRONT_RIGHT):
+        tachometer_counts_[FRONT_RIGHT] = parsedMsg.tachometer;
+        break;
+      case (BACK_LEFT):
+        tachometer_counts_[BACK_LEFT] = parsedMsg.tachometer;
+        break;
+      case (BACK_RIGHT):
+        tachometer_counts_[BACK_RIGHT] = parsedMsg.tachometer;
+        break;
+      default:
+        break;
+    }
+    if (parsedMsg.vescId <= BACK_RIGHT) {
+      tachometer_received_ |= (1 << parsedMsg.vescId);
+      tachometer_ts_[parsedMsg.vescId] = Control::clockNow();
+    }
+    robotstatus_.battery1_voltage = parsedMsg.voltage;
+    robotstatus_mutex_.unlock();
+    skid_control_->setBusVoltage(parsedMsg.voltage);
+  } else if (parsedMsg.dataValid) {
+    robotstatus_mutex_.lock();
+    feedback_ts_ = Control::clockNow();
     switch (parsedMsg.vescId) {
       case (FRONT_LEFT):
         robotstatus_.motor1_rpm = parsedMsg.rpm;
@@ -167,7 +372,15 @@ void Pro2ProtocolObject::unpack_comm_response(std::vector<uint8_t> robotmsg) {
       default:
         break;
     }
+    if (parsedMsg.vescId <= BACK_RIGHT) {
+      status_received_ |= (1 << parsedMsg.vescId);
+    }
     robotstatus_mutex_.unlock();
+
+    /* the wheels are indexed like the VESCs */
+    if (parsedMsg.vescId <= BACK_RIGHT) {
+      skid_control_->setMotorCurrent(parsedMsg.vescId, parsedMsg.current);
+    }
   }
 }
 
@@ -183,38 +396,79 @@ void Pro2ProtocolObject::register_comm_base(const char *device) {
     } catch (int i) {
       throw(i);
     }
+  } else if (comm_type_ == "lockstep") {
+    auto lockstep_comm = std::make_unique<CommLockstep>();
+    lockstep_comm_ = lockstep_comm.get();
+    comm_base_ = std::move(lockstep_comm);
   } else
     throw(-2);
 }
 
+void Pro2ProtocolObject::step(double sim_time) {
+  if (!lockstep_comm_) return;
+  auto time_point = std::chrono::steady_clock::time_point(
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(sim_time)));
+  sim_time_ = time_point;
+  Control::setSimulatedTime(time_point);
+
+  /* parse RX, control and build TX back to back, as one instant */
+  lockstep_comm_->read_device_loop(
+      [this](std::vector<uint8_t> c) { unpack_comm_response(c); });
+  run_control_tick(0);
+  write_motor_commands();
+
+  Control::setSimulatedTime(std::nullopt);
+}
+
+void Pro2ProtocolObject::inject_rx(std::vector<uint8_t> frame) {
+  if (lockstep_comm_) lockstep_comm_->inject(frame);
+}
+
+std::vector<std::vector<uint8_t>> Pro2ProtocolObject::take_tx() {
+  if (!lockstep_comm_) return {};
+  return lockstep_comm_->take_written();
+}
+
+std::chrono::milliseconds Pro2ProtocolObject::command_clock() {
+  if (lockstep_comm_) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        sim_time_.load().time_since_epoch());
+  }
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch());
+}
+
 void Pro2ProtocolObject::send_command(int sleeptime) {
   while (true) {
+    write_motor_commands();
+    std::this_thread::sleep_for(std::chrono::milliseconds(sleeptime));
+  }
+}
 
-    /* loop over the motors */
-    for (uint8_t vid = VESC_IDS::FRONT_LEFT; vid <= VESC_IDS::BACK_RIGHT;
-         vid++) {
-
-      robotstatus_mutex_.lock();
-      auto signedMotorCommand = motors_speeds_[vid];
+void Pro2ProtocolObject::write_motor_commands() {
+  /* loop over the motors */
+  for (uint8_t vid = VESC_IDS::FRONT_LEFT; vid <= VESC_IDS::BACK_RIGHT;
+       vid++) {
 
-      /* only use current control when robot is stopped to prevent wasted energy
-       */
-      bool useCurrentControl = motors_speeds_[vid] == MOTOR_NEUTRAL_ &&
-                               robotstatus_.linear_vel == MOTOR_NEUTRAL_ &&
-                               robotstatus_.angular_vel == MOTOR_NEUTRAL_;
+    robotstatus_mutex_.lock();
+    auto signedMotorCommand = motors_speeds_[vid];
 
-      robotstatus_mutex_.unlock();
+    /* only use current control when robot is stopped to prevent wasted energy
+     */
+    bool useCurrentControl = motors_speeds_[vid] == MOTOR_NEUTRAL_ &&
+                             robotstatus_.linear_vel == MOTOR_NEUTRAL_ &&
+                             robotstatus_.angular_vel == MOTOR_NEUTRAL_;
 
-      auto msg =  vescArray_.buildCommandMessage((vesc::vescChannelCommand){
-              .vescId = vid,
-              .commandType = (useCurrentControl ? vesc::vescPacketFlags::CURRENT
-                                                : vesc::vescPacketFlags::DUTY),
-              .commandValue = (useCurrentControl ? (float)MOTOR_NEUTRAL_ : signedMotorCommand)});
+    robotstatus_mutex_.unlock();
 
-      comm_base_->write_to_device(msg);
-    }
+    auto msg =  vescArray_.buildCommandMessage((vesc::vescChannelCommand){
+            .vescId = vid,
+            .commandType = (useCurrentControl ? vesc::vescPacketFlags::CURRENT
+                                              : vesc::vescPacketFlags::DUTY),
+            .commandValue = (useCurrentControl ? (float)MOTOR_NEUTRAL_ : signedMotorCommand)});
 
-    std::this_thread::sleep_for(std::chrono::milliseconds(sleeptime));
+    comm_base_->write_to_device(msg);
   }
 }
 
@@ -238,82 +492,204 @@ int Pro2ProtocolObject::cycle_robot_mode() {
       skid_control_->setAccelerationLimits(
           {LINEAR_JERK_LIMIT_, std::numeric_limits<float>::max()});
       break;
+    case Control::MODEL_PREDICTIVE:
+      /* the mpc limits acceleration and jerk itself */
+      skid_control_->setOperatingMode(Control::MODEL_PREDICTIVE);
+      skid_control_->setAccelerationLimits({std::numeric_limits<float>::max(),
+                                            std::numeric_limits<float>::max()});
+      break;
   }
   std::cout << "robot_mode: " << robotmode_num_ << std::endl;
   return robotmode_num_;
 }
 
+void Pro2ProtocolObject::set_measured_yaw_rate(double yaw_rate) {
+  /* measured at the latest simulated instant in lockstep mode */
+  if (lockstep_comm_) Control::setSimulatedTime(sim_time_.load());
+  skid_control_->setMeasuredYawRate(yaw_rate);
+  if (lockstep_comm_) Control::setSimulatedTime(std::nullopt);
+  if (!calibrator_) return;
+
+  /* mean wheelspeed of each side */
+  robotstatus_mutex_.lock();
+  float left_rpm = (robotstatus_.motor1_rpm + robotstatus_.motor3_rpm) / 2;
+  float right_rpm = (robotstatus_.motor2_rpm + robotstatus_.motor4_rpm) / 2;
+  robotstatus_mutex_.unlock();
+
+  if (calibrator_->addYawRateSample(left_rpm * RPM_TO_RADS_SEC,
+                                    right_rpm * RPM_TO_RADS_SEC,
+                                    yaw_rate)) {
+    publish_calibration();
+  }
+}
+
+void Pro2ProtocolObject::set_reference_displacement(double distance,
+                                                    double rotation) {
+  if (!calibrator_) return;
+
+  /* the first reference only sets the baseline */
+  robotstatus_mutex_.lock();
+  Control::wheel_counts<4> counts = tachometer_counts_;
+  bool tachometer_valid = tachometer_fresh();
+  auto last_counts = reference_counts_;
+  if (tachometer_valid) reference_counts_ = counts;
+  robotstatus_mutex_.unlock();
+  if (!tachometer_valid || !last_counts) return;
+
+  /* wheel rotation of each side since the previous reference */
+  Control::wheel_data<4> angles;
+  for (int wheel = 0; wheel < 4; wheel++) {
+    int32_t delta_counts =
+        static_cast<int32_t>(static_cast<uint32_t>(counts[wheel]) -
+                             static_cast<uint32_t>((*last_counts)[wheel]));
+    angles[wheel] = 2 * M_PI * delta_counts / TACH_COUNTS_PER_WHEEL_REV_;
+  }
+  float left_angle = Control::averageSide<4>(angles, Control::LEFT_WHEELS);
+  float right_angle = Control::averageSide<4>(angles, Control::RIGHT_WHEELS);
+
+  if (calibrator_->addDisplacementSample(left_angle, right_angle, distance,
+                                         rotation)) {
+    publish_calibration();
+  }
+}
+
+bool Pro2ProtocolObject::follow_path(std::vector<Control::path_point> path) {
+  robotstatus_mutex_.lock();
+  path_ts_ = command_clock();
+  path_follower_->setPath(std::move(path));
+  robotstatus_mutex_.unlock();
+  return true;
+}
+
+void Pro2ProtocolObject::set_robot_pose(double x, double y, double heading) {
+  robotstatus_mutex_.lock();
+  Control::odometry_data odometry = {.left_distance = 0,
+                                     .right_distance = 0,
+                                     .x = robotstatus_.odom_x,
+                                     .y = robotstatus_.odom_y,
+                                     .heading = robotstatus_.odom_heading};
+  path_ts_ = command_clock();
+  robotstatus_mutex_.unlock();
+  path_follower_->correctPose(
+      (Control::odometry_data){.left_distance = 0,
+                               .right_distance = 0,
+                               .x = x,
+                               .y = y,
+                               .heading = heading},
+      odometry);
+}
+
 void Pro2ProtocolObject::motors_control_loop(int sleeptime) {
+  while (true) {
+    /* the command waits on average half a write period before it is sent */
+    run_control_tick(sleeptime / 2000.0);
+    std::this_thread::sleep_for(std::chrono::milliseconds(sleeptime));
+  }
+}
+
+void Pro2ProtocolObject::run_control_tick(float command_delay) {
   float linear_vel_target, angular_vel_target, rpm_FL, rpm_FR, rpm_BL, rpm_BR;
-  std::chrono::milliseconds time_last =
-      std::chrono::duration_cast<std::chrono::milliseconds>(
-          std::chrono::system_clock::now().time_since_epoch());
   std::chrono::milliseconds time_from_msg;
+  std::chrono::milliseconds time_now = command_clock();
+  /* collect user commands and various status */
+  robotstatus_mutex_.lock();
+  linear_vel_target = robotstatus_.cmd_linear_vel;
+  angular_vel_target = robotstatus_.cmd_angular_vel;
+  rpm_FL = robotstatus_.motor1_rpm;
+  rpm_FR = robotstatus_.motor2_rpm;
+  rpm_BL = robotstatus_.motor3_rpm;
+  rpm_BR = robotstatus_.motor4_rpm;
+  time_from_msg = robotstatus_.cmd_ts;
+  auto feedback_age = Control::clockNow() - feedback_ts_;
+  auto tachometer_counts = tachometer_counts_;
+  bool tachometer_valid = tachometer_fresh();
+  auto pending_geometry = pending_geometry_;
+  pending_geometry_.reset();
+  /* a path needs a heartbeat too, or it stops being followed */
+  if ((time_now - path_ts_).count() > PATH_TIMEOUT_MS_ &&
+      path_follower_->isActive()) {
+    path_follower_->setPath({});
+  }
+  robotstatus_mutex_.unlock();
 
-  while (true) {
-    std::chrono::milliseconds time_now =
-        std::chrono::duration_cast<std::chrono::milliseconds>(
-            std::chrono::system_clock::now().time_since_epoch());
+  /* a new calibration is applied between two control ticks */
+  if (pending_geometry) apply_robot_geometry(pending_geometry.value());
 
-    /* collect user commands and various status */
+  /* tachometer odometry does not depend on the polling rate */
+  std::optional<Control::robot_velocities> path_velocities;
+  if (tachometer_valid) {
+    auto odometry = tach_odometry_->update(tachometer_counts);
     robotstatus_mutex_.lock();
-    linear_vel_target = robotstatus_.cmd_linear_vel;
-    angular_vel_target = robotstatus_.cmd_angular_vel;
-    rpm_FL = robotstatus_.motor1_rpm;
-    rpm_FR = robotstatus_.motor2_rpm;
-    rpm_BL = robotstatus_.motor3_rpm;
-    rpm_BR = robotstatus_.motor4_rpm;
-    time_from_msg = robotstatus_.cmd_ts;
+    robotstatus_.odom_left_distance = odometry.left_distance;
+    robotstatus_.odom_right_distance = odometry.right_distance;
+    robotstatus_.odom_x = odometry.x;
+    robotstatus_.odom_y = odometry.y;
+    robotstatus_.odom_heading = odometry.heading;
     robotstatus_mutex_.unlock();
 
-    /* compute motion targets if no estop and data is not stale */
-    if (!estop_ &&
-        (time_now - time_from_msg).count() <= CONTROL_LOOP_TIMEOUT_MS_) {
-      
-      /* compute motion targets (not using duty cycle input ATM) */
-      auto duty_cycles = skid_control_->runMotionControl(
-          (Control::robot_velocities){.linear_velocity = linear_vel_target,
-                                      .angular_velocity = angular_vel_target},
-          (Control::motor_data){.fl = 0, .fr = 0, .rl = 0, .rr = 0},
-          (Control::motor_data){
-              .fl = rpm_FL, .fr = rpm_FR, .rl = rpm_BL, .rr = rpm_BR});
-
-      
-      
-      /* compute velocities of robot from wheel rpms */
-      auto velocities =
-          skid_control_->getMeasuredVelocities((Control::motor_data){
-              .fl = rpm_FL, .fr = rpm_FR, .rl = rpm_BL, .rr = rpm_BR});
-
-      /* update the main data structure with both commands and status */
-      robotstatus_mutex_.lock();
-      motors_speeds_[FRONT_LEFT] = duty_cycles.fl;
-      motors_speeds_[FRONT_RIGHT] = duty_cycles.fr;
-      motors_speeds_[BACK_LEFT] = duty_cycles.rl;
-      motors_speeds_[BACK_RIGHT] = duty_cycles.rr;
-      robotstatus_.linear_vel = velocities.linear_velocity;
-      robotstatus_.angular_vel = velocities.angular_velocity;
-      robotstatus_mutex_.unlock();
-
-    } else {
-
-      /* COMMAND THE ROBOT TO STOP */
-      auto duty_cycles = skid_control_->runMotionControl(
-          {0, 0}, {0, 0, 0, 0}, {rpm_FL, rpm_FR, rpm_BL, rpm_BR});
-      auto velocities = skid_control_->getMeasuredVelocities(
-          {rpm_FL, rpm_FR, rpm_BL, rpm_BR});
-
-      /* update the main data structure with both commands and status */
-      robotstatus_mutex_.lock();
-      motors_speeds_[FRONT_LEFT] = MOTOR_NEUTRAL_;
-      motors_speeds_[FRONT_RIGHT] = MOTOR_NEUTRAL_;
-      motors_speeds_[BACK_LEFT] = MOTOR_NEUTRAL_;
-      motors_speeds_[BACK_RIGHT] = MOTOR_NEUTRAL_;
-      robotstatus_.linear_vel = velocities.linear_velocity;
-      robotstatus_.angular_vel = velocities.angular_velocity;
-      robotstatus_mutex_.unlock();
+    /* a path being followed replaces the velocity commands */
+    path_velocities = path_follower_->update(odometry);
+    if (path_velocities) {
+      linear_vel_target = path_velocities->linear_velocity;
+      angular_vel_target = path_velocities->angular_velocity;
     }
-    std::this_thread::sleep_for(std::chrono::milliseconds(sleeptime));
+  }
+
+  /* feedback is as old as the last frame, and the command still has to be
+   * sent */
+  skid_control_->setFeedbackDelay(
+      std::chrono::duration<float>(feedback_age).count() + command_delay);
+
+  /* compute motion targets if no estop and data is not stale */
+  if (!estop_ &&
+      (path_velocities ||
+       (time_now - time_from_msg).count() <= CONTROL_LOOP_TIMEOUT_MS_)) {
+    
+    /* compute motion targets (not using duty cycle input ATM) */
+    auto duty_cycles = skid_control_->runMotionControl(
+        (Control::robot_velocities){.linear_velocity = linear_vel_target,
+                                    .angular_velocity = angular_vel_target},
+        Control::wheel_data<4>{0, 0, 0, 0},
+        Control::wheel_data<4>{rpm_FL, rpm_FR, rpm_BL, rpm_BR});
+
+    
+    
+    /* keep the automatic trim once it settled */
+    if (auto trim = skid_control_->takeStableTrim()) {
+      save_auto_trim(trim.value());
+    }
+
+    /* compute velocities of robot from wheel rpms */
+    auto velocities = skid_control_->getMeasuredVelocities(
+        Control::wheel_data<4>{rpm_FL, rpm_FR, rpm_BL, rpm_BR});
+
+    /* update the main data structure with both commands and status */
+    robotstatus_mutex_.lock();
+    motors_speeds_[FRONT_LEFT] = duty_cycles[FRONT_LEFT];
+    motors_speeds_[FRONT_RIGHT] = duty_cycles[FRONT_RIGHT];
+    motors_speeds_[BACK_LEFT] = duty_cycles[BACK_LEFT];
+    motors_speeds_[BACK_RIGHT] = duty_cycles[BACK_RIGHT];
+    robotstatus_.linear_vel = velocities.linear_velocity;
+    robotstatus_.angular_vel = velocities.angular_velocity;
+    robotstatus_mutex_.unlock();
+
+  } else {
+
+    /* COMMAND THE ROBOT TO STOP */
+    auto duty_cycles = skid_control_->runMotionControl(
+        {0, 0}, {0, 0, 0, 0}, {rpm_FL, rpm_FR, rpm_BL, rpm_BR});
+    auto velocities = skid_control_->getMeasuredVelocities(
+        {rpm_FL, rpm_FR, rpm_BL, rpm_BR});
+
+    /* update the main data structure with both commands and status */
+    robotstatus_mutex_.lock();
+    motors_speeds_[FRONT_LEFT] = MOTOR_NEUTRAL_;
+    motors_speeds_[FRONT_RIGHT] = MOTOR_NEUTRAL_;
+    motors_speeds_[BACK_LEFT] = MOTOR_NEUTRAL_;
+    motors_speeds_[BACK_RIGHT] = MOTOR_NEUTRAL_;
+    robotstatus_.linear_vel = velocities.linear_velocity;
+    robotstatus_.angular_vel = velocities.angular_velocity;
+    robotstatus_mutex_.unlock();
   }
 }
 
@@ -1,7 +1,24 @@
 #include "protocol_zero_2.hpp"
+#include "tracepoints.hpp"
+
+#include <cstring>
 
 namespace RoverRobotics {
 
+/* size in bytes of each field of a values reply, in reply order */
+static const int VALUES_FIELD_SIZES[Zero2ProtocolObject::NUM_VALUES_FIELDS] = {
+    2, 2, 4, 4, 4, 4, 2, 4, 2, 4, 4, 4, 4, 4, 4, 1, 4, 1, 6, 4, 4};
+
+/* position of a field in a values reply with the given mask, -1 if absent */
+static int values_field_offset(uint32_t mask, int field) {
+  if (!(mask & (1 << field))) return -1;
+  int offset = 0;
+  for (int previous = 0; previous < field; previous++) {
+    if (mask & (1 << previous)) offset += VALUES_FIELD_SIZES[previous];
+  }
+  return offset;
+}
+
 Zero2ProtocolObject::Zero2ProtocolObject(
     const char *device, std::string new_comm_type,
     Control::robot_motion_mode_t robot_mode, Control::pid_gains pid,
@@ -19,22 +36,50 @@ Zero2ProtocolObject::Zero2ProtocolObject(
   robotstatus_ = {0};
   /* clear estop and zero out all motors */
   estop_ = false;
-  motors_speeds_[LEFT_MOTOR] = MOTOR_NEUTRAL_;
-  motors_speeds_[RIGHT_MOTOR] = MOTOR_NEUTRAL_;
+  motors_speeds_[LEFT_SIDE] = MOTOR_NEUTRAL_;
+  motors_speeds_[RIGHT_SIDE] = MOTOR_NEUTRAL_;
   /* register the pid gains for closed-loop modes */
   pid_ = pid;
 
   /* make and initialize the motion logic object */
-  skid_control_ = std::make_unique<Control::SkidRobotMotionController>(
+  skid_control_ = std::make_unique<Control::SkidRobotMotionController<2>>(
       Control::OPEN_LOOP, robot_geometry_, pid_, MOTOR_MAX_, MOTOR_MIN_,
       left_trim_, right_trim_, geometric_decay_);
 
+  /* odometry from the motor controller tachometers */
+  tach_odometry_ = std::make_unique<Control::TachometerOdometry<2>>(
+      2 * M_PI * robot_geometry_.wheel_radius / TACH_COUNTS_PER_WHEEL_REV_,
+      robot_geometry_);
+  tach_odometry_->setSkidSteerParams(SKID_STEER_PARAMS_);
+  path_follower_ = std::make_unique<Control::PathFollower>(PURE_PURSUIT_PARAMS_);
+
   /* MUST be done after skid control is constructed */
   load_persistent_params();
 
+  /* calibrate around the (persisted) geometry */
+  if (USE_KINEMATIC_CALIBRATION_) {
+    calibrator_ = std::make_unique<Control::KinematicCalibrator>(
+        robot_geometry_, SKID_STEER_PARAMS_);
+  }
+
   /* set some default params */
   skid_control_->setOpenLoopMaxRpm(OPEN_LOOP_MAX_RPM_);
   skid_control_->setAngularScaling(angular_scaling_params_);
+  skid_control_->setSkidSteerParams(SKID_STEER_PARAMS_);
+  /* overrides the loaded trim disabling it, only when opted in */
+  if (USE_AUTO_TRIM_) {
+    skid_control_->setAutoTrim(true, MAX_CURVATURE_CORRECTION_);
+  }
+  skid_control_->setPlantModel(plant_model_);
+  skid_control_->setDeadbandCompensation(deadband_compensation_);
+  skid_control_->setVoltageCompensation(USE_VOLTAGE_COMPENSATION_,
+                                        nominal_battery_voltage_);
+  skid_control_->setLatencyCompensation(USE_LATENCY_COMPENSATION_);
+  feedback_ts_ = std::chrono::steady_clock::now();
+
+  /* make an object to decode and encode motor controller messages*/
+  vescArray_ =
+      vesc::BridgedVescArray(std::vector<uint8_t>{LEFT_MOTOR, RIGHT_MOTOR});
 
   /* set mode specific limits */
   if (robot_mode_ != Control::OPEN_LOOP) {
@@ -55,8 +100,9 @@ Zero2ProtocolObject::Zero2ProtocolObject(
   std::cerr << "establishing connection to rover zero..." << std::endl;
   try{
   register_comm_base(device);
+  probe_firmware();
   }
-  catch{
+  catch(int i){
       std::cerr << "error establishing connection to Rover Zero, please check cabling and power to the motor controller (VESC)" << std::endl;
   }
     
@@ -81,9 +127,66 @@ void Zero2ProtocolObject::load_persistent_params() {
     std::cout << "Loaded trim from persistent param file: " << param.value()
               << std::endl;
   }
+
+  /* calibrated geometry */
+  Control::robot_geometry robot_geometry = robot_geometry_;
+  if (auto param = persistent_params_->read_param("wheel_radius")) {
+    robot_geometry.wheel_radius = param.value();
+  }
+  if (auto param = persistent_params_->read_param("wheel_base")) {
+    robot_geometry.wheel_base = param.value();
+  }
+  apply_robot_geometry(robot_geometry);
+
+  /* drive model identified by the sysid tool */
+  if (auto param = persistent_params_->read_param("plant_gain")) {
+    plant_model_.gain = param.value();
+  }
+  if (auto param = persistent_params_->read_param("plant_time_constant")) {
+    plant_model_.time_constant = param.value();
+  }
+  if (auto param = persistent_params_->read_param("plant_dead_time")) {
+    plant_model_.dead_time = param.value();
+  }
+  if (auto param = persistent_params_->read_param("plant_voltage")) {
+    nominal_battery_voltage_ = param.value();
+  }
+
+  /* static friction of each wheel */
+  if (auto param = persistent_params_->read_param("breakaway_duty_left")) {
+    deadband_compensation_.breakaway_duty[LEFT_SIDE] = param.value();
+  }
+  if (auto param = persistent_params_->read_param("breakaway_duty_right")) {
+    deadband_compensation_.breakaway_duty[RIGHT_SIDE] = param.value();
+  }
+}
+
+void Zero2ProtocolObject::apply_robot_geometry(
+    Control::robot_geometry robot_geometry) {
+  robot_geometry_ = robot_geometry;
+  skid_control_->setRobotGeometry(robot_geometry_);
+  tach_odometry_->setRobotGeometry(robot_geometry_);
+  tach_odometry_->setMetersPerCount(2 * M_PI * robot_geometry_.wheel_radius /
+                                    TACH_COUNTS_PER_WHEEL_REV_);
+}
+
+void Zero2ProtocolObject::publish_calibration() {
+  auto robot_geometry = calibrator_->getGeometry();
+  std::cout << "writing calibrated wheel radius " << robot_geometry.wheel_radius
+            << " and wheel base " << robot_geometry.wheel_base << " to file"
+            << std::endl;
+  persistent_params_->write_param("wheel_radius", robot_geometry.wheel_radius);
+  persistent_params_->write_param("wheel_base", robot_geometry.wheel_base);
+
+  robotstatus_mutex_.lock();
+  pending_geometry_ = robot_geometry;
+  robotstatus_mutex_.unlock();
 }
 
 void Zero2ProtocolObject::update_drivetrim(double delta) {
+  /* the operator takes over from the automatic trim */
+  skid_control_->setAutoTrim(false, MAX_CURVATURE_CORRECTION_);
+
   if (-MAX_CURVATURE_CORRECTION_ < (trimvalue_ + delta) &&
       (trimvalue_ + delta) < MAX_CURVATURE_CORRECTION_) {
     trimvalue_ += delta;
@@ -104,15 +207,85 @@ void Zero2ProtocolObject::update_drivetrim(double delta) {
   }
 }
 
+bool Zero2ProtocolObject::tachometer_fresh() {
+  if (tachometer_received_ != 0x03) return false;
+  auto time_now = std::chrono::steady_clock::now();
+  for (auto &tachometer_ts : tachometer_ts_) {
+    if (std::chrono::duration<float>(time_now - tachometer_ts).count() >
+        TACHOMETER_TIMEOUT_) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Zero2ProtocolObject::save_auto_trim(double trim) {
+  /* the controller already applies it, only the record needs updating */
+  bool changed = std::abs(trim - trimvalue_) > AUTO_TRIM_SAVE_TOLERANCE_;
+  trimvalue_ = trim;
+  if (trimvalue_ >= 0) {
+    left_trim_ = 1;
+    right_trim_ = 1 - trimvalue_;
+  } else {
+    right_trim_ = 1;
+    left_trim_ = 1 + trimvalue_;
+  }
+  if (changed) {
+    std::cout << "writing automatic trim " << trimvalue_ << " to file "
+              << std::endl;
+    persistent_params_->write_param("trim", trimvalue_);
+  }
+}
+
 void Zero2ProtocolObject::send_estop(bool estop) {
   robotstatus_mutex_.lock();
   estop_ = estop;
   robotstatus_mutex_.unlock();
 }
 
-robotData Zero2ProtocolObject::status_request() { return robotstatus_; }
+robotData Zero2ProtocolObject::status_request() {
+  robotstatus_mutex_.lock();
+  refresh_values();
+  auto returnData = robotstatus_;
+  robotstatus_mutex_.unlock();
+  return returnData;
+}
 
-robotData Zero2ProtocolObject::info_request() { return robotstatus_; }
+robotData Zero2ProtocolObject::info_request() { return status_request(); }
+
+std::vector<std::pair<std::string, double>>
+Zero2ProtocolObject::metrics_request() {
+  robotstatus_mutex_.lock();
+  std::vector<std::pair<std::string, double>> metrics = {
+      {"telemetry_mode", telemetry_mode_}};
+  const std::string sides[2] = {"left", "right"};
+  for (int side = LEFT_SIDE; side <= RIGHT_SIDE; side++) {
+    metrics.push_back({sides[side] + "_fw_valid", firmware_[side].valid});
+    metrics.push_back({sides[side] + "_fw_major", firmware_[side].major});
+    metrics.push_back({sides[side] + "_fw_minor", firmware_[side].minor});
+    metrics.push_back({sides[side] + "_selective_values",
+                       capabilities_[side].selectiveValues});
+    metrics.push_back({sides[side] + "_status_broadcasts",
+                       capabilities_[side].statusBroadcasts});
+    /* duty sent to the VESC, after trim and compensation */
+    metrics.push_back({sides[side] + "_duty", motors_speeds_[side]});
+    if (values_frames_[side].valid) {
+      metrics.push_back(
+          {sides[side] + "_values_age",
+           std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         values_frames_[side].received_ts)
+               .count()});
+    }
+  }
+  robotstatus_mutex_.unlock();
+  if (comm_base_) {
+    auto comm_metrics = comm_base_->metrics();
+    metrics.insert(metrics.end(), comm_metrics.begin(), comm_metrics.end());
+  }
+  auto lock_metrics = Utilities::ProfiledMutex::metrics();
+  metrics.insert(metrics.end(), lock_metrics.begin(), lock_metrics.end());
+  return metrics;
+}
 
 void Zero2ProtocolObject::set_robot_velocity(double *controlarray) {
   robotstatus_mutex_.lock();
@@ -120,11 +293,90 @@ void Zero2ProtocolObject::set_robot_velocity(double *controlarray) {
   robotstatus_.cmd_angular_vel = controlarray[1];
   robotstatus_.cmd_ts = std::chrono::duration_cast<std::chrono::milliseconds>(
       std::chrono::system_clock::now().time_since_epoch());
+  /* a velocity command takes over from a path, a zero one stops it */
+  path_follower_->setPath({});
+  robotstatus_mutex_.unlock();
+}
+
+void Zero2ProtocolObject::set_measured_yaw_rate(double yaw_rate) {
+  skid_control_->setMeasuredYawRate(yaw_rate);
+  if (!calibrator_) return;
+
+  /* mean wheelspeed of each side */
+  robotstatus_mutex_.lock();
+  refresh_values();
+  float left_rpm = robotstatus_.motor1_rpm / MOTOR_RPM_TO_WHEEL_RPM_RATIO_;
+  float right_rpm = robotstatus_.motor2_rpm / MOTOR_RPM_TO_WHEEL_RPM_RATIO_;
+  robotstatus_mutex_.unlock();
+
+  if (calibrator_->addYawRateSample(left_rpm * RPM_TO_RADS_SEC,
+                                    right_rpm * RPM_TO_RADS_SEC,
+                                    yaw_rate)) {
+    publish_calibration();
+  }
+}
+
+void Zero2ProtocolObject::set_reference_displacement(double distance,
+                                                    double rotation) {
+  if (!calibrator_) return;
+
+  /* the first reference only sets the baseline */
+  robotstatus_mutex_.lock();
+  refresh_values();
+  Control::wheel_counts<2> counts = {left_tachometer_, right_tachometer_};
+  bool tachometer_valid = tachometer_fresh();
+  auto last_counts = reference_counts_;
+  if (tachometer_valid) reference_counts_ = counts;
+  robotstatus_mutex_.unlock();
+  if (!tachometer_valid || !last_counts) return;
+
+  /* wheel rotation of each side since the previous reference */
+  auto to_angle = [this](int32_t counts_now, int32_t counts_last) {
+    int32_t delta_counts = static_cast<int32_t>(
+        static_cast<uint32_t>(counts_now) - static_cast<uint32_t>(counts_last));
+    return 2 * M_PI * delta_counts / TACH_COUNTS_PER_WHEEL_REV_;
+  };
+  float left_angle =
+      to_angle(counts[LEFT_SIDE], (*last_counts)[LEFT_SIDE]);
+  float right_angle =
+      to_angle(counts[RIGHT_SIDE], (*last_counts)[RIGHT_SIDE]);
+
+  if (calibrator_->addDisplacementSample(left_angle, right_angle, distance,
+                                         rotation)) {
+    publish_calibration();
+  }
+}
+
+bool Zero2ProtocolObject::follow_path(std::vector<Control::path_point> path) {
+  robotstatus_mutex_.lock();
+  path_ts_ = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch());
+  path_follower_->setPath(std::move(path));
   robotstatus_mutex_.unlock();
+  return true;
+}
+
+void Zero2ProtocolObject::set_robot_pose(double x, double y, double heading) {
+  robotstatus_mutex_.lock();
+  Control::odometry_data odometry = {.left_distance = 0,
+                                     .right_distance = 0,
+                                     .x = robotstatus_.odom_x,
+                                     .y = robotstatus_.odom_y,
+                                     .heading = robotstatus_.odom_heading};
+  path_ts_ = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch());
+  robotstatus_mutex_.unlock();
+  path_follower_->correctPose(
+      (Control::odometry_data){.left_distance = 0,
+                               .right_distance = 0,
+                               .x = x,
+                               .y = y,
+                               .heading = heading},
+      odometry);
 }
 
 void Zero2ProtocolObject::motors_control_loop(int sleeptime) {
-  float linear_vel_target, angular_vel_target, rpm_FL, rpm_FR, rpm_BL, rpm_BR;
+  float linear_vel_target, angular_vel_target, rpm_left, rpm_right;
   std::chrono::milliseconds time_last =
       std::chrono::duration_cast<std::chrono::milliseconds>(
           std::chrono::system_clock::now().time_since_epoch());
@@ -137,37 +389,79 @@ void Zero2ProtocolObject::motors_control_loop(int sleeptime) {
 
     /* collect user commands and various status */
     robotstatus_mutex_.lock();
+    refresh_values();
     linear_vel_target = robotstatus_.cmd_linear_vel;
     angular_vel_target = robotstatus_.cmd_angular_vel;
     /* Convert from motors to wheels RPM based on the robot geometry and gear
      * ratio */
-    rpm_FL = robotstatus_.motor1_rpm / MOTOR_RPM_TO_WHEEL_RPM_RATIO_;
-    rpm_FR = robotstatus_.motor2_rpm / MOTOR_RPM_TO_WHEEL_RPM_RATIO_;
-    rpm_BL = robotstatus_.motor1_rpm / MOTOR_RPM_TO_WHEEL_RPM_RATIO_;
-    rpm_BR = robotstatus_.motor2_rpm / MOTOR_RPM_TO_WHEEL_RPM_RATIO_;
+    rpm_left = robotstatus_.motor1_rpm / MOTOR_RPM_TO_WHEEL_RPM_RATIO_;
+    rpm_right = robotstatus_.motor2_rpm / MOTOR_RPM_TO_WHEEL_RPM_RATIO_;
     time_from_msg = robotstatus_.cmd_ts;
+    auto feedback_age = std::chrono::steady_clock::now() - feedback_ts_;
+    Control::wheel_counts<2> tachometer_counts = {left_tachometer_,
+                                                  right_tachometer_};
+    bool tachometer_valid = tachometer_fresh();
+    auto pending_geometry = pending_geometry_;
+    pending_geometry_.reset();
+    /* a path needs a heartbeat too, or it stops being followed */
+    if ((time_now - path_ts_).count() > PATH_TIMEOUT_MS_ &&
+        path_follower_->isActive()) {
+      path_follower_->setPath({});
+    }
     robotstatus_mutex_.unlock();
 
+    /* a new calibration is applied between two control ticks */
+    if (pending_geometry) apply_robot_geometry(pending_geometry.value());
+
+    /* tachometer odometry does not depend on the polling rate */
+    std::optional<Control::robot_velocities> path_velocities;
+    if (tachometer_valid) {
+      auto odometry = tach_odometry_->update(tachometer_counts);
+      robotstatus_mutex_.lock();
+      robotstatus_.odom_left_distance = odometry.left_distance;
+      robotstatus_.odom_right_distance = odometry.right_distance;
+      robotstatus_.odom_x = odometry.x;
+      robotstatus_.odom_y = odometry.y;
+      robotstatus_.odom_heading = odometry.heading;
+      robotstatus_mutex_.unlock();
+
+      /* a path being followed replaces the velocity commands */
+      path_velocities = path_follower_->update(odometry);
+      if (path_velocities) {
+        linear_vel_target = path_velocities->linear_velocity;
+        angular_vel_target = path_velocities->angular_velocity;
+      }
+    }
+
+    /* commands are sent right after this tick, so the delay is the age of the
+     * feedback */
+    skid_control_->setFeedbackDelay(
+        std::chrono::duration<float>(feedback_age).count());
+
     /* compute motion targets if no estop and data is not stale */
     if (!estop_ &&
-        (time_now - time_from_msg).count() <= CONTROL_LOOP_TIMEOUT_MS_) {
+        (path_velocities ||
+         (time_now - time_from_msg).count() <= CONTROL_LOOP_TIMEOUT_MS_)) {
       /* compute motion targets (not using duty cycle input ATM) */
       auto duty_cycles = skid_control_->runMotionControl(
           (Control::robot_velocities){.linear_velocity = linear_vel_target,
                                       .angular_velocity = angular_vel_target},
-          (Control::motor_data){.fl = 0, .fr = 0, .rl = 0, .rr = 0},
-          (Control::motor_data){
-              .fl = rpm_FL, .fr = rpm_FR, .rl = rpm_BL, .rr = rpm_BR});
+          Control::wheel_data<2>{0, 0},
+          Control::wheel_data<2>{rpm_left, rpm_right});
+
+      /* keep the automatic trim once it settled */
+      if (auto trim = skid_control_->takeStableTrim()) {
+        save_auto_trim(trim.value());
+      }
 
       /* compute velocities of robot from wheel rpms */
-      auto velocities =
-          skid_control_->getMeasuredVelocities((Control::motor_data){
-              .fl = rpm_FL, .fr = rpm_FR, .rl = rpm_BL, .rr = rpm_BR});
+      auto velocities = skid_control_->getMeasuredVelocities(
+          Control::wheel_data<2>{rpm_left, rpm_right});
 
       /* update the main data structure with both commands and status */
       robotstatus_mutex_.lock();
-      motors_speeds_[LEFT_MOTOR] = duty_cycles.fl;
-      motors_speeds_[RIGHT_MOTOR] = duty_cycles.fr;
+      motors_speeds_[LEFT_SIDE] = duty_cycles[LEFT_SIDE];
+      motors_speeds_[RIGHT_SIDE] = duty_cycles[RIGHT_SIDE];
       robotstatus_.linear_vel = velocities.linear_velocity;
       robotstatus_.angular_vel = velocities.angular_velocity;
       robotstatus_mutex_.unlock();
@@ -175,14 +469,14 @@ void Zero2ProtocolObject::motors_control_loop(int sleeptime) {
     } else {
       /* COMMAND THE ROBOT TO STOP */
       auto duty_cycles = skid_control_->runMotionControl(
-          {0, 0}, {0, 0, 0, 0}, {rpm_FL, rpm_FR, rpm_BL, rpm_BR});
-      auto velocities = skid_control_->getMeasuredVelocities(
-          {rpm_FL, rpm_FR, rpm_BL, rpm_BR});
+          {0, 0}, {0, 0}, {rpm_left, rpm_right});
+      auto velocities =
+          skid_control_->getMeasuredVelocities({rpm_left, rpm_right});
 
       /* update the main data structure with both commands and status */
       robotstatus_mutex_.lock();
-      motors_speeds_[LEFT_MOTOR] = MOTOR_NEUTRAL_;
-      motors_speeds_[RIGHT_MOTOR] = MOTOR_NEUTRAL_;
+      motors_speeds_[LEFT_SIDE] = MOTOR_NEUTRAL_;
+      motors_speeds_[RIGHT_SIDE] = MOTOR_NEUTRAL_;
       robotstatus_.linear_vel = velocities.linear_velocity;
       robotstatus_.angular_vel = velocities.angular_velocity;
       robotstatus_mutex_.unlock();
@@ -192,6 +486,11 @@ void Zero2ProtocolObject::motors_control_loop(int sleeptime) {
   }
 }
 void Zero2ProtocolObject::unpack_comm_response(std::vector<uint8_t> robotmsg) {
+  if (comm_type_ == "can") {
+    unpack_can_response(robotmsg);
+    return;
+  }
+
   static std::vector<uint8_t> msgqueue;
   robotstatus_mutex_.lock();
   msgqueue.insert(msgqueue.end(), robotmsg.begin(),
@@ -199,166 +498,57 @@ void Zero2ProtocolObject::unpack_comm_response(std::vector<uint8_t> robotmsg) {
 
   // valid msg check
   int msg_size = msgqueue[1] + 4;
-  if (msgqueue.size() >= msg_size && msgqueue[0] == START_BYTE_ &&
+  if (msgqueue.size() > msg_size && msgqueue[0] == START_BYTE_ &&
       msgqueue[msg_size] == STOP_BYTE_) {
-    int payload_index = 3;
-    int16_t v16;
-    int32_t v32;
-    v16 = static_cast<int16_t>(
-        (static_cast<uint16_t>(msgqueue[payload_index]) << 8) +
-        static_cast<uint16_t>(msgqueue[++payload_index]));
-    vesc_fet_temp_ = static_cast<double>(v16) / 10.0;
-    v16 = static_cast<int16_t>(
-        (static_cast<uint16_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint16_t>(msgqueue[++payload_index]));
-    vesc_motor_temp_ = static_cast<double>(v16) / 10.0;
-    v32 = static_cast<int32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_all_motor_current_ = static_cast<float>(v32) / 100.0;
-    v32 = static_cast<int32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_all_input_current_ = static_cast<float>(v32) / 100.0;
-    v32 = static_cast<int32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_id_ = static_cast<float>(v32) / 100.0;
-    v32 = static_cast<int32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_iq_ = static_cast<float>(v32) / 100.0;
-    v16 = static_cast<int16_t>(
-        (static_cast<uint16_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint16_t>(msgqueue[++payload_index]));
-    vesc_duty_ = static_cast<double>(v16) / 1000.0;
-    v32 = static_cast<int32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_rpm_ = static_cast<int32_t>(v32);
-    v16 = static_cast<int16_t>(
-        (static_cast<uint16_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint16_t>(msgqueue[++payload_index]));
-    vesc_v_in_ = static_cast<double>(v16) / 10.0;
-    v32 = static_cast<uint32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_amp_hours_ = static_cast<double>(v32) / 10000.0;
-    v32 = static_cast<uint32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_amp_hours_charged_ = static_cast<double>(v32) / 10000.0;
-    v32 = static_cast<uint32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_watt_hours_ = static_cast<double>(v32) / 10000.0;
-    v32 = static_cast<uint32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_watt_hours_charged_ = static_cast<double>(v32) / 10000.0;
-    v32 = static_cast<uint32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_tach_ = static_cast<double>(v32);
-    v32 = static_cast<uint32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_tach_abs_ = static_cast<double>(v32);
-    vesc_fault_ = static_cast<uint8_t>(msgqueue[++payload_index]);
-    v32 = static_cast<uint32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    vesc_pid_pos_ = static_cast<double>(v32) / 1000000.0;
-    vesc_dev_id_ = static_cast<uint8_t>(msgqueue[++payload_index]);
-    v16 = static_cast<int16_t>(
-        (static_cast<uint16_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint16_t>(msgqueue[++payload_index]));
-    double temp1 = static_cast<double>(v16) / 10.0;
-    v16 = static_cast<int16_t>(
-        (static_cast<uint16_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint16_t>(msgqueue[++payload_index]));
-    double temp2 = static_cast<double>(v16) / 10.0;
-    v16 = static_cast<int16_t>(
-        (static_cast<uint16_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint16_t>(msgqueue[++payload_index]));
-    double temp3 = static_cast<double>(v16) / 10.0;
-    v32 = static_cast<uint32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    double reset_avg_vd = static_cast<double>(v32);
-    v32 = static_cast<uint32_t>(
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 24) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 16) +
-        (static_cast<uint32_t>(msgqueue[++payload_index]) << 8) +
-        static_cast<uint32_t>(msgqueue[++payload_index]));
-    double reset_avg_vq = static_cast<double>(v32);
-    std::cerr << std::flush;
-    msgqueue.clear();
-    // msgqueue.resize(0);
-    if (vesc_dev_id_ == LEFT_MOTOR) {
-      robotstatus_.motor1_id = vesc_dev_id_;
-      robotstatus_.motor1_current = vesc_all_input_current_;
-      robotstatus_.motor1_rpm = vesc_rpm_;
-      robotstatus_.motor1_temp = vesc_motor_temp_;
-      robotstatus_.motor1_mos_temp = vesc_fet_temp_;
-    } else if (vesc_dev_id_ == RIGHT_MOTOR) {
-      robotstatus_.motor2_id = vesc_dev_id_;
-      robotstatus_.motor2_current = vesc_all_input_current_;
-      robotstatus_.motor2_rpm = vesc_rpm_;
-      robotstatus_.motor2_temp = vesc_motor_temp_;
-      robotstatus_.motor2_mos_temp = vesc_fet_temp_;
+    int payload_index = 2;
+    int payload_end = msg_size - 2;
+    uint8_t command = msgqueue[payload_index++];
+    LIBROVER_TRACE(parse_complete, 0, command);
+    if (command == COMM_FW_VERSION) {
+      /* major, minor and the null terminated hardware name */
+      vesc::vescFirmware &firmware = firmware_[probe_side_];
+      firmware.major = msgqueue[payload_index++];
+      firmware.minor = msgqueue[payload_index++];
+      firmware.hardware.clear();
+      while (payload_index < payload_end && msgqueue[payload_index] != 0) {
+        firmware.hardware.push_back(msgqueue[payload_index++]);
+      }
+      firmware.valid = true;
+      msgqueue.clear();
+      robotstatus_mutex_.unlock();
+      return;
+    }
+    uint32_t mask = 0;
+    if (command == COMM_GET_VALUES_SELECTIVE) {
+      mask = (static_cast<uint32_t>(msgqueue[payload_index]) << 24) +
+             (static_cast<uint32_t>(msgqueue[payload_index + 1]) << 16) +
+             (static_cast<uint32_t>(msgqueue[payload_index + 2]) << 8) +
+             static_cast<uint32_t>(msgqueue[payload_index + 3]);
+      payload_index += 4;
+    } else if (command == COMM_GET_VALUES) {
+      mask = (1 << NUM_VALUES_FIELDS) - 1;
+    }
+
+    /* only the controller id is read now, the rest when it is needed */
+    int id_offset = values_field_offset(mask, VALUES_CONTROLLER_ID);
+    if (id_offset >= 0 && payload_index + id_offset < payload_end) {
+      uint8_t vesc_id = msgqueue[payload_index + id_offset];
+      int side = vesc_id == LEFT_MOTOR    ? LEFT_SIDE
+                 : vesc_id == RIGHT_MOTOR ? RIGHT_SIDE
+                                          : -1;
+      if (side >= 0) {
+        values_frame &frame = values_frames_[side];
+        frame.length = std::min<int>(payload_end - payload_index,
+                                     sizeof(frame.fields));
+        std::memcpy(frame.fields, &msgqueue[payload_index], frame.length);
+        frame.mask = mask;
+        frame.received_ts = std::chrono::steady_clock::now();
+        frame.valid = true;
+        frame.decoded = false;
+        feedback_ts_ = frame.received_ts;
+      }
     }
-    robotstatus_.battery1_voltage = vesc_v_in_;
-    robotstatus_.battery1_fault_flag = 0;
-    robotstatus_.battery2_voltage = 0;
-    robotstatus_.battery1_temp = 0;
-    robotstatus_.battery2_temp = 0;
-    robotstatus_.battery1_current = vesc_all_input_current_;
-    robotstatus_.battery2_current = 0;
-    robotstatus_.battery1_SOC = 0;
-    robotstatus_.battery2_SOC = 0;
-    robotstatus_.battery1_fault_flag = 0;
-    robotstatus_.battery2_fault_flag = 0;
-    robotstatus_.motor3_rpm = 0;
-    robotstatus_.motor3_current = 0;
-    robotstatus_.motor3_temp = 0;
-    robotstatus_.motor3_mos_temp = 0;
-    robotstatus_.motor4_id = 0;
-    robotstatus_.motor4_rpm = 0;
-    robotstatus_.motor4_current = 0;
-    robotstatus_.motor4_temp = 0;
-    robotstatus_.motor4_mos_temp = 0;
-    robotstatus_.robot_guid = 0;
-    robotstatus_.robot_firmware = 0;
-    robotstatus_.robot_fault_flag = vesc_fault_;
-    robotstatus_.robot_fan_speed = 0;
-    robotstatus_.robot_speed_limit = 0;
+    msgqueue.clear();
   } else if (msgqueue.size() > msg_size && msgqueue[0] != START_BYTE_) {
     int start_byte_index = 0;
     // !Did not find valid start byte in buffer
@@ -367,6 +557,7 @@ void Zero2ProtocolObject::unpack_comm_response(std::vector<uint8_t> robotmsg) {
       start_byte_index++;
     if (start_byte_index >= msgqueue.size()) {
       msgqueue.clear();
+      robotstatus_mutex_.unlock();
       return;
     } else {
       // !Reconstruct the vector so that the start byte is at the 0 position
@@ -383,6 +574,171 @@ void Zero2ProtocolObject::unpack_comm_response(std::vector<uint8_t> robotmsg) {
   robotstatus_mutex_.unlock();
 }
 
+void Zero2ProtocolObject::unpack_can_response(std::vector<uint8_t> robotmsg) {
+  auto parsedMsg = vescArray_.parseReceivedMessage(robotmsg);
+  if (!parsedMsg.dataValid) return;
+  LIBROVER_TRACE(parse_complete, parsedMsg.vescId, parsedMsg.packetType);
+
+  robotstatus_mutex_.lock();
+  /* any status frame shows the controller broadcasts */
+  if (parsedMsg.vescId == LEFT_MOTOR) {
+    capabilities_[LEFT_SIDE].statusBroadcasts = true;
+  } else if (parsedMsg.vescId == RIGHT_MOTOR) {
+    capabilities_[RIGHT_SIDE].statusBroadcasts = true;
+  }
+  if (parsedMsg.packetType == vesc::vescPacketFlags::STATUS_5) {
+    if (parsedMsg.vescId == LEFT_MOTOR) {
+      left_tachometer_ = parsedMsg.tachometer;
+      tachometer_received_ |= 0x01;
+      tachometer_ts_[LEFT_SIDE] = std::chrono::steady_clock::now();
+    } else if (parsedMsg.vescId == RIGHT_MOTOR) {
+      right_tachometer_ = parsedMsg.tachometer;
+      tachometer_received_ |= 0x02;
+      tachometer_ts_[RIGHT_SIDE] = std::chrono::steady_clock::now();
+    }
+    robotstatus_.battery1_voltage = parsedMsg.voltage;
+    robotstatus_mutex_.unlock();
+    skid_control_->setBusVoltage(parsedMsg.voltage);
+    return;
+  }
+
+  /* the status broadcast carries the raw erpm, as COMM_GET_VALUES does */
+  float erpm = parsedMsg.rpm / vesc::RPM_SCALING_FACTOR;
+  if (parsedMsg.vescId == LEFT_MOTOR) {
+    feedback_ts_ = std::chrono::steady_clock::now();
+    robotstatus_.motor1_id = parsedMsg.vescId;
+    robotstatus_.motor1_current = parsedMsg.current;
+    robotstatus_.motor1_rpm = erpm;
+  } else if (parsedMsg.vescId == RIGHT_MOTOR) {
+    feedback_ts_ = std::chrono::steady_clock::now();
+    robotstatus_.motor2_id = parsedMsg.vescId;
+    robotstatus_.motor2_current = parsedMsg.current;
+    robotstatus_.motor2_rpm = erpm;
+  }
+  robotstatus_mutex_.unlock();
+}
+
+void Zero2ProtocolObject::decode_values(const uint8_t *fields, int length,
+                                        uint32_t mask, vesc_values &values) {
+  int index = 0;
+  auto read16 = [fields, &index]() {
+    int16_t v16 = static_cast<int16_t>(
+        (static_cast<uint16_t>(fields[index]) << 8) +
+        static_cast<uint16_t>(fields[index + 1]));
+    index += 2;
+    return v16;
+  };
+  auto read32 = [fields, &index]() {
+    int32_t v32 = static_cast<int32_t>(
+        (static_cast<uint32_t>(fields[index]) << 24) +
+        (static_cast<uint32_t>(fields[index + 1]) << 16) +
+        (static_cast<uint32_t>(fields[index + 2]) << 8) +
+        static_cast<uint32_t>(fields[index + 3]));
+    index += 4;
+    return v32;
+  };
+
+  for (int field = 0; field < NUM_VALUES_FIELDS; field++) {
+    if (!(mask & (1 << field))) continue;
+    /* a truncated reply keeps the previous values of the missing fields */
+    if (index + VALUES_FIELD_SIZES[field] > length) return;
+    switch (field) {
+      case VALUES_TEMP_FET:
+        values.fet_temp = static_cast<double>(read16()) / 10.0;
+        break;
+      case VALUES_TEMP_MOTOR:
+        values.motor_temp = static_cast<double>(read16()) / 10.0;
+        break;
+      case VALUES_MOTOR_CURRENT:
+        values.motor_current = static_cast<float>(read32()) / 100.0;
+        break;
+      case VALUES_INPUT_CURRENT:
+        values.input_current = static_cast<float>(read32()) / 100.0;
+        break;
+      case VALUES_ID:
+        values.id = static_cast<float>(read32()) / 100.0;
+        break;
+      case VALUES_IQ:
+        values.iq = static_cast<float>(read32()) / 100.0;
+        break;
+      case VALUES_DUTY:
+        values.duty = static_cast<double>(read16()) / 1000.0;
+        break;
+      case VALUES_RPM:
+        values.rpm = read32();
+        break;
+      case VALUES_V_IN:
+        values.v_in = static_cast<double>(read16()) / 10.0;
+        break;
+      case VALUES_AMP_HOURS:
+        values.amp_hours = static_cast<double>(read32()) / 10000.0;
+        break;
+      case VALUES_AMP_HOURS_CHARGED:
+        values.amp_hours_charged = static_cast<double>(read32()) / 10000.0;
+        break;
+      case VALUES_WATT_HOURS:
+        values.watt_hours = static_cast<double>(read32()) / 10000.0;
+        break;
+      case VALUES_WATT_HOURS_CHARGED:
+        values.watt_hours_charged = static_cast<double>(read32()) / 10000.0;
+        break;
+      case VALUES_TACHOMETER:
+        values.tach = read32();
+        break;
+      case VALUES_TACHOMETER_ABS:
+        values.tach_abs = read32();
+        break;
+      case VALUES_FAULT:
+        values.fault = fields[index++];
+        break;
+      case VALUES_PID_POS:
+        values.pid_pos = static_cast<double>(read32()) / 1000000.0;
+        break;
+      case VALUES_CONTROLLER_ID:
+        values.dev_id = fields[index++];
+        break;
+      default:
+        /* mosfet temperatures and the d/q voltages are not used */
+        index += VALUES_FIELD_SIZES[field];
+        break;
+    }
+  }
+}
+
+void Zero2ProtocolObject::refresh_values() {
+  for (int side = LEFT_SIDE; side <= RIGHT_SIDE; side++) {
+    values_frame &frame = values_frames_[side];
+    if (!frame.valid || frame.decoded) continue;
+    decode_values(frame.fields, frame.length, frame.mask, frame.values);
+    frame.decoded = true;
+
+    const vesc_values &values = frame.values;
+    if (side == LEFT_SIDE) {
+      left_tachometer_ = values.tach;
+      tachometer_received_ |= 0x01;
+      tachometer_ts_[LEFT_SIDE] = frame.received_ts;
+      robotstatus_.motor1_id = values.dev_id;
+      robotstatus_.motor1_current = values.input_current;
+      robotstatus_.motor1_rpm = values.rpm;
+      robotstatus_.motor1_temp = values.motor_temp;
+      robotstatus_.motor1_mos_temp = values.fet_temp;
+    } else {
+      right_tachometer_ = values.tach;
+      tachometer_received_ |= 0x02;
+      tachometer_ts_[RIGHT_SIDE] = frame.received_ts;
+      robotstatus_.motor2_id = values.dev_id;
+      robotstatus_.motor2_current = values.input_current;
+      robotstatus_.motor2_rpm = values.rpm;
+      robotstatus_.motor2_temp = values.motor_temp;
+      robotstatus_.motor2_mos_temp = values.fet_temp;
+    }
+    robotstatus_.battery1_voltage = values.v_in;
+    robotstatus_.battery1_current = values.input_current;
+    robotstatus_.robot_fault_flag = values.fault;
+    skid_control_->setBusVoltage(values.v_in);
+  }
+}
+
 bool Zero2ProtocolObject::is_connected() { return comm_base_->is_connected(); }
 
 int Zero2ProtocolObject::cycle_robot_mode() {
@@ -419,6 +775,16 @@ void Zero2ProtocolObject::register_comm_base(const char *device) {
       std::cerr << "error";
       throw(i);
     }
+  } else if (comm_type_ == "can") {
+    std::vector<uint8_t> setting;
+    try {
+      comm_base_ = std::make_unique<CommCan>(
+          device, [this](std::vector<uint8_t> c) { unpack_comm_response(c); },
+          setting);
+    } catch (int i) {
+      std::cerr << "error";
+      throw(i);
+    }
   } else {  // not supported device
     std::cerr << "not supported";
     throw(-2);
@@ -428,39 +794,23 @@ void Zero2ProtocolObject::register_comm_base(const char *device) {
 void Zero2ProtocolObject::send_getvalues_command(int sleeptime) {
   while (true) {
     if (comm_type_ == "serial") {
-      unsigned char *payloadptr;
-      uint16_t crc;
-      std::vector<uint8_t> write_buffer;
-      uint8_t MSG_SIZE = 1;
+      std::vector<uint8_t> payload = {COMM_GET_VALUES};
+      if (telemetry_mode_ == SELECTIVE_VALUES_POLLING) {
+        payload = {COMM_GET_VALUES_SELECTIVE,
+                   static_cast<uint8_t>(SELECTIVE_VALUES_MASK_ >> 24),
+                   static_cast<uint8_t>(SELECTIVE_VALUES_MASK_ >> 16),
+                   static_cast<uint8_t>(SELECTIVE_VALUES_MASK_ >> 8),
+                   static_cast<uint8_t>(SELECTIVE_VALUES_MASK_)};
+      }
       robotstatus_mutex_.lock();
-      uint8_t payload[1];
-      payload[0] = COMM_GET_VALUES;
-      payloadptr = payload;
-      write_buffer = {PAYLOAD_BYTE_SIZE_, MSG_SIZE, COMM_GET_VALUES};
-      crc = crc16(payloadptr, MSG_SIZE);
-      write_buffer.push_back(static_cast<uint8_t>(crc >> 8));
-      write_buffer.push_back(static_cast<uint8_t>(crc & 0xFF));
-      write_buffer.push_back(STOP_BYTE_);
-      comm_base_->write_to_device(write_buffer);
+      send_vesc_payload(LEFT_MOTOR, payload);
       robotstatus_mutex_.unlock();
 
       robotstatus_mutex_.lock();
-      uint8_t payload2[3];
-      payload2[0] = COMM_CAN_FORWARD;
-      payload2[1] = RIGHT_MOTOR;
-      payload2[2] = COMM_GET_VALUES;
-      payloadptr = payload2;
-      MSG_SIZE = 3;
-      write_buffer.clear();
-      write_buffer = {PAYLOAD_BYTE_SIZE_, MSG_SIZE, COMM_CAN_FORWARD,
-                      RIGHT_MOTOR, COMM_GET_VALUES};
-      crc = crc16(payloadptr, MSG_SIZE);
-      write_buffer.push_back(static_cast<uint8_t>(crc >> 8));
-      write_buffer.push_back(static_cast<uint8_t>(crc & 0xFF));
-      write_buffer.push_back(STOP_BYTE_);
-      comm_base_->write_to_device(write_buffer);
+      send_vesc_payload(RIGHT_MOTOR, payload);
       robotstatus_mutex_.unlock();
     } else if (comm_type_ == "can") {
+      /* both controllers broadcast their status, nothing to poll */
       return;
     } else {   //! How did you get here?
       return;  // TODO: Return error ?
@@ -469,9 +819,127 @@ void Zero2ProtocolObject::send_getvalues_command(int sleeptime) {
   }
 }
 
+void Zero2ProtocolObject::probe_firmware() {
+  const uint8_t vesc_ids[2] = {LEFT_MOTOR, RIGHT_MOTOR};
+  const std::string sides[2] = {"left", "right"};
+  if (comm_type_ == "can") {
+    /* the broadcasts are the only telemetry on CAN, nothing is polled */
+    robotstatus_mutex_.lock();
+    telemetry_mode_ = STATUS_BROADCAST;
+    robotstatus_mutex_.unlock();
+    bool broadcasting = false;
+    for (int waited_ms = 0;
+         waited_ms < STATUS_BROADCAST_TIMEOUT_MS_ && !broadcasting;
+         waited_ms += 10) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      robotstatus_mutex_.lock();
+      broadcasting = capabilities_[LEFT_SIDE].statusBroadcasts &&
+                     capabilities_[RIGHT_SIDE].statusBroadcasts;
+      robotstatus_mutex_.unlock();
+    }
+
+    robotstatus_mutex_.lock();
+    for (int side = LEFT_SIDE; side <= RIGHT_SIDE; side++) {
+      if (capabilities_[side].statusBroadcasts) {
+        std::cerr << sides[side] << " VESC broadcasts its status" << std::endl;
+      } else {
+        std::cerr << "error: " << sides[side] << " VESC (id "
+                  << int(vesc_ids[side])
+                  << ") sent no status broadcast, there is no telemetry from "
+                     "it until it does; enable STATUS_1 and STATUS_5 in its "
+                     "CAN settings"
+                  << std::endl;
+      }
+    }
+    robotstatus_mutex_.unlock();
+    return;
+  }
+
+  for (int side = LEFT_SIDE; side <= RIGHT_SIDE; side++) {
+    robotstatus_mutex_.lock();
+    probe_side_ = side;
+    firmware_[side] = {};
+    robotstatus_mutex_.unlock();
+
+    bool valid = false;
+    for (int attempt = 0; attempt < FIRMWARE_PROBE_ATTEMPTS_ && !valid;
+         attempt++) {
+      robotstatus_mutex_.lock();
+      send_vesc_payload(vesc_ids[side], {COMM_FW_VERSION});
+      robotstatus_mutex_.unlock();
+      for (int waited_ms = 0; waited_ms < FIRMWARE_PROBE_TIMEOUT_MS_ && !valid;
+           waited_ms += 10) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        robotstatus_mutex_.lock();
+        valid = firmware_[side].valid;
+        robotstatus_mutex_.unlock();
+      }
+    }
+
+    robotstatus_mutex_.lock();
+    capabilities_[side] = vesc::capabilitiesFromFirmware(firmware_[side]);
+    if (valid) {
+      std::cerr << sides[side] << " VESC firmware "
+                << int(firmware_[side].major) << "." << int(firmware_[side].minor)
+                << " on " << firmware_[side].hardware << std::endl;
+    } else {
+      std::cerr << sides[side] << " VESC did not report its firmware"
+                << std::endl;
+    }
+    robotstatus_mutex_.unlock();
+  }
+
+  /* both replies have to be decodable the same way */
+  robotstatus_mutex_.lock();
+  if (capabilities_[LEFT_SIDE].selectiveValues &&
+      capabilities_[RIGHT_SIDE].selectiveValues) {
+    telemetry_mode_ = SELECTIVE_VALUES_POLLING;
+    std::cerr << "polling selected VESC values for telemetry" << std::endl;
+  } else {
+    telemetry_mode_ = FULL_VALUES_POLLING;
+    std::cerr << "polling all VESC values for telemetry" << std::endl;
+  }
+  robotstatus_mutex_.unlock();
+}
+
+void Zero2ProtocolObject::send_vesc_payload(uint8_t vesc_id,
+                                            std::vector<uint8_t> payload) {
+  if (vesc_id != LEFT_MOTOR) {
+    payload.insert(payload.begin(), {COMM_CAN_FORWARD, vesc_id});
+  }
+  std::vector<uint8_t> write_buffer = {PAYLOAD_BYTE_SIZE_,
+                                       static_cast<uint8_t>(payload.size())};
+  write_buffer.insert(write_buffer.end(), payload.begin(), payload.end());
+  uint16_t crc = crc16(payload.data(), payload.size());
+  write_buffer.push_back(static_cast<uint8_t>(crc >> 8));
+  write_buffer.push_back(static_cast<uint8_t>(crc & 0xFF));
+  write_buffer.push_back(STOP_BYTE_);
+  comm_base_->write_to_device(write_buffer);
+}
+
 void Zero2ProtocolObject::send_motors_commands() {
+  if (comm_type_ == "can") {
+    /* address each controller directly instead of forwarding through the left
+     * one */
+    robotstatus_mutex_.lock();
+    float left_duty = motors_speeds_[LEFT_SIDE];
+    float right_duty = motors_speeds_[RIGHT_SIDE];
+    robotstatus_mutex_.unlock();
+    comm_base_->write_to_device(
+        vescArray_.buildCommandMessage((vesc::vescChannelCommand){
+            .vescId = LEFT_MOTOR,
+            .commandType = vesc::vescPacketFlags::DUTY,
+            .commandValue = left_duty}));
+    comm_base_->write_to_device(
+        vescArray_.buildCommandMessage((vesc::vescChannelCommand){
+            .vescId = RIGHT_MOTOR,
+            .commandType = vesc::vescPacketFlags::DUTY,
+            .commandValue = right_duty}));
+    return;
+  }
+
   robotstatus_mutex_.lock();
-  int32_t v = static_cast<int32_t>(motors_speeds_[LEFT_MOTOR] * 100000.0);
+  int32_t v = static_cast<int32_t>(motors_speeds_[LEFT_SIDE] * 100000.0);
   unsigned char *payloadptr;
   uint8_t payload[5];
   payload[0] = COMM_SET_DUTY;
@@ -498,7 +966,7 @@ void Zero2ProtocolObject::send_motors_commands() {
   write_buffer.clear();
   robotstatus_mutex_.lock();
   // WIP
-  v = static_cast<int32_t>(motors_speeds_[RIGHT_MOTOR] * 100000.0);
+  v = static_cast<int32_t>(motors_speeds_[RIGHT_SIDE] * 100000.0);
   unsigned char payload2[7];
   payload2[0] = COMM_CAN_FORWARD;
   payload2[1] = RIGHT_MOTOR;
@@ -0,0 +1,373 @@
+#include <math.h>
+#include <stdio.h>
+
+#include <chrono>
+#include <memory>
+#include <thread>
+
+#include "protocol_pro_2.hpp"
+#include "protocol_zero_2.hpp"
+#include "utilities.hpp"
+using namespace RoverRobotics;
+
+/*
+ * Drive-system identification. Commands scripted duty steps, a chirp and a
+ * slow ramp through set_robot_velocity in OPEN_LOOP mode, records the wheel
+ * rpm and current, and fits a first order plus dead time model (and a
+ * critically damped second order one) to each wheel. The ramp gives the
+ * breakaway duty of each wheel. The result is printed in the key:value format
+ * of the persistent params file, which the protocols load into the plant
+ * model used for latency compensation and the deadband compensation.
+ *
+ * Each wheel is fitted against the duty the protocol reports to have sent to
+ * its motor controller, so the trim, the automatic trim and the voltage
+ * compensation scaling the commanded duty do not bias the model.
+ *
+ * usage: sysid.out <pro2|zero2> <device> <comm_type> [amplitude] [log.csv]
+ *        [--write]
+ *
+ * The robot drives forward and backward by a few meters; lift the wheels or
+ * make room before starting. The persisted breakaway duties lift small
+ * duties to the breakaway, so reset them first to measure it again.
+ */
+
+/* what the tool needs to know to turn duty into a velocity command */
+struct sysid_robot {
+  float wheel_radius;            /* m */
+  float open_loop_max_rpm;       /* wheel rpm at full duty */
+  float rpm_to_wheel_rpm;        /* scale from the reported rpm */
+  std::vector<std::string> wheels; /* reported motors, in motorN order */
+  std::vector<std::string> duty_metrics; /* applied duty, in motorN order */
+};
+
+struct sysid_sample {
+  float time;
+  float command;              /* duty of the experiment */
+  std::array<float, 4> duty;  /* duty applied to each wheel */
+  std::array<float, 4> rpm;
+  std::array<float, 4> current;
+  float voltage;
+};
+
+struct sysid_fit {
+  uint8_t order;
+  float gain;
+  float time_constant;
+  float dead_time;
+  float fit; /* % of the variance explained */
+};
+
+const float SAMPLE_PERIOD_ = 0.02;  /* s */
+const float DEFAULT_AMPLITUDE_ = 0.15;
+const float MAX_DEAD_TIME_ = 0.5;   /* s */
+const float DEAD_TIME_STEP_ = 0.01; /* s */
+const float MIN_TIME_CONSTANT_ = 0.01; /* s */
+const float MAX_TIME_CONSTANT_ = 2.0;  /* s */
+const int TIME_CONSTANT_STEPS_ = 60;
+/* a second order model must explain this much more to be reported */
+const float SECOND_ORDER_IMPROVEMENT_ = 0.8;
+/* a wheel turns once it exceeds this share of its open loop max rpm */
+const float BREAKAWAY_RPM_FRACTION_ = 0.01;
+
+/*
+ * @brief duty of the experiment at a given time: alternating steps of one and
+ * two amplitudes in both directions, a 0.2-3 Hz chirp, then a ramp from zero
+ * to the amplitude which starts at ramp_start
+ */
+float experiment_duty(float time, float amplitude, float &ramp_start,
+                      float &duration) {
+  const std::vector<std::pair<float, float>> steps = {
+      {1.0, 0},          {1.5, amplitude},  {2.0, 0},
+      {1.5, -amplitude}, {2.0, 0},          {1.5, 2 * amplitude},
+      {2.0, 0},          {1.5, -2 * amplitude}, {2.0, 0}};
+  const float CHIRP_TIME = 10;
+  const float CHIRP_START_HZ = 0.2;
+  const float CHIRP_END_HZ = 3.0;
+  const float REST_TIME = 1.0;
+  const float RAMP_TIME = 4.0;
+
+  float step_time = 0;
+  for (auto step : steps) step_time += step.first;
+  ramp_start = step_time + CHIRP_TIME + REST_TIME;
+  duration = ramp_start + RAMP_TIME + REST_TIME;
+
+  float elapsed = 0;
+  for (auto step : steps) {
+    elapsed += step.first;
+    if (time < elapsed) return step.second;
+  }
+
+  float chirp_time = time - step_time;
+  if (chirp_time <= CHIRP_TIME) {
+    float rate = (CHIRP_END_HZ - CHIRP_START_HZ) / CHIRP_TIME;
+    return amplitude * sin(2 * M_PI *
+                           (CHIRP_START_HZ * chirp_time +
+                            0.5 * rate * pow(chirp_time, 2)));
+  }
+
+  float ramp_time = time - ramp_start;
+  if (ramp_time < 0 || ramp_time > RAMP_TIME) return 0;
+  return amplitude * ramp_time / RAMP_TIME;
+}
+
+/*
+ * @brief unit gain response of the model to the duty applied to a wheel
+ */
+std::vector<float> simulate(const std::vector<sysid_sample> &samples,
+                            int wheel, uint8_t order, float time_constant,
+                            float dead_time) {
+  std::vector<float> response(samples.size(), 0);
+  float state_1 = 0;
+  float state_2 = 0;
+  size_t delayed = 0;
+  for (size_t i = 1; i < samples.size(); i++) {
+    float dt = samples[i].time - samples[i - 1].time;
+
+    /* latest duty applied at least dead_time ago */
+    while (delayed + 1 < i &&
+           samples[delayed + 1].time <= samples[i].time - dead_time) {
+      delayed++;
+    }
+    float input =
+        samples[i].time - dead_time >= samples[0].time
+            ? samples[delayed].duty[wheel]
+            : 0;
+
+    float alpha = 1 - exp(-dt / time_constant);
+    state_1 += alpha * (input - state_1);
+    state_2 += alpha * (state_1 - state_2);
+    response[i] = order == 1 ? state_1 : state_2;
+  }
+  return response;
+}
+
+/*
+ * @brief grid search on time constant and dead time, with the gain solved by
+ * least squares for each candidate
+ */
+sysid_fit fit_model(const std::vector<sysid_sample> &samples, int wheel,
+                    uint8_t order) {
+  double variance = 0;
+  double mean = 0;
+  for (auto &sample : samples) mean += sample.rpm[wheel];
+  mean /= samples.size();
+  for (auto &sample : samples) variance += pow(sample.rpm[wheel] - mean, 2);
+
+  sysid_fit best = {order, 0, 0, 0, -std::numeric_limits<float>::max()};
+  for (int i = 0; i < TIME_CONSTANT_STEPS_; i++) {
+    float time_constant =
+        MIN_TIME_CONSTANT_ *
+        pow(MAX_TIME_CONSTANT_ / MIN_TIME_CONSTANT_,
+            static_cast<float>(i) / (TIME_CONSTANT_STEPS_ - 1));
+    for (float dead_time = 0; dead_time <= MAX_DEAD_TIME_;
+         dead_time += DEAD_TIME_STEP_) {
+      auto response = simulate(samples, wheel, order, time_constant, dead_time);
+
+      double cross = 0;
+      double power = 0;
+      for (size_t k = 0; k < samples.size(); k++) {
+        cross += response[k] * samples[k].rpm[wheel];
+        power += response[k] * response[k];
+      }
+      if (power <= 0) continue;
+      float gain = cross / power;
+
+      double error = 0;
+      for (size_t k = 0; k < samples.size(); k++) {
+        error += pow(samples[k].rpm[wheel] - gain * response[k], 2);
+      }
+      float fit = 100 * (1 - error / variance);
+      if (fit > best.fit) best = {order, gain, time_constant, dead_time, fit};
+    }
+  }
+  return best;
+}
+
+int main(int argc, char *argv[]) {
+  /* --write stores the model in the persistent params file */
+  std::vector<std::string> args;
+  bool write_params = false;
+  for (int i = 1; i < argc; i++) {
+    if (std::string(argv[i]) == "--write") {
+      write_params = true;
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+  if (args.size() < 3) {
+    std::cerr << "usage: sysid.out <pro2|zero2> <device> <comm_type> "
+                 "[amplitude] [log.csv] [--write]"
+              << std::endl;
+    return 1;
+  }
+  std::string robot_type = args[0];
+  float amplitude = args.size() > 3 ? std::stof(args[3]) : DEFAULT_AMPLITUDE_;
+  std::string log_path = args.size() > 4 ? args[4] : "";
+  std::string param_path = std::string(std::getenv("HOME")) + "/robot.config";
+
+  /* keep in sync with the protocol constants */
+  sysid_robot robot;
+  std::unique_ptr<BaseProtocolObject> robot_;
+  Control::pid_gains gains = {0, 0, 0};
+  Control::angular_scaling_params angular_scaling_params = {0, 1, 0, 1, 1};
+  if (robot_type == "pro2") {
+    robot = {0.1397,
+             600,
+             1,
+             {"fl", "fr", "rl", "rr"},
+             {"front_left_duty", "front_right_duty", "back_left_duty",
+              "back_right_duty"}};
+    robot_ = std::make_unique<Pro2ProtocolObject>(
+        args[1].c_str(), args[2], Control::OPEN_LOOP, gains,
+        angular_scaling_params);
+  } else if (robot_type == "zero2") {
+    robot = {0.2667,
+             17000.0 / (96 * 2),
+             1.0 / (96 * 2),
+             {"left", "right"},
+             {"left_duty", "right_duty"}};
+    robot_ = std::make_unique<Zero2ProtocolObject>(
+        args[1].c_str(), args[2], Control::OPEN_LOOP, gains,
+        angular_scaling_params);
+  } else {
+    std::cerr << "unknown robot " << robot_type << std::endl;
+    return 1;
+  }
+
+  /* velocity which the open loop controller turns into a unit duty */
+  float duty_to_velocity =
+      robot.open_loop_max_rpm * RPM_TO_RADS_SEC * robot.wheel_radius;
+
+  std::cerr << "running the identification experiment, the robot will move"
+            << std::endl;
+  std::vector<sysid_sample> samples;
+  auto time_start = std::chrono::steady_clock::now();
+  float ramp_start = 0;
+  float duration = 0;
+  float time = 0;
+  do {
+    time = std::chrono::duration<float>(std::chrono::steady_clock::now() -
+                                        time_start)
+               .count();
+    float duty = experiment_duty(time, amplitude, ramp_start, duration);
+    double controlarray[2] = {duty * duty_to_velocity, 0};
+    robot_->set_robot_velocity(controlarray);
+
+    auto status = robot_->status_request();
+    std::array<float, 4> applied = {0, 0, 0, 0};
+    for (auto &metric : robot_->metrics_request()) {
+      for (size_t wheel = 0; wheel < robot.duty_metrics.size(); wheel++) {
+        if (metric.first == robot.duty_metrics[wheel]) {
+          applied[wheel] = metric.second;
+        }
+      }
+    }
+    samples.push_back(
+        {time,
+         duty,
+         applied,
+         {status.motor1_rpm * robot.rpm_to_wheel_rpm,
+          status.motor2_rpm * robot.rpm_to_wheel_rpm,
+          status.motor3_rpm * robot.rpm_to_wheel_rpm,
+          status.motor4_rpm * robot.rpm_to_wheel_rpm},
+         {static_cast<float>(status.motor1_current),
+          static_cast<float>(status.motor2_current),
+          static_cast<float>(status.motor3_current),
+          static_cast<float>(status.motor4_current)},
+         static_cast<float>(status.battery1_voltage)});
+    std::this_thread::sleep_for(
+        std::chrono::milliseconds(static_cast<int>(SAMPLE_PERIOD_ * 1000)));
+  } while (time < duration);
+
+  double stop[2] = {0, 0};
+  robot_->set_robot_velocity(stop);
+
+  /* raw data for the simulation and offline fitting */
+  if (!log_path.empty()) {
+    std::ofstream log_file(log_path);
+    log_file << "time,command,duty1,duty2,duty3,duty4,rpm1,rpm2,rpm3,rpm4,"
+                "current1,current2,current3,current4,voltage"
+             << std::endl;
+    for (auto &sample : samples) {
+      log_file << sample.time << "," << sample.command;
+      for (auto duty : sample.duty) log_file << "," << duty;
+      for (auto rpm : sample.rpm) log_file << "," << rpm;
+      for (auto current : sample.current) log_file << "," << current;
+      log_file << "," << sample.voltage << std::endl;
+    }
+  }
+
+  /* the ramp is dominated by friction, keep it out of the linear fit */
+  std::vector<sysid_sample> linear_samples;
+  for (auto &sample : samples) {
+    if (sample.time < ramp_start) linear_samples.push_back(sample);
+  }
+
+  /* fit each wheel; the first order fit feeds the predictor */
+  Control::plant_model mean_model = {0, 0, 0};
+  std::vector<float> breakaway_duties;
+  for (size_t wheel = 0; wheel < robot.wheels.size(); wheel++) {
+    sysid_fit first = fit_model(linear_samples, wheel, 1);
+    sysid_fit second = fit_model(linear_samples, wheel, 2);
+    std::string name = robot.wheels[wheel];
+
+    /* duty applied a dead time before the wheel first turned on the ramp */
+    float breakaway_duty = 0;
+    for (auto &sample : samples) {
+      if (sample.time < ramp_start ||
+          std::abs(sample.rpm[wheel]) <
+              BREAKAWAY_RPM_FRACTION_ * robot.open_loop_max_rpm) {
+        continue;
+      }
+      for (auto &applied : samples) {
+        if (applied.time > sample.time - first.dead_time) break;
+        breakaway_duty = applied.duty[wheel];
+      }
+      break;
+    }
+    breakaway_duties.push_back(breakaway_duty);
+
+    std::cout << "plant_gain_" << name << ":" << first.gain << std::endl
+              << "plant_time_constant_" << name << ":" << first.time_constant
+              << std::endl
+              << "plant_dead_time_" << name << ":" << first.dead_time
+              << std::endl
+              << "plant_fit_" << name << ":" << first.fit << std::endl
+              << "breakaway_duty_" << name << ":" << breakaway_duty
+              << std::endl;
+    if (100 - second.fit < SECOND_ORDER_IMPROVEMENT_ * (100 - first.fit)) {
+      std::cout << "plant_second_order_time_constant_" << name << ":"
+                << second.time_constant << std::endl
+                << "plant_second_order_dead_time_" << name << ":"
+                << second.dead_time << std::endl
+                << "plant_second_order_fit_" << name << ":" << second.fit
+                << std::endl;
+    }
+
+    mean_model.gain += first.gain / robot.wheels.size();
+    mean_model.time_constant += first.time_constant / robot.wheels.size();
+    mean_model.dead_time += first.dead_time / robot.wheels.size();
+  }
+  /* the gain holds at the voltage it was measured at */
+  float voltage = 0;
+  for (auto &sample : samples) voltage += sample.voltage / samples.size();
+
+  std::cout << "plant_gain:" << mean_model.gain << std::endl
+            << "plant_time_constant:" << mean_model.time_constant << std::endl
+            << "plant_dead_time:" << mean_model.dead_time << std::endl
+            << "plant_voltage:" << voltage << std::endl;
+
+  if (write_params) {
+    Utilities::PersistentParams persistent_params(param_path);
+    persistent_params.write_param("plant_gain", mean_model.gain);
+    persistent_params.write_param("plant_time_constant",
+                                  mean_model.time_constant);
+    persistent_params.write_param("plant_dead_time", mean_model.dead_time);
+    if (voltage > 0) persistent_params.write_param("plant_voltage", voltage);
+    for (size_t wheel = 0; wheel < robot.wheels.size(); wheel++) {
+      persistent_params.write_param("breakaway_duty_" + robot.wheels[wheel],
+                                    breakaway_duties[wheel]);
+    }
+  }
+  return 0;
+}
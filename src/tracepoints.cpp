@@ -0,0 +1,17 @@
+#include "tracepoints.hpp"
+
+#ifdef LIBROVER_TRACEPOINTS
+/* the semaphores live in the library, raised by an attached tracer */
+#define LIBROVER_DEFINE_SEMAPHORE(probe)                                       \
+  __extension__ unsigned short librover_##probe##_semaphore                    \
+      __attribute__((unused)) __attribute__((section(".probes"))) = 0
+
+extern "C" {
+LIBROVER_DEFINE_SEMAPHORE(frame_receive);
+LIBROVER_DEFINE_SEMAPHORE(parse_complete);
+LIBROVER_DEFINE_SEMAPHORE(control_begin);
+LIBROVER_DEFINE_SEMAPHORE(control_end);
+LIBROVER_DEFINE_SEMAPHORE(command_enqueue);
+LIBROVER_DEFINE_SEMAPHORE(tx_write);
+}
+#endif
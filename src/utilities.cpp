@@ -2,6 +2,174 @@
 #include <algorithm>
 namespace Utilities {
 
+/* every live profiled lock, for the metrics */
+static std::mutex &registryMutex() {
+  static std::mutex registry_mutex;
+  return registry_mutex;
+}
+
+static std::vector<ProfiledMutex *> &registry() {
+  static std::vector<ProfiledMutex *> profiled_mutexes;
+  return profiled_mutexes;
+}
+
+#ifdef PROFILE_LOCKS
+std::atomic<bool> ProfiledMutex::profiling_(true);
+#else
+std::atomic<bool> ProfiledMutex::profiling_(
+    std::getenv("LIBROVER_PROFILE_LOCKS") != nullptr);
+#endif
+
+ProfiledMutex::ProfiledMutex(std::string name)
+    : name_(name),
+      holder_site_(-1),
+      acquisitions_(0),
+      contended_(0),
+      wait_max_(0),
+      hold_max_(0),
+      wait_histogram_({0}),
+      hold_histogram_({0}),
+      site_count_(0) {
+  std::scoped_lock lock(registryMutex());
+  registry().push_back(this);
+}
+
+ProfiledMutex::~ProfiledMutex() {
+  std::scoped_lock lock(registryMutex());
+  auto &profiled_mutexes = registry();
+  profiled_mutexes.erase(
+      std::remove(profiled_mutexes.begin(), profiled_mutexes.end(), this),
+      profiled_mutexes.end());
+}
+
+void ProfiledMutex::lock(const char *file, int line) {
+  if (!profiling_.load(std::memory_order_relaxed)) {
+    mutex_.lock();
+    holder_site_ = -1;
+    return;
+  }
+
+  /* only a failed attempt is a contended acquisition */
+  auto wait_start = std::chrono::steady_clock::now();
+  bool contended = !mutex_.try_lock();
+  if (contended) mutex_.lock();
+  recordAcquisition_(file, line, contended, wait_start);
+}
+
+bool ProfiledMutex::try_lock(const char *file, int line) {
+  if (!mutex_.try_lock()) return false;
+
+  if (!profiling_.load(std::memory_order_relaxed)) {
+    holder_site_ = -1;
+    return true;
+  }
+  recordAcquisition_(file, line, false, std::chrono::steady_clock::now());
+  return true;
+}
+
+void ProfiledMutex::unlock() {
+  /* a lock taken while profiling was off is not timed */
+  if (holder_site_ >= 0) {
+    double hold_time = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - hold_start_)
+                           .count();
+    std::scoped_lock lock(stats_mutex_);
+    hold_max_ = std::max(hold_max_, hold_time);
+    hold_histogram_[bucket_(hold_time)]++;
+    sites_[holder_site_].hold_time += hold_time;
+  }
+  mutex_.unlock();
+}
+
+void ProfiledMutex::setProfiling(bool enabled) { profiling_ = enabled; }
+
+bool ProfiledMutex::getProfiling() { return profiling_; }
+
+std::vector<std::pair<std::string, double>> ProfiledMutex::metrics() {
+  std::vector<std::pair<std::string, double>> metrics;
+  std::scoped_lock lock(registryMutex());
+  for (ProfiledMutex *profiled_mutex : registry()) {
+    profiled_mutex->appendMetrics_(metrics);
+  }
+  return metrics;
+}
+
+void ProfiledMutex::recordAcquisition_(
+    const char *file, int line, bool contended,
+    std::chrono::steady_clock::time_point wait_start) {
+  hold_start_ = std::chrono::steady_clock::now();
+  double wait_time =
+      std::chrono::duration<double>(hold_start_ - wait_start).count();
+
+  std::scoped_lock lock(stats_mutex_);
+
+  /* the sites are few, a linear search on the literal is enough */
+  int site = 0;
+  while (site < site_count_ &&
+         (sites_[site].file != file || sites_[site].line != line)) {
+    site++;
+  }
+  if (site == site_count_) {
+    if (site_count_ < MAX_SITES_) {
+      sites_[site] = {file, line, 0, 0, 0, 0};
+      site_count_++;
+    } else {
+      site = MAX_SITES_ - 1;
+    }
+  }
+  holder_site_ = site;
+
+  acquisitions_++;
+  wait_max_ = std::max(wait_max_, wait_time);
+  wait_histogram_[bucket_(wait_time)]++;
+  sites_[site].acquisitions++;
+  if (contended) {
+    contended_++;
+    sites_[site].contended++;
+    sites_[site].wait_time += wait_time;
+  }
+}
+
+int ProfiledMutex::bucket_(double seconds) {
+  int bucket = 0;
+  for (double bound = 1e-6; bucket < HISTOGRAM_BUCKETS_ - 1 && seconds > bound;
+       bound *= 10) {
+    bucket++;
+  }
+  return bucket;
+}
+
+void ProfiledMutex::appendMetrics_(
+    std::vector<std::pair<std::string, double>> &metrics) {
+  std::scoped_lock lock(stats_mutex_);
+  if (acquisitions_ == 0) return;
+
+  const std::string prefix = "lock_" + name_ + "_";
+  const std::string buckets[HISTOGRAM_BUCKETS_] = {
+      "le_1us", "le_10us", "le_100us", "le_1ms", "le_10ms", "gt_10ms"};
+  metrics.push_back({prefix + "acquisitions", acquisitions_});
+  metrics.push_back({prefix + "contended", contended_});
+  metrics.push_back({prefix + "wait_max", wait_max_});
+  metrics.push_back({prefix + "hold_max", hold_max_});
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS_; bucket++) {
+    metrics.push_back(
+        {prefix + "wait_" + buckets[bucket], wait_histogram_[bucket]});
+    metrics.push_back(
+        {prefix + "hold_" + buckets[bucket], hold_histogram_[bucket]});
+  }
+
+  /* call sites by file name and line */
+  for (int site = 0; site < site_count_; site++) {
+    std::string file = sites_[site].file;
+    std::string site_name =
+        prefix + file.substr(file.find_last_of('/') + 1) + ":" +
+        std::to_string(sites_[site].line) + "_";
+    metrics.push_back({site_name + "contended", sites_[site].contended});
+    metrics.push_back({site_name + "wait_time", sites_[site].wait_time});
+    metrics.push_back({site_name + "hold_time", sites_[site].hold_time});
+  }
+}
+
 PersistentParams::PersistentParams(std::string robot_param_path) {
   robot_param_path_ = robot_param_path;
 }
@@ -201,4 +201,21 @@ double OdomControl::deadbandOffset(double motor_speed, double deadband_offset) {
   }
 }
 
+SigmaDeltaQuantizer::SigmaDeltaQuantizer() : residual_(0) {}
+
+int SigmaDeltaQuantizer::quantize(double value, int max, int min) {
+  double target = value + residual_;
+  int command = std::round(target);
+  if (command > max) command = max;
+  if (command < min) command = min;
+
+  // Saturation would otherwise pile up error that is paid back much later
+  residual_ = target - command;
+  if (residual_ > 1) residual_ = 1;
+  if (residual_ < -1) residual_ = -1;
+  return command;
+}
+
+void SigmaDeltaQuantizer::reset() { residual_ = 0; }
+
 }  // namespace RoverRobotics
@@ -4,6 +4,19 @@
 
 namespace vesc {
 
+vescCapabilities capabilitiesFromFirmware(vescFirmware firmware) {
+  auto at_least = [&firmware](uint8_t major, uint8_t minor) {
+    return firmware.valid && (firmware.major > major ||
+                              (firmware.major == major &&
+                               firmware.minor >= minor));
+  };
+  return (vescCapabilities){
+      .selectiveValues = at_least(SELECTIVE_VALUES_MIN_FW_MAJOR,
+                                  SELECTIVE_VALUES_MIN_FW_MINOR),
+      .statusBroadcasts = at_least(STATUS_BROADCASTS_MIN_FW_MAJOR,
+                                   STATUS_BROADCASTS_MIN_FW_MINOR)};
+}
+
 BridgedVescArray::BridgedVescArray(std::vector<uint8_t> vescIds) {
   vescIds_ = vescIds;
 }
@@ -34,13 +47,42 @@ vescChannelStatus BridgedVescArray::parseReceivedMessage(
     float duty = ((float)duty_scaled) * DUTY_SCALING_FACTOR;
 
     return (vescChannelStatus){.vescId = vescId,
+                               .packetType = vescPacketFlags::RPM,
                                .current = current,
                                .rpm = rpm,
                                .duty = duty,
+                               .tachometer = 0,
+                               .voltage = 0,
                                .dataValid = true};
-  } else {
+  } else if ((full_msg & CONTENT_MASK) ==
+             (vescPacketFlags::PACKET_FLAG | vescPacketFlags::STATUS_5)) {
+    uint8_t vescId = full_msg & ID_MASK;
+
+    /* combine shifted byte values into a single tachometer value */
+    int32_t tachometer = (robotmsg[5] << 24) | (robotmsg[6] << 16) |
+                         (robotmsg[7] << 8) | (robotmsg[8]);
+
+    /* combine shifted byte values into a single input voltage value */
+    int16_t voltage_scaled = (robotmsg[9] << 8) | (robotmsg[10]);
+
     return (vescChannelStatus){
-        .vescId = 0, .current = 0, .rpm = 0, .duty = 0, .dataValid = false};
+        .vescId = vescId,
+        .packetType = vescPacketFlags::STATUS_5,
+        .current = 0,
+        .rpm = 0,
+        .duty = 0,
+        .tachometer = tachometer,
+        .voltage = ((float)voltage_scaled) * VOLTAGE_SCALING_FACTOR,
+        .dataValid = true};
+  } else {
+    return (vescChannelStatus){.vescId = 0,
+                               .packetType = vescPacketFlags::PACKET_FLAG,
+                               .current = 0,
+                               .rpm = 0,
+                               .duty = 0,
+                               .tachometer = 0,
+                               .voltage = 0,
+                               .dataValid = false};
   }
 }
 